@@ -0,0 +1,134 @@
+// Arenas
+//
+// An arena takes memory from the heap in large blocks and hands it out by
+// bumping an offset, so allocating costs a few instructions and freeing costs
+// nothing until the arena is reset or destroyed. The compiler keeps one arena
+// per phase, and everything a phase allocates lives until the phase ends.
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "error.h"
+#include "utils.h"
+
+// Every allocation is aligned for any object type
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(n) (((n) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+// The data of a block starts after its header
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(ArenaBlock))
+
+static ArenaBlock *arena_block_create(size_t);
+
+// Create an arena that takes memory from the heap in blocks of the given
+// size. A block size of 0 selects ARENA_BLOCK_SIZE.
+
+Arena *arena_create(size_t block_size)
+{
+    Arena *arena;
+
+    arena = (Arena*)emalloc(sizeof(*arena));
+    arena->head = NULL;
+    arena->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+    return arena;
+}
+
+// Allocate memory from an arena
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    ArenaBlock *block;
+    void *p;
+
+    size = ARENA_ALIGN(size);
+    block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        if (size > arena->block_size / 4) {
+            // A large object gets a block of its own. It goes behind the
+            // current block, so the space left in the current block is
+            // still used.
+            block = arena_block_create(size);
+            block->used = size;
+            if (arena->head == NULL) {
+                arena->head = block;
+            }
+            else {
+                block->next = arena->head->next;
+                arena->head->next = block;
+            }
+            return (char*)block + ARENA_HEADER_SIZE;
+        }
+        block = arena_block_create(arena->block_size);
+        block->next = arena->head;
+        arena->head = block;
+    }
+    p = (char*)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return p;
+}
+
+// Copy len characters of a string to an arena, and terminate the copy
+
+char *arena_substr(Arena *arena, const char *s, size_t len)
+{
+    char *p;
+
+    p = (char*)arena_alloc(arena, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+// Copy a string to an arena
+
+char *arena_dupstr(Arena *arena, const char *s)
+{
+    return arena_substr(arena, s, strlen(s));
+}
+
+// Release everything allocated from an arena. One block is kept for the
+// arena to start over with.
+
+void arena_reset(Arena *arena)
+{
+    ArenaBlock *block;
+    ArenaBlock *next;
+
+    block = arena->head;
+    while (block != NULL && (block->next != NULL || block->size != arena->block_size)) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+    if (block != NULL) {
+        block->used = 0;
+    }
+    arena->head = block;
+}
+
+// Destroy an arena and everything allocated from it
+
+void arena_destroy(Arena *arena)
+{
+    ArenaBlock *block;
+    ArenaBlock *next;
+
+    for (block = arena->head; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+// Take a block from the heap
+
+static ArenaBlock *arena_block_create(size_t size)
+{
+    ArenaBlock *block;
+
+    block = (ArenaBlock*)emalloc(ARENA_HEADER_SIZE + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
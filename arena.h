@@ -0,0 +1,32 @@
+#ifndef __PARTICLE_ARENA_H__
+#define __PARTICLE_ARENA_H__
+
+#include <stddef.h>
+
+// The size of the blocks an arena takes from the heap, unless told otherwise
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// A block of arena memory
+typedef struct ArenaBlock {
+    struct ArenaBlock *next; // the block filled before this one
+    size_t size;             // the number of bytes of data in the block
+    size_t used;             // the number of bytes handed out from the block
+} ArenaBlock;
+
+// An arena hands out memory for objects that share one lifetime, such as a
+// compiler phase. Objects are never freed one by one; the whole arena is
+// reset or destroyed at once.
+typedef struct Arena {
+    ArenaBlock *head;  // the block memory is currently handed out from
+    size_t block_size; // the size of the blocks taken from the heap
+} Arena;
+
+// Arena operations
+Arena *arena_create(size_t);
+void *arena_alloc(Arena *, size_t);
+char *arena_substr(Arena *, const char *, size_t);
+char *arena_dupstr(Arena *, const char *);
+void arena_reset(Arena *);
+void arena_destroy(Arena *);
+
+#endif /* __PARTICLE_ARENA_H__ */
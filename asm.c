@@ -1,41 +1,1172 @@
+// The Particle assembler
+//
+// The assembler reads text assembly into an assembly source (see ir.h) and
+// assembles an assembly source into machine code. By default it makes two
+// passes. Pass one walks the lines with a location counter, sizes every
+// instruction and directive, and enters labels and equates in a symbol table.
+// Pass two encodes each line into a code image in memory, looking up symbol
+// operands in the table. In one-pass mode, lines are encoded as they are
+// reached and forward references are patched when their labels are defined.
+// The encoding follows doc/vm.md: an instruction is a big-endian word holding
+// the opcode and operand-size class, followed by a big-endian immediate of the
+// operand size.
+//
+// Code can also be assembled as relocatable code, which starts at address 0
+// and leaves the operands that refer to labels for the linker to fill in once
+// the code has been placed among other code.
+
 #include <stdarg.h>
 #include <string.h>
 #include "asm.h"
 #include "file.h"
 #include "token.h"
 #include "lexer.h"
+#include "arena.h"
+#include "ir.h"
+#include "keyword.h"
+#include "symtab.h"
+#include "opcode.h"
+#include "object.h"
 #include "utils.h"
 #include "error.h"
 #include "debug.h"
 
+// The size of the code segment, into which the program must fit
+#define CODE_SEGMENT_SIZE (1024 * 1024)
+
+// The size of an instruction word
+#define INSTRUCTION_SIZE 2
+
+// Operand-size classes
+#define OPERAND_SIZE_NONE  0
+#define OPERAND_SIZE_BYTE  1
+#define OPERAND_SIZE_WORD  2
+#define OPERAND_SIZE_DWORD 3
+
+// The number of bytes of an operand of each size class
+#define OPERAND_BYTES(sc) ((sc) == OPERAND_SIZE_NONE ? 0 : 1 << ((sc) - 1))
+
+// The largest value that fits in an operand of the given number of bytes
+#define OPERAND_MAX(bytes) (0xFFFFFFFFUL >> (32 - 8 * (bytes)))
+
+// The size a code image that grows starts at: a program, or relocatable code,
+// which is usually a single function
+#define ASM_CODE_INITIAL_SIZE (64 * 1024)
+#define ASM_UNIT_INITIAL_SIZE 256
+
+// Directives. They are numbered after the opcodes so that both share one
+// mnemonic table.
+#define DIRECTIVE_DB  0x100 // define bytes
+#define DIRECTIVE_DW  0x101 // define words
+#define DIRECTIVE_DD  0x102 // define dwords
+#define DIRECTIVE_EQU 0x103 // define a symbol
+#define DIRECTIVE_ORG 0x104 // set the location counter
+#define DIRECTIVE_ENTRY 0x105 // set the entry point
+
+// The longest mnemonic
+#define MNEMONIC_MAX_LENGTH 15
+
+// The size of the blocks the names of relocatable code are allocated in
+#define ASM_NAMES_BLOCK_SIZE 512
+
 static bool match(TokenType);
 static void program();
 static void linen();
 static bool is_linen(TokenType);
 static void line();
 static bool is_line(TokenType);
-static void constant();
+static bool is_name(TokenType);
+static void constant(IrLine *);
 static bool is_constant(TokenType);
+static Code *assemble_code(Ir *);
+static void assemble_two_pass();
+static void assemble_one_pass();
+static void define(IrLine *, int);
+static void encode(IrLine *, int);
+static int mnemonic_lookup(IrLine *);
+static unsigned long line_size(IrLine *, int);
+static unsigned long operand_value(IrLine *, unsigned long);
+static void emit_operand(IrLine *, unsigned long, int);
+static unsigned int first_reference(Symbol *);
+static void code_reserve(unsigned long);
+static void emit_value(unsigned long, unsigned long, int);
+static Code *code_create(void);
+static void add_symbol(const char *, size_t, int, unsigned long);
+static void add_relocation(const char *, size_t, unsigned long, int);
+static unsigned char *read_section(File *, const Section *);
+static unsigned char *write_records(Code *, unsigned long, size_t *);
+static bool read_records(unsigned long, const unsigned char *, size_t);
+static bool read_pieces(const unsigned char *, size_t);
 
-static File *objfile;
 static Lexer *lexer;
+static Arena *arena; // memory that lasts as long as reading the assembly
 static Token *look;
+static Ir *ir;       // the assembly read from text
 
-File *assemble(File *file)
+// Mnemonics of instructions and directives. The instruction mnemonics are the
+// opcode names of opcode.h in lowercase.
+static const Keyword mnemonic_keywords[] = {
+    // Stack
+    { "pushbi", OC_PUSHBI }, { "pushwi", OC_PUSHWI }, { "pushdi", OC_PUSHDI },
+    { "pushsp", OC_PUSHSP }, { "pushfp", OC_PUSHFP },
+    { "popbi",  OC_POPBI },  { "popwi",  OC_POPWI },  { "popdi",  OC_POPDI },
+    { "dupbi",  OC_DUPBI },  { "dupwi",  OC_DUPWI },  { "dupdi",  OC_DUPDI },
+    { "overbi", OC_OVERBI }, { "overwi", OC_OVERWI }, { "overdi", OC_OVERDI },
+    { "swapbi", OC_SWAPBI }, { "swapwi", OC_SWAPWI }, { "swapdi", OC_SWAPDI },
+    { "rollbi", OC_ROLLBI }, { "rollwi", OC_ROLLWI }, { "rolldi", OC_ROLLDI },
+    { "rotbi",  OC_ROTBI },  { "rotwi",  OC_ROTWI },  { "rotdi",  OC_ROTDI },
+    { "rotcbi", OC_ROTCBI }, { "rotcwi", OC_ROTCWI }, { "rotcdi", OC_ROTCDI },
+    // Memory
+    { "loadbi", OC_LOADBI }, { "loadwi", OC_LOADWI }, { "loaddi", OC_LOADDI },
+    { "pullbi", OC_PULLBI }, { "pullwi", OC_PULLWI }, { "pulldi", OC_PULLDI },
+    // Jumps
+    { "jmp", OC_JMP }, { "jz", OC_JZ }, { "jnz", OC_JNZ }, { "je", OC_JE },
+    { "jne", OC_JNE }, { "call", OC_CALL }, { "ret", OC_RET },
+    // Math
+    { "addbi",  OC_ADDBI },  { "addwi",  OC_ADDWI },  { "adddi",  OC_ADDDI },
+    { "subbi",  OC_SUBBI },  { "subwi",  OC_SUBWI },  { "subdi",  OC_SUBDI },
+    { "mulbi",  OC_MULBI },  { "mulwi",  OC_MULWI },  { "muldi",  OC_MULDI },
+    { "divbi",  OC_DIVBI },  { "divwi",  OC_DIVWI },  { "divdi",  OC_DIVDI },
+    { "modbi",  OC_MODBI },  { "modwi",  OC_MODWI },  { "moddi",  OC_MODDI },
+    // Bitwise
+    { "andbi",  OC_ANDBI },  { "andwi",  OC_ANDWI },  { "anddi",  OC_ANDDI },
+    { "orbi",   OC_ORBI },   { "orwi",   OC_ORWI },   { "ordi",   OC_ORDI },
+    { "xorbi",  OC_XORBI },  { "xorwi",  OC_XORWI },  { "xordi",  OC_XORDI },
+    { "notbi",  OC_NOTBI },  { "notwi",  OC_NOTWI },  { "notdi",  OC_NOTDI },
+    { "shlbi",  OC_SHLBI },  { "shlwi",  OC_SHLWI },  { "shldi",  OC_SHLDI },
+    { "shrbi",  OC_SHRBI },  { "shrwi",  OC_SHRWI },  { "shrdi",  OC_SHRDI },
+    // Machine
+    { "nop", OC_NOP }, { "halt", OC_HALT },
+    // Directives
+    { "db", DIRECTIVE_DB }, { "dw", DIRECTIVE_DW }, { "dd", DIRECTIVE_DD },
+    { "equ", DIRECTIVE_EQU }, { "org", DIRECTIVE_ORG }, { "entry", DIRECTIVE_ENTRY }
+};
+
+// The operand-size class of the operand each instruction takes. Instructions
+// that are not listed take no operand.
+static const unsigned char operand_sizes[256] = {
+    [OC_PUSHBI] = OPERAND_SIZE_BYTE,
+    [OC_PUSHWI] = OPERAND_SIZE_WORD,
+    [OC_PUSHDI] = OPERAND_SIZE_DWORD,
+    [OC_ROLLBI] = OPERAND_SIZE_BYTE,
+    [OC_ROLLWI] = OPERAND_SIZE_BYTE,
+    [OC_ROLLDI] = OPERAND_SIZE_BYTE,
+    [OC_LOADBI] = OPERAND_SIZE_DWORD,
+    [OC_LOADWI] = OPERAND_SIZE_DWORD,
+    [OC_LOADDI] = OPERAND_SIZE_DWORD,
+    [OC_PULLBI] = OPERAND_SIZE_DWORD,
+    [OC_PULLWI] = OPERAND_SIZE_DWORD,
+    [OC_PULLDI] = OPERAND_SIZE_DWORD,
+    [OC_JMP]    = OPERAND_SIZE_DWORD,
+    [OC_JZ]     = OPERAND_SIZE_DWORD,
+    [OC_JNZ]    = OPERAND_SIZE_DWORD,
+    [OC_JE]     = OPERAND_SIZE_DWORD,
+    [OC_JNE]    = OPERAND_SIZE_DWORD,
+    [OC_CALL]   = OPERAND_SIZE_DWORD,
+    [OC_RET]    = OPERAND_SIZE_DWORD
+};
+
+static KeywordTable mnemonics; // the mnemonic table, set up on first use
+static bool mnemonics_ready = false;
+
+// Externally exposed
+int asm_passes = ASM_PASSES_TWO; // the number of passes the assembler makes
+bool asm_predecode = false;      // writes pre-decoded instructions with machine code if TRUE
+
+static Ir *source;       // the assembly being assembled
+static Symtab *symtab;   // the labels and equates of the assembly
+static Code *image;      // the machine code being assembled
+static unsigned long lc; // location counter
+static Arena *fixups;    // fixups of symbols referred to before they are defined
+static IrLine *entry;    // the line that gives the entry point, if any
+static bool relocatable; // assembles relocatable code if TRUE
+static size_t initial_size; // the size the code image and its instruction addresses start at
+
+// Read text assembly into an assembly source
+
+Ir *asm_read(File *file)
 {
-    objfile = file_open("particle.bin","wb+");
-    lexer = lexer_create();
-    lexer->file = file;
-    lexer->input = lexer_next_char(lexer);
+    ir = ir_create(file->name);
+
+    arena = arena_create(ARENA_BLOCK_SIZE);
+    lexer = lexer_create(file, arena);
     look = lexer_next_token(lexer, true);
     program();
-    return NULL;
+    lexer_destroy(lexer);
+    arena_destroy(arena);
+    return ir;
+}
+
+// Assemble an assembly source into machine code
+
+Code *assemble(Ir *assembly)
+{
+    relocatable = false;
+    initial_size = ASM_CODE_INITIAL_SIZE;
+    return assemble_code(assembly);
+}
+
+// Assemble an assembly source into relocatable code. An operand that refers
+// to a label, or to a symbol the source does not define, is left zero and
+// recorded as a relocation; the symbols the source defines are recorded for
+// the linker to resolve the relocations of other code with.
+
+Code *assemble_relocatable(Ir *assembly)
+{
+    relocatable = true;
+    initial_size = ASM_UNIT_INITIAL_SIZE;
+    return assemble_code(assembly);
+}
+
+// Link relocatable code into one program. The pieces are laid out one after
+// another in the order given, and every relocation is filled in with the
+// value of its symbol, which any of the pieces may define. The name is the
+// name of the program, for messages.
+
+Code *code_link(Code **pieces, size_t count, const char *name)
+{
+    Code *result;
+    Symtab *symbols;
+    Symbol *symbol;
+    CodeSymbol *defined;
+    Relocation *relocation;
+    unsigned long *bases;
+    unsigned long base;
+    size_t insn_count;
+    size_t i;
+    size_t j;
+
+    // lay the pieces out, and enter the symbols they define
+    bases = (unsigned long*)emalloc((count > 0 ? count : 1) * sizeof(*bases));
+    symbols = symtab_create();
+    base = 0;
+    insn_count = 0;
+    for (i = 0; i < count; i++) {
+        bases[i] = base;
+        base += pieces[i]->size;
+        insn_count += pieces[i]->insn_count;
+        if (base > CODE_SEGMENT_SIZE) {
+            fail("%s: program exceeds the code segment size of %dB", name, CODE_SEGMENT_SIZE);
+        }
+        for (j = 0; j < pieces[i]->symbol_count; j++) {
+            defined = &pieces[i]->symbols[j];
+            symbol = symtab_insert(symbols, defined->name);
+            if (symbol->type != 0) {
+                fail("%s: `%s' is defined more than once", name, defined->name);
+            }
+            symbol->type = defined->type;
+            symbol->value = defined->type == SYMTYPE_LABEL ? bases[i] + defined->value : defined->value;
+        }
+    }
+
+    image = code_create();
+    initial_size = base > 0 ? base : 1;
+    code_reserve(base);
+    image->insns = (unsigned long*)emalloc((insn_count > 0 ? insn_count : 1) * sizeof(*image->insns));
+    image->insn_capacity = insn_count;
+    for (i = 0; i < count; i++) {
+        memcpy(image->bytes + bases[i], pieces[i]->bytes, pieces[i]->size);
+        for (j = 0; j < pieces[i]->insn_count; j++) {
+            image->insns[image->insn_count++] = bases[i] + pieces[i]->insns[j];
+        }
+        for (j = 0; j < pieces[i]->relocation_count; j++) {
+            relocation = &pieces[i]->relocations[j];
+            symbol = symtab_lookup(symbols, relocation->name);
+            if (symbol == NULL) {
+                fail("%s: undefined symbol `%s'", name, relocation->name);
+            }
+            if (symbol->value > OPERAND_MAX(relocation->size)) {
+                fail("%s: operand is out of range: `%s' is %lu, which is greater than %lu", name, symbol->name, symbol->value, OPERAND_MAX(relocation->size));
+            }
+            emit_value(bases[i] + relocation->address, symbol->value, relocation->size);
+        }
+    }
+
+    symtab_destroy(symbols);
+    free(bases);
+    result = image;
+    image = NULL;
+    return result;
+}
+
+// Join relocatable code into one piece of relocatable code, laid out one
+// after another in the order given, without resolving any relocation. Each
+// piece is recorded under its key, so that it can be taken out again with
+// code_piece().
+
+Code *code_join(Code **pieces, const unsigned long long *keys, size_t count)
+{
+    Code *result;
+    CodePiece *piece;
+    CodeSymbol *symbol;
+    Relocation *relocation;
+    unsigned long base;
+    size_t insn_count;
+    size_t i;
+    size_t j;
+
+    base = 0;
+    insn_count = 0;
+    for (i = 0; i < count; i++) {
+        base += pieces[i]->size;
+        insn_count += pieces[i]->insn_count;
+    }
+    if (base > CODE_SEGMENT_SIZE) {
+        fail("relocatable code exceeds the code segment size of %dB", CODE_SEGMENT_SIZE);
+    }
+
+    image = code_create();
+    initial_size = base > 0 ? base : 1;
+    code_reserve(base);
+    image->insns = (unsigned long*)emalloc((insn_count > 0 ? insn_count : 1) * sizeof(*image->insns));
+    image->insn_capacity = insn_count;
+    image->pieces = (CodePiece*)emalloc((count > 0 ? count : 1) * sizeof(*image->pieces));
+    base = 0;
+    for (i = 0; i < count; i++) {
+        piece = &image->pieces[image->piece_count++];
+        piece->key = keys[i];
+        piece->address = base;
+        piece->size = pieces[i]->size;
+        piece->symbol = image->symbol_count;
+        piece->symbol_count = pieces[i]->symbol_count;
+        piece->relocation = image->relocation_count;
+        piece->relocation_count = pieces[i]->relocation_count;
+        piece->insn = image->insn_count;
+        piece->insn_count = pieces[i]->insn_count;
+
+        memcpy(image->bytes + base, pieces[i]->bytes, pieces[i]->size);
+        for (j = 0; j < pieces[i]->symbol_count; j++) {
+            symbol = &pieces[i]->symbols[j];
+            add_symbol(symbol->name, strlen(symbol->name), symbol->type, symbol->type == SYMTYPE_LABEL ? base + symbol->value : symbol->value);
+        }
+        for (j = 0; j < pieces[i]->relocation_count; j++) {
+            relocation = &pieces[i]->relocations[j];
+            add_relocation(relocation->name, strlen(relocation->name), base + relocation->address, relocation->size);
+        }
+        for (j = 0; j < pieces[i]->insn_count; j++) {
+            image->insns[image->insn_count++] = base + pieces[i]->insns[j];
+        }
+        base += pieces[i]->size;
+    }
+
+    result = image;
+    image = NULL;
+    return result;
+}
+
+// Take a piece out of relocatable code joined by code_join(), as relocatable
+// code of its own
+
+Code *code_piece(Code *code, size_t index)
+{
+    Code *result;
+    CodePiece *piece;
+    CodeSymbol *symbol;
+    Relocation *relocation;
+    size_t i;
+
+    piece = &code->pieces[index];
+    image = code_create();
+    initial_size = piece->size > 0 ? piece->size : 1;
+    code_reserve(piece->size);
+    memcpy(image->bytes, code->bytes + piece->address, piece->size);
+    for (i = piece->symbol; i < piece->symbol + piece->symbol_count; i++) {
+        symbol = &code->symbols[i];
+        add_symbol(symbol->name, strlen(symbol->name), symbol->type, symbol->type == SYMTYPE_LABEL ? symbol->value - piece->address : symbol->value);
+    }
+    for (i = piece->relocation; i < piece->relocation + piece->relocation_count; i++) {
+        relocation = &code->relocations[i];
+        add_relocation(relocation->name, strlen(relocation->name), relocation->address - piece->address, relocation->size);
+    }
+    image->insns = (unsigned long*)emalloc((piece->insn_count > 0 ? piece->insn_count : 1) * sizeof(*image->insns));
+    image->insn_capacity = piece->insn_count;
+    for (i = piece->insn; i < piece->insn + piece->insn_count; i++) {
+        image->insns[image->insn_count++] = code->insns[i] - piece->address;
+    }
+
+    result = image;
+    image = NULL;
+    return result;
+}
+
+// Assemble an assembly source into machine code, relocatable or not
+
+static Code *assemble_code(Ir *assembly)
+{
+    Code *result;
+    Symbol *symbol;
+    size_t i;
+
+    if (!mnemonics_ready) {
+        keyword_table_init(&mnemonics, mnemonic_keywords, sizeof(mnemonic_keywords) / sizeof(mnemonic_keywords[0]));
+        mnemonics_ready = true;
+    }
+    source = assembly;
+    symtab = symtab_create();
+    image = code_create();
+    entry = NULL;
+
+    if (asm_passes == ASM_PASSES_ONE) {
+        assemble_one_pass();
+    }
+    else {
+        assemble_two_pass();
+    }
+    if (entry != NULL) {
+        image->entry = operand_value(entry, CODE_SEGMENT_SIZE - 1);
+    }
+    if (relocatable) {
+        for (i = 0; i <= symtab->mask; i++) {
+            symbol = &symtab->slots[i];
+            if (symbol->name != NULL && symbol->type != 0) {
+                add_symbol(symbol->name, strlen(symbol->name), symbol->type, symbol->value);
+            }
+        }
+    }
+
+    symtab_destroy(symtab);
+    result = image;
+    image = NULL;
+    return result;
+}
+
+// Write machine code to a file as an object file. Trailing zeroes are left
+// out of the code section and given as a bss section instead. With
+// asm_predecode, every instruction is also written decoded, so that the
+// machine can skip decoding it. Relocatable code is always written with its
+// instructions decoded, since the linker needs to know where they are.
+
+void code_write(Code *code, File *file)
+{
+    Object object;
+    Section *section;
+    const void *contents[OBJECT_MAX_SECTIONS];
+    unsigned char *decoded;
+    unsigned char *symbols;
+    unsigned char *relocations;
+    unsigned char *pieces;
+    unsigned char *record;
+    CodePiece *piece;
+    bool relocatable_code;
+    unsigned long end;
+    unsigned long address;
+    unsigned long iw;
+    int sc;
+    size_t size;
+    size_t i;
+
+    end = code->size;
+    while (end > 0 && code->bytes[end - 1] == 0) {
+        end--;
+    }
+
+    object.version = OBJECT_VERSION;
+    relocatable_code = code->symbol_count > 0 || code->relocation_count > 0 || code->piece_count > 0;
+    object.flags = relocatable_code ? OBJECT_RELOCATABLE : 0;
+    object.entry = code->entry;
+    object.section_count = 0;
+    section = &object.sections[object.section_count++];
+    section->type = SECTION_CODE;
+    section->address = 0;
+    section->size = end;
+    section->filesize = end;
+    contents[object.section_count - 1] = code->bytes;
+    if (code->size > end) {
+        contents[object.section_count] = NULL;
+        section = &object.sections[object.section_count++];
+        section->type = SECTION_BSS;
+        section->address = end;
+        section->size = code->size - end;
+        section->filesize = 0;
+    }
+    decoded = NULL;
+    if ((asm_predecode || relocatable_code) && code->insn_count > 0) {
+        decoded = (unsigned char*)emalloc(code->insn_count * OBJECT_DECODED_SIZE);
+        for (i = 0; i < code->insn_count; i++) {
+            address = code->insns[i];
+            iw = object_get(code->bytes + address, INSTRUCTION_SIZE);
+            sc = (iw >> 2) & 3;
+            record = decoded + i * OBJECT_DECODED_SIZE;
+            object_put(record, address, 4);
+            record[4] = iw >> 8;
+            record[5] = sc;
+            record[6] = iw & 3;
+            record[7] = 0;
+            object_put(record + 8, object_get(code->bytes + address + INSTRUCTION_SIZE, OPERAND_BYTES(sc)), 4);
+            object_put(record + 12, address + INSTRUCTION_SIZE + OPERAND_BYTES(sc), 4);
+        }
+        contents[object.section_count] = decoded;
+        section = &object.sections[object.section_count++];
+        section->type = SECTION_DECODED;
+        section->address = 0;
+        section->size = code->insn_count * OBJECT_DECODED_SIZE;
+        section->filesize = section->size;
+    }
+    symbols = NULL;
+    if (code->symbol_count > 0) {
+        symbols = write_records(code, SECTION_SYMBOLS, &size);
+        contents[object.section_count] = symbols;
+        section = &object.sections[object.section_count++];
+        section->type = SECTION_SYMBOLS;
+        section->address = 0;
+        section->size = size;
+        section->filesize = size;
+    }
+    relocations = NULL;
+    if (code->relocation_count > 0) {
+        relocations = write_records(code, SECTION_RELOCATIONS, &size);
+        contents[object.section_count] = relocations;
+        section = &object.sections[object.section_count++];
+        section->type = SECTION_RELOCATIONS;
+        section->address = 0;
+        section->size = size;
+        section->filesize = size;
+    }
+    pieces = NULL;
+    if (code->piece_count > 0) {
+        pieces = (unsigned char*)emalloc(code->piece_count * OBJECT_PIECE_SIZE);
+        for (i = 0; i < code->piece_count; i++) {
+            piece = &code->pieces[i];
+            record = pieces + i * OBJECT_PIECE_SIZE;
+            object_put(record, (unsigned long)(piece->key >> 32), 4);
+            object_put(record + 4, (unsigned long)(piece->key & 0xFFFFFFFFUL), 4);
+            object_put(record + 8, piece->address, 4);
+            object_put(record + 12, piece->size, 4);
+            object_put(record + 16, piece->symbol, 4);
+            object_put(record + 20, piece->symbol_count, 4);
+            object_put(record + 24, piece->relocation, 4);
+            object_put(record + 28, piece->relocation_count, 4);
+            object_put(record + 32, piece->insn, 4);
+            object_put(record + 36, piece->insn_count, 4);
+        }
+        contents[object.section_count] = pieces;
+        section = &object.sections[object.section_count++];
+        section->type = SECTION_PIECES;
+        section->address = 0;
+        section->size = code->piece_count * OBJECT_PIECE_SIZE;
+        section->filesize = section->size;
+    }
+    object_layout(&object);
+
+    object_write(file, &object);
+    for (i = 0; i < (size_t)object.section_count; i++) {
+        object_write_section(file, &object.sections[i], contents[i]);
+    }
+    free(decoded);
+    free(symbols);
+    free(relocations);
+    free(pieces);
+}
+
+// Read machine code from an object file, as written by code_write(). Every
+// instruction of the code is known only if the file has a decoded section.
+//
+// Returns the code, or NULL if the file is not an object file of this version
+// or is malformed
+
+Code *code_read(File *file)
+{
+    Object object;
+    Section *section;
+    unsigned char *contents;
+    Code *result;
+    size_t count;
+    size_t i;
+    int j;
+    bool valid;
+
+    if (object_read(file, &object) != OBJECT_OK || object.version != OBJECT_VERSION) {
+        return NULL;
+    }
+    image = code_create();
+    initial_size = 1;
+    for (j = 0; j < object.section_count; j++) {
+        section = &object.sections[j];
+        if ((section->type == SECTION_CODE || section->type == SECTION_BSS) && section->address + section->size > initial_size && section->address + section->size <= CODE_SEGMENT_SIZE) {
+            initial_size = section->address + section->size;
+        }
+    }
+    valid = true;
+    for (j = 0; j < object.section_count && valid; j++) {
+        section = &object.sections[j];
+        contents = NULL;
+        if (section->filesize > 0) {
+            contents = read_section(file, section);
+            valid = contents != NULL;
+        }
+        switch (valid ? section->type : 0) {
+            case SECTION_CODE:
+            case SECTION_BSS:
+                if (section->filesize > section->size || section->address + section->size > CODE_SEGMENT_SIZE) {
+                    valid = false;
+                    break;
+                }
+                code_reserve(section->address + section->size);
+                if (contents != NULL) {
+                    memcpy(image->bytes + section->address, contents, section->filesize);
+                }
+                break;
+            case SECTION_DECODED:
+                count = section->filesize / OBJECT_DECODED_SIZE;
+                image->insns = (unsigned long*)erealloc(image->insns, (image->insn_count + count + 1) * sizeof(*image->insns));
+                for (i = 0; i < count; i++) {
+                    image->insns[image->insn_count++] = object_get(contents + i * OBJECT_DECODED_SIZE, 4);
+                }
+                image->insn_capacity = image->insn_count + 1;
+                break;
+            case SECTION_SYMBOLS:
+            case SECTION_RELOCATIONS:
+                valid = read_records(section->type, contents, section->filesize);
+                break;
+            case SECTION_PIECES:
+                valid = read_pieces(contents, section->filesize);
+                break;
+            default:
+                break;
+        }
+        free(contents);
+    }
+    image->entry = object.entry;
+
+    result = image;
+    image = NULL;
+    if (!valid) {
+        code_destroy(result);
+        return NULL;
+    }
+    return result;
+}
+
+// Destroy machine code
+
+void code_destroy(Code *code)
+{
+    if (code->names != NULL) {
+        arena_destroy(code->names);
+    }
+    free(code->pieces);
+    free(code->relocations);
+    free(code->symbols);
+    free(code->insns);
+    free(code->bytes);
+    free(code);
+}
+
+// Assemble in two passes. Pass one gives every label the address of its line
+// and every equate its value, and finds how many bytes the program spans.
+// Pass two encodes every line at its address; by then every symbol is known.
+
+static void assemble_two_pass()
+{
+    IrLine *line;
+    int mnemonic;
+
+    lc = 0;
+    for (line = source->head; line != NULL; line = line->next) {
+        mnemonic = line->mnemonic != NULL ? mnemonic_lookup(line) : -1;
+        if (line->label != NULL) {
+            define(line, mnemonic);
+        }
+        else if (mnemonic == DIRECTIVE_EQU) {
+            fail("%s:%u: equ needs a name to define", source->name, line->lineno);
+        }
+        if (mnemonic == DIRECTIVE_ORG) {
+            lc = operand_value(line, CODE_SEGMENT_SIZE);
+        }
+        else if (mnemonic >= 0) {
+            lc += line_size(line, mnemonic);
+        }
+        if (lc > CODE_SEGMENT_SIZE) {
+            fail("%s:%u: program exceeds the code segment size of %dB", source->name, line->lineno, CODE_SEGMENT_SIZE);
+        }
+        code_reserve(lc);
+    }
+
+    lc = 0;
+    for (line = source->head; line != NULL; line = line->next) {
+        if (line->mnemonic != NULL) {
+            encode(line, mnemonic_lookup(line));
+        }
+    }
+}
+
+// Assemble in one pass. Every line is encoded as soon as it is reached. An
+// operand that refers to a label further on is left zero, and its place is
+// chained to the label; when the label is defined, the places on its chain
+// are patched. The lines are walked once, and the code image grows as it is
+// written.
+
+static void assemble_one_pass()
+{
+    IrLine *line;
+    Symbol *symbol;
+    Symbol *undefined;
+    int mnemonic;
+    size_t i;
+
+    fixups = arena_create(ARENA_BLOCK_SIZE);
+    lc = 0;
+    for (line = source->head; line != NULL; line = line->next) {
+        mnemonic = line->mnemonic != NULL ? mnemonic_lookup(line) : -1;
+        if (line->label != NULL) {
+            define(line, mnemonic);
+        }
+        else if (mnemonic == DIRECTIVE_EQU) {
+            fail("%s:%u: equ needs a name to define", source->name, line->lineno);
+        }
+        if (mnemonic >= 0) {
+            encode(line, mnemonic);
+        }
+    }
+
+    // Any symbol still waiting for its definition is undefined. The one
+    // referred to first is reported.
+    undefined = NULL;
+    for (i = 0; i <= symtab->mask; i++) {
+        symbol = &symtab->slots[i];
+        if (symbol->name != NULL && symbol->type == 0) {
+            if (undefined == NULL || first_reference(symbol) < first_reference(undefined)) {
+                undefined = symbol;
+            }
+        }
+    }
+    if (undefined != NULL) {
+        fail("%s:%u: undefined symbol `%s'", source->name, first_reference(undefined), undefined->name);
+    }
+    arena_destroy(fixups);
+}
+
+// Define the label of a line: as the value of the line's operand if the line
+// is an equate, and as the address of the line otherwise. References made
+// before the definition are patched.
+
+static void define(IrLine *line, int mnemonic)
+{
+    Symbol *symbol;
+    Fixup *fixup;
+
+    symbol = symtab_insert(symtab, line->label);
+    if (symbol->type != 0) {
+        fail("%s:%u: `%s' is already defined on line %u", source->name, line->lineno, line->label, symbol->lineno);
+    }
+    symbol->lineno = line->lineno;
+    if (mnemonic == DIRECTIVE_EQU) {
+        symbol->type = SYMTYPE_EQU;
+        symbol->value = operand_value(line, 0xFFFFFFFFUL);
+    }
+    else {
+        symbol->type = SYMTYPE_LABEL;
+        symbol->value = lc;
+    }
+
+    for (fixup = symbol->fixups; fixup != NULL; fixup = fixup->next) {
+        if (symbol->value > OPERAND_MAX(fixup->size)) {
+            fail("%s:%u: operand is out of range: `%s' is %lu, which is greater than %lu", source->name, fixup->lineno, symbol->name, symbol->value, OPERAND_MAX(fixup->size));
+        }
+        emit_value(fixup->address, symbol->value, fixup->size);
+    }
+    symbol->fixups = NULL;
+}
+
+// Encode a line at the location counter, and move the counter past it. Bytes
+// that no line covers, such as those skipped by org, stay zero.
+
+static void encode(IrLine *line, int mnemonic)
+{
+    unsigned long size;
+    int sc;
+
+    if (mnemonic == DIRECTIVE_EQU) {
+        return;
+    }
+    if (relocatable && (mnemonic == DIRECTIVE_ENTRY || mnemonic == DIRECTIVE_ORG)) {
+        fail("%s:%u: %s cannot be used in relocatable code", source->name, line->lineno, line->mnemonic);
+    }
+    if (mnemonic == DIRECTIVE_ENTRY) {
+        if (entry != NULL) {
+            fail("%s:%u: the entry point is already given on line %u", source->name, line->lineno, entry->lineno);
+        }
+        entry = line;
+        return;
+    }
+    if (mnemonic == DIRECTIVE_ORG) {
+        lc = operand_value(line, CODE_SEGMENT_SIZE);
+        code_reserve(lc);
+        return;
+    }
+    size = line_size(line, mnemonic);
+    if (lc + size > CODE_SEGMENT_SIZE) {
+        fail("%s:%u: program exceeds the code segment size of %dB", source->name, line->lineno, CODE_SEGMENT_SIZE);
+    }
+    code_reserve(lc + size);
+
+    switch (mnemonic) {
+        case DIRECTIVE_DB:
+        case DIRECTIVE_DW:
+        case DIRECTIVE_DD:
+            if (line->operand.type == IR_OPERAND_STRING && mnemonic == DIRECTIVE_DB) {
+                // db lays a string out byte by byte
+                memcpy(image->bytes + lc, line->operand.text, line->operand.length);
+            }
+            else {
+                emit_operand(line, lc, size);
+            }
+            break;
+        default:
+            // an operand-taking instruction written without an operand is
+            // encoded without one
+            sc = line->operand.type == IR_OPERAND_NONE ? OPERAND_SIZE_NONE : operand_sizes[mnemonic];
+            emit_value(lc, (unsigned long)mnemonic << 8 | sc << 2, INSTRUCTION_SIZE);
+            if (image->insn_count == image->insn_capacity) {
+                image->insn_capacity = image->insn_capacity > 0 ? 2 * image->insn_capacity : initial_size;
+                image->insns = (unsigned long*)erealloc(image->insns, image->insn_capacity * sizeof(*image->insns));
+            }
+            image->insns[image->insn_count++] = lc;
+            if (sc != OPERAND_SIZE_NONE) {
+                emit_operand(line, lc + INSTRUCTION_SIZE, OPERAND_BYTES(sc));
+            }
+            break;
+    }
+    lc += size;
+}
+
+// Look up the mnemonic of a line. Mnemonics are not case-sensitive.
+
+static int mnemonic_lookup(IrLine *line)
+{
+    char name[MNEMONIC_MAX_LENGTH + 1];
+    size_t length;
+    size_t i;
+    int mnemonic;
+
+    mnemonic = -1;
+    length = strlen(line->mnemonic);
+    if (length <= MNEMONIC_MAX_LENGTH) {
+        for (i = 0; i < length; i++) {
+            name[i] = lowercase(line->mnemonic[i]);
+        }
+        mnemonic = keyword_lookup(&mnemonics, name, length);
+    }
+    if (mnemonic < 0) {
+        fail("%s:%u: unknown mnemonic `%s'", source->name, line->lineno, line->mnemonic);
+    }
+    return mnemonic;
+}
+
+// Find the number of bytes a line occupies in the code image. The operand is
+// checked against what the instruction or directive accepts.
+
+static unsigned long line_size(IrLine *line, int mnemonic)
+{
+    int sc;
+
+    switch (mnemonic) {
+        case DIRECTIVE_EQU:
+        case DIRECTIVE_ORG:
+        case DIRECTIVE_ENTRY:
+            return 0;
+        case DIRECTIVE_DB:
+        case DIRECTIVE_DW:
+        case DIRECTIVE_DD:
+            if (line->operand.type == IR_OPERAND_NONE) {
+                fail("%s:%u: %s needs an operand", source->name, line->lineno, line->mnemonic);
+            }
+            if (line->operand.type == IR_OPERAND_STRING && mnemonic == DIRECTIVE_DB) {
+                return line->operand.length;
+            }
+            return OPERAND_BYTES(mnemonic - DIRECTIVE_DB + OPERAND_SIZE_BYTE);
+        default:
+            sc = operand_sizes[mnemonic];
+            if (line->operand.type == IR_OPERAND_NONE) {
+                return INSTRUCTION_SIZE;
+            }
+            if (sc == OPERAND_SIZE_NONE) {
+                fail("%s:%u: %s takes no operand", source->name, line->lineno, line->mnemonic);
+            }
+            return INSTRUCTION_SIZE + OPERAND_BYTES(sc);
+    }
+}
+
+// Find the value of the operand of a line, which must not exceed the given
+// maximum. A symbol stands for its value and must already be defined; a
+// string of up to four characters stands for its characters packed
+// big-endian.
+
+static unsigned long operand_value(IrLine *line, unsigned long max)
+{
+    Symbol *symbol;
+    unsigned long value;
+    size_t i;
+
+    switch (line->operand.type) {
+        case IR_OPERAND_INT:
+            value = line->operand.value;
+            break;
+        case IR_OPERAND_SYMBOL:
+            symbol = symtab_lookup(symtab, line->operand.text);
+            if (symbol == NULL || symbol->type == 0) {
+                fail("%s:%u: undefined symbol `%s'", source->name, line->lineno, line->operand.text);
+            }
+            value = symbol->value;
+            break;
+        case IR_OPERAND_STRING:
+            if (line->operand.length > 4) {
+                fail("%s:%u: string operand \"%s\" is longer than 4 characters", source->name, line->lineno, line->operand.text);
+            }
+            value = 0;
+            for (i = 0; i < line->operand.length; i++) {
+                value = value << 8 | (unsigned char)line->operand.text[i];
+            }
+            break;
+        default:
+            fail("%s:%u: %s needs an operand", source->name, line->lineno, line->mnemonic);
+            return 0;
+    }
+    if (value > max) {
+        fail("%s:%u: operand of %s is out of range: %lu is greater than %lu", source->name, line->lineno, line->mnemonic, value, max);
+    }
+    return value;
+}
+
+// Write the operand of a line into the code image. In one pass, an operand
+// that refers to a symbol not defined yet is chained to the symbol, to be
+// patched when the symbol is defined. In relocatable code, an operand that
+// refers to anything but an equate defined already is left to the linker.
+
+static void emit_operand(IrLine *line, unsigned long address, int size)
+{
+    Symbol *symbol;
+    Fixup *fixup;
+
+    if (relocatable && line->operand.type == IR_OPERAND_SYMBOL) {
+        symbol = symtab_lookup(symtab, line->operand.text);
+        if (symbol == NULL || symbol->type != SYMTYPE_EQU) {
+            add_relocation(line->operand.text, line->operand.length, address, size);
+            return;
+        }
+    }
+    if (asm_passes == ASM_PASSES_ONE && line->operand.type == IR_OPERAND_SYMBOL) {
+        symbol = symtab_insert(symtab, line->operand.text);
+        if (symbol->type == 0) {
+            fixup = (Fixup*)arena_alloc(fixups, sizeof(*fixup));
+            fixup->address = address;
+            fixup->size = size;
+            fixup->lineno = line->lineno;
+            fixup->next = symbol->fixups;
+            symbol->fixups = fixup;
+            return;
+        }
+    }
+    emit_value(address, operand_value(line, OPERAND_MAX(size)), size);
+}
+
+// Find the line a symbol is first referred to on
+
+static unsigned int first_reference(Symbol *symbol)
+{
+    Fixup *fixup;
+    unsigned int lineno;
+
+    lineno = symbol->fixups->lineno;
+    for (fixup = symbol->fixups; fixup != NULL; fixup = fixup->next) {
+        if (fixup->lineno < lineno) {
+            lineno = fixup->lineno;
+        }
+    }
+    return lineno;
+}
+
+// Make the code image span at least the given number of bytes. New bytes are
+// zero.
+
+static void code_reserve(unsigned long size)
+{
+    size_t capacity;
+
+    if (size <= image->size) {
+        return;
+    }
+    if (size > image->capacity) {
+        capacity = image->capacity > 0 ? image->capacity : initial_size;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        image->bytes = (unsigned char*)erealloc(image->bytes, capacity);
+        image->capacity = capacity;
+    }
+    memset(image->bytes + image->size, 0, size - image->size);
+    image->size = size;
+}
+
+// Write a value big-endian into the code image
+
+static void emit_value(unsigned long address, unsigned long value, int size)
+{
+    while (size-- > 0) {
+        image->bytes[address++] = (unsigned char)(value >> (8 * size));
+    }
+}
+
+// Create empty machine code
+
+static Code *code_create(void)
+{
+    Code *code;
+
+    code = (Code*)emalloc(sizeof(*code));
+    code->bytes = NULL;
+    code->size = 0;
+    code->capacity = 0;
+    code->entry = 0;
+    code->insns = NULL;
+    code->insn_count = 0;
+    code->insn_capacity = 0;
+    code->symbols = NULL;
+    code->symbol_count = 0;
+    code->relocations = NULL;
+    code->relocation_count = 0;
+    code->relocation_capacity = 0;
+    code->pieces = NULL;
+    code->piece_count = 0;
+    code->names = NULL;
+    return code;
+}
+
+// Record a symbol the code image defines. The name, of the given length, is
+// copied.
+
+static void add_symbol(const char *name, size_t length, int type, unsigned long value)
+{
+    CodeSymbol *symbol;
+
+    if (image->names == NULL) {
+        image->names = arena_create(ASM_NAMES_BLOCK_SIZE);
+    }
+    image->symbols = (CodeSymbol*)erealloc(image->symbols, (image->symbol_count + 1) * sizeof(*image->symbols));
+    symbol = &image->symbols[image->symbol_count++];
+    symbol->name = arena_substr(image->names, name, length);
+    symbol->type = type;
+    symbol->value = value;
+}
+
+// Record a place in the code image that the value of a symbol goes in. The
+// name, of the given length, is copied.
+
+static void add_relocation(const char *name, size_t length, unsigned long address, int size)
+{
+    Relocation *relocation;
+
+    if (image->names == NULL) {
+        image->names = arena_create(ASM_NAMES_BLOCK_SIZE);
+    }
+    if (image->relocation_count == image->relocation_capacity) {
+        image->relocation_capacity = image->relocation_capacity > 0 ? 2 * image->relocation_capacity : 16;
+        image->relocations = (Relocation*)erealloc(image->relocations, image->relocation_capacity * sizeof(*image->relocations));
+    }
+    relocation = &image->relocations[image->relocation_count++];
+    relocation->name = arena_substr(image->names, name, length);
+    relocation->address = address;
+    relocation->size = size;
+}
+
+// Read the contents of a section. Returns NULL if they cannot be read.
+
+static unsigned char *read_section(File *file, const Section *section)
+{
+    unsigned char *contents;
+
+    if (section->offset + section->filesize > (unsigned long)file_size(file)) {
+        return NULL;
+    }
+    contents = (unsigned char*)emalloc(section->filesize);
+    if (fseek(file->handle, section->offset, SEEK_SET) != 0 || fread(contents, section->filesize, 1, file->handle) != 1) {
+        free(contents);
+        return NULL;
+    }
+    return contents;
+}
+
+// Lay out the symbols or the relocations of code as the records of a section
+// (see object.h). Returns the records, and their size through size.
+
+static unsigned char *write_records(Code *code, unsigned long type, size_t *size)
+{
+    unsigned char *records;
+    unsigned char *record;
+    const char *name;
+    size_t count;
+    size_t length;
+    size_t i;
+
+    count = type == SECTION_SYMBOLS ? code->symbol_count : code->relocation_count;
+    *size = 0;
+    for (i = 0; i < count; i++) {
+        name = type == SECTION_SYMBOLS ? code->symbols[i].name : code->relocations[i].name;
+        *size += OBJECT_RECORD_SIZE + strlen(name);
+    }
+    records = (unsigned char*)emalloc(*size);
+    record = records;
+    for (i = 0; i < count; i++) {
+        if (type == SECTION_SYMBOLS) {
+            name = code->symbols[i].name;
+            object_put(record, code->symbols[i].value, 4);
+            record[4] = code->symbols[i].type;
+        }
+        else {
+            name = code->relocations[i].name;
+            object_put(record, code->relocations[i].address, 4);
+            record[4] = code->relocations[i].size;
+        }
+        length = strlen(name);
+        record[5] = 0;
+        object_put(record + 6, length, 2);
+        memcpy(record + OBJECT_RECORD_SIZE, name, length);
+        record += OBJECT_RECORD_SIZE + length;
+    }
+    return records;
+}
+
+// Read the records of a symbols or relocations section into the code image.
+// Returns FALSE if the records are malformed.
+
+static bool read_records(unsigned long type, const unsigned char *records, size_t size)
+{
+    const unsigned char *end;
+    const char *name;
+    unsigned long value;
+    size_t length;
+
+    end = records + size;
+    while (records < end) {
+        if ((size_t)(end - records) < OBJECT_RECORD_SIZE) {
+            return false;
+        }
+        length = object_get(records + 6, 2);
+        if ((size_t)(end - records) - OBJECT_RECORD_SIZE < length) {
+            return false;
+        }
+        name = (const char *)records + OBJECT_RECORD_SIZE;
+        value = object_get(records, 4);
+        if (type == SECTION_SYMBOLS) {
+            if (records[4] != SYMTYPE_LABEL && records[4] != SYMTYPE_EQU) {
+                return false;
+            }
+            add_symbol(name, length, records[4], value);
+        }
+        else {
+            if (records[4] < 1 || records[4] > 4 || value + records[4] > image->size) {
+                return false;
+            }
+            add_relocation(name, length, value, records[4]);
+        }
+        records += OBJECT_RECORD_SIZE + length;
+    }
+    return true;
 }
 
 static bool match(TokenType type)
 {
     if (look->type == type) {
-        token_destroy(look); // remove our garbage from memory
         look = lexer_next_token(lexer, true);
         return true;
     }
@@ -47,7 +1178,7 @@ static bool match(TokenType type)
 static void program()
 {
     // Expect repeated linen productions
-    while (look->type == t_id || look->type == t_eol) {
+    while (is_linen(look->type)) {
         linen();
     }
 
@@ -63,7 +1194,7 @@ static void linen()
         match(t_eol);
         return;
     }
-    else if (look->type == t_id) {
+    else if (is_line(look->type)) {
         line();
         return;
     }
@@ -74,7 +1205,7 @@ static void linen()
 
 static bool is_linen(TokenType type)
 {
-    if (type == t_id || type == t_eol) {
+    if (is_line(type) || type == t_eol) {
         return true;
     }
     else {
@@ -84,8 +1215,14 @@ static bool is_linen(TokenType type)
 
 static void line()
 {
-    // Expect an identifier for either a label or instruction
-    if (!match(t_id)) {
+    Token *id;       // the identifier the line starts with
+    Token *second;   // the identifier that follows it, if any
+    IrLine *irline;  // the line emitted to the assembly source
+
+    // Expect an identifier for either a label or instruction. The token stays
+    // valid for a few more tokens, so it is looked at after it is matched.
+    id = look;
+    if (!match(id->type)) {
         expected(lexer->file, look, "%s for a label or mnemonic", token_meaning(t_id));
     }
 
@@ -97,21 +1234,40 @@ static void line()
     // the token couple as an instruction.
     if (look->type == t_colon) {
         match(t_colon);
+        irline = ir_emit(ir, ir_name(ir, id->lexeme, id->length), NULL, id->lineno);
         // Expect identifier for instruction
-        if (look->type == t_id) {
-            match(t_id);
+        if (is_name(look->type)) {
+            irline->mnemonic = ir_name(ir, look->lexeme, look->length);
+            match(look->type);
             if (is_constant(look->type)) {
-                constant();
+                constant(irline);
             }
         }
     }
+    else if (is_name(look->type)) {
+        // Two names in a row are a mnemonic and a symbol operand, unless a
+        // constant follows: then they are a name and a directive that defines
+        // it, as in `max equ 99'.
+        second = look;
+        match(second->type);
+        if (is_constant(look->type)) {
+            irline = ir_emit(ir, ir_name(ir, id->lexeme, id->length), ir_name(ir, second->lexeme, second->length), id->lineno);
+            constant(irline);
+        }
+        else {
+            irline = ir_emit(ir, NULL, ir_name(ir, id->lexeme, id->length), id->lineno);
+            ir_operand_symbol(irline, ir_name(ir, second->lexeme, second->length));
+        }
+    }
     else if (is_constant(look->type)) {
-        constant();
+        constant(ir_emit(ir, NULL, ir_name(ir, id->lexeme, id->length), id->lineno));
     }
     else if (look->type == t_eol) {
+        ir_emit(ir, NULL, ir_name(ir, id->lexeme, id->length), id->lineno);
         match(t_eol);
     }
     else if (look->type == t_eof) {
+        ir_emit(ir, NULL, ir_name(ir, id->lexeme, id->length), id->lineno);
         return;
     }
     else {
@@ -121,7 +1277,15 @@ static void line()
 
 static bool is_line(TokenType type)
 {
-    if (type == t_id) {
+    return is_name(type);
+}
+
+// Mnemonics and labels are identifiers. Particle keywords such as `ret' are
+// plain names in assembly.
+
+static bool is_name(TokenType type)
+{
+    if (type == t_id || (type >= t_word && type <= t_endfor)) {
         return true;
     }
     else {
@@ -129,18 +1293,19 @@ static bool is_line(TokenType type)
     }
 }
 
-static void constant() {
-    if (look->type == t_id) {
-        match(t_id);
+static void constant(IrLine *irline) {
+    if (is_name(look->type)) {
+        ir_operand_symbol(irline, ir_name(ir, look->lexeme, look->length));
+        match(look->type);
     }
     else if (look->type == t_int) {
+        ir_operand_int(irline, (unsigned int)look->intval);
         match(t_int);
     }
-    else if (look->type == t_sqstr) {
-        match(t_sqstr);
-    }
-    else if (look->type == t_dqstr) {
-        match(t_dqstr);
+    else if (look->type == t_sqstr || look->type == t_dqstr) {
+        // the string goes in without its quotation marks
+        ir_operand_string(ir, irline, look->lexeme + 1, look->length - 2, look->lexeme[0]);
+        match(look->type);
     }
     else {
         expected(lexer->file, look, "literal constant: expected int, sqstr, or dqstr");
@@ -149,10 +1314,44 @@ static void constant() {
 
 static bool is_constant(TokenType type)
 {
-    if (type == t_id || type == t_int || type == t_sqstr || type == t_dqstr) {
+    if (is_name(type) || type == t_int || type == t_sqstr || type == t_dqstr) {
         return true;
     }
     else {
         return false;
     }
 }
+
+// Read the records of a pieces section into the code image. The sections the
+// pieces refer to are read already. Returns FALSE if the records are
+// malformed.
+
+static bool read_pieces(const unsigned char *records, size_t size)
+{
+    CodePiece *piece;
+    size_t i;
+
+    if (size % OBJECT_PIECE_SIZE != 0) {
+        return false;
+    }
+    image->pieces = (CodePiece*)erealloc(image->pieces, (size / OBJECT_PIECE_SIZE + 1) * sizeof(*image->pieces));
+    for (i = 0; i < size; i += OBJECT_PIECE_SIZE) {
+        piece = &image->pieces[image->piece_count++];
+        piece->key = (unsigned long long)object_get(records + i, 4) << 32 | object_get(records + i + 4, 4);
+        piece->address = object_get(records + i + 8, 4);
+        piece->size = object_get(records + i + 12, 4);
+        piece->symbol = object_get(records + i + 16, 4);
+        piece->symbol_count = object_get(records + i + 20, 4);
+        piece->relocation = object_get(records + i + 24, 4);
+        piece->relocation_count = object_get(records + i + 28, 4);
+        piece->insn = object_get(records + i + 32, 4);
+        piece->insn_count = object_get(records + i + 36, 4);
+        if (piece->address + piece->size > image->size
+            || piece->symbol + piece->symbol_count > image->symbol_count
+            || piece->relocation + piece->relocation_count > image->relocation_count
+            || piece->insn + piece->insn_count > image->insn_count) {
+            return false;
+        }
+    }
+    return true;
+}
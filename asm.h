@@ -1,8 +1,78 @@
 #ifndef __PARTICLE_ASM_H__
 #define __PARTICLE_ASM_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include "file.h"
+#include "ir.h"
+#include "arena.h"
 
-File *assemble(File *);
+// Assembler passes
+#define ASM_PASSES_ONE 1 // encode lines as they are reached and backpatch forward references
+#define ASM_PASSES_TWO 2 // find every symbol first, then encode
+
+// A symbol that relocatable machine code defines
+typedef struct CodeSymbol {
+    const char *name;    // the name of the symbol
+    int type;            // SYMTYPE_LABEL or SYMTYPE_EQU
+    unsigned long value; // the value of an equate, or the address of a label from the start of the code
+} CodeSymbol;
+
+// A place in relocatable machine code where the value of a symbol goes once
+// the code is linked
+typedef struct Relocation {
+    const char *name;      // the name of the symbol
+    unsigned long address; // the address of the first byte of the value
+    int size;              // the number of bytes of the value
+} Relocation;
+
+// A piece of relocatable code that was joined with other pieces into one
+typedef struct CodePiece {
+    unsigned long long key;  // the key the piece was joined under
+    unsigned long address;   // the address the piece starts at
+    unsigned long size;      // the number of bytes of the piece
+    size_t symbol;           // the first symbol of the piece
+    size_t symbol_count;     // the number of symbols of the piece
+    size_t relocation;       // the first relocation of the piece
+    size_t relocation_count; // the number of relocations of the piece
+    size_t insn;             // the first instruction of the piece
+    size_t insn_count;       // the number of instructions of the piece
+} CodePiece;
+
+// Machine code: the image of the code segment the assembler produces.
+// Relocatable machine code starts at address 0 wherever it ends up, and
+// carries its symbols and the places that refer to them, so that it can be
+// linked with other machine code.
+typedef struct Code {
+    unsigned char *bytes; // the bytes of the image
+    size_t size;          // the number of bytes
+    size_t capacity;      // the number of bytes allocated
+    unsigned long entry;  // the address execution starts at
+    unsigned long *insns; // the address of every instruction, in the order they were assembled
+    size_t insn_count;    // the number of instructions
+    size_t insn_capacity; // the number of instruction addresses allocated
+    CodeSymbol *symbols;        // the symbols of relocatable code
+    size_t symbol_count;        // the number of symbols
+    Relocation *relocations;    // the places that refer to symbols in relocatable code
+    size_t relocation_count;    // the number of relocations
+    size_t relocation_capacity; // the number of relocations allocated
+    CodePiece *pieces;          // the pieces relocatable code was joined from
+    size_t piece_count;         // the number of pieces
+    Arena *names;               // the names of the symbols and relocations; NULL if there are none
+} Code;
+
+// Externally exposed
+extern int asm_passes;     // the number of passes the assembler makes
+extern bool asm_predecode; // writes pre-decoded instructions with machine code if TRUE
+
+Ir *asm_read(File *);
+Code *assemble(Ir *);
+Code *assemble_relocatable(Ir *);
+Code *code_link(Code **, size_t, const char *);
+Code *code_join(Code **, const unsigned long long *, size_t);
+Code *code_piece(Code *, size_t);
+void code_write(Code *, File *);
+Code *code_read(File *);
+void code_destroy(Code *);
 
 #endif  /* __PARTICLE_ASM_H__ */
@@ -13,7 +13,7 @@ set error_log=%~n0_error.log
 :: compile
 echo %0: Stage - Compilation
 echo %0: Compiling using gcc...
-gcc *.c -o particle 2> %error_log%
+gcc *.c -o particle -lpthread 2> %error_log%
 
 :: report compilation result
 if %ERRORLEVEL% equ 0 (
@@ -0,0 +1,497 @@
+// Compile cache
+//
+// The cache keeps the machine code of compiled sources in a directory, one
+// object file per source, named after a hash of the source bytes and of
+// everything else that goes into the code: the compiler version and the
+// options that change what is generated. A run of an unchanged source finds
+// its object file there and loads it like any other, without parsing or
+// assembling anything.
+//
+// An entry is written to a file of its own and renamed into place, so an
+// invocation never sees half an entry, and invocations that store the same
+// entry at once do not get in each other's way. When the entries take up
+// more than the limit, the least recently used ones are removed. The hit and
+// miss counters live in the directory too. Invocations add their counts to
+// them under a lock on a file of its own, so that counts from invocations
+// that finish at the same moment are not lost.
+//
+// In incremental mode, a Particle program that misses is compiled unit by
+// unit (see parser.c). The relocatable code of its units is kept in an
+// archive named after the source file, each unit under a hash of its tokens,
+// so that when a few functions of a program change, only those are
+// translated and assembled again, and the rest are linked from the archive.
+// The archive is one file, so that taking a thousand functions from it costs
+// one read.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
+#include "cache.h"
+#include "parser.h"
+#include "error.h"
+#include "utils.h"
+
+// The name of the file that holds the counters, the file that is locked
+// while they are updated, and the number of counters
+#define CACHE_COUNTERS "counters"
+#define CACHE_COUNTERS_LOCK "counters.lock"
+#define CACHE_COUNTER_COUNT 4
+
+// The extensions of entries: whole programs, and archives of the units of
+// programs
+#define CACHE_EXTENSION ".bin"
+#define CACHE_UNITS_EXTENSION ".units"
+
+// An entry, as found when the cache is trimmed
+typedef struct Entry {
+    char *name;    // the path of the entry
+    long size;     // the size of the entry in bytes
+    time_t mtime;  // the time the entry was last used
+} Entry;
+
+static char *cache_path(const char *, const char *, const char *);
+static void cache_write(Cache *, const char *, const char *, Code *);
+static bool cache_is_entry(const char *);
+static void cache_trim(Cache *);
+static void cache_read_counters(const char *, unsigned long *);
+static int entry_compare(const void *, const void *);
+static int piece_compare(const void *, const void *);
+static int key_compare(const void *, const void *);
+
+// Open a cache in a directory, creating the directory if it is not there yet.
+// The entries are kept under limit bytes.
+
+Cache *cache_open(const char *dir, unsigned long limit)
+{
+    Cache *cache;
+    struct stat st;
+
+#if defined(_WIN32)
+    mkdir(dir);
+#else
+    mkdir(dir, 0777);
+#endif
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fail("cache: could not create cache directory `%s'", dir);
+    }
+    cache = (Cache*)emalloc(sizeof(*cache));
+    cache->dir = dupstr(dir);
+    cache->limit = limit;
+    cache->salt = FNV1A64_BASIS;
+    cache->key[0] = '\0';
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->unit_hits = 0;
+    cache->unit_misses = 0;
+    return cache;
+}
+
+// Look up the entry of a source file. The key hashes the salt, which names
+// everything besides the source that goes into the code, and the bytes of the
+// source. The source is read from the start, and left at the start.
+//
+// Returns the entry, opened for reading, or NULL on a miss
+
+File *cache_lookup(Cache *cache, File *source, const char *salt)
+{
+    unsigned char buffer[8192];
+    unsigned long long hash;
+    size_t count;
+    char *path;
+    File *entry;
+
+    cache->salt = fnv1a64(FNV1A64_BASIS, salt, strlen(salt) + 1);
+    hash = cache->salt;
+    file_reset(source);
+    while ((count = fread(buffer, 1, sizeof(buffer), source->handle)) > 0) {
+        hash = fnv1a64(hash, buffer, count);
+    }
+    if (ferror(source->handle)) {
+        fail("%s: could not read source file", source->name);
+    }
+    file_reset(source);
+    snprintf(cache->key, sizeof(cache->key), "%016llx", hash);
+
+    path = cache_path(cache->dir, cache->key, CACHE_EXTENSION);
+    entry = file_try_open(path, "rb");
+    if (entry != NULL) {
+        // mark the entry as recently used, so trimming keeps it
+        utime(path, NULL);
+        cache->hits++;
+    }
+    else {
+        cache->misses++;
+    }
+    free(path);
+    return entry;
+}
+
+// Compile the Particle source of the last lookup unit by unit. The
+// relocatable code of the units the source was last compiled with is kept
+// in one archive, so that a unit that has not changed since is taken from
+// there instead of being translated and assembled again. The archive is
+// written again if any unit was not in it. The code of all units is linked
+// into the program.
+
+Code *cache_compile(Cache *cache, File *source)
+{
+    char key[CACHE_KEY_DIGITS + 1];
+    unsigned long long hash;
+    unsigned long long *keys;
+    Unit *units;
+    Code **pieces;
+    Code *archive;
+    Code *joined;
+    Code *code;
+    CodePiece *piece;
+    File *file;
+    char *path;
+    Ir *ir;
+    size_t count;
+    size_t misses;
+    size_t i;
+
+    hash = fnv1a64(cache->salt, source->name, strlen(source->name) + 1);
+    snprintf(key, sizeof(key), "%016llx", hash);
+    path = cache_path(cache->dir, key, CACHE_UNITS_EXTENSION);
+    archive = NULL;
+    file = file_try_open(path, "rb");
+    if (file != NULL) {
+        archive = code_read(file);
+        file_close(file);
+    }
+    if (archive != NULL) {
+        qsort(archive->pieces, archive->piece_count, sizeof(*archive->pieces), piece_compare);
+    }
+
+    units = parse_split(source, &count);
+    keys = (unsigned long long*)emalloc(count * sizeof(*keys));
+    pieces = (Code**)emalloc(count * sizeof(*pieces));
+    misses = 0;
+    for (i = 0; i < count; i++) {
+        // the first unit is told apart, since it is translated differently
+        keys[i] = fnv1a64(cache->salt, &units[i].hash, sizeof(units[i].hash));
+        keys[i] = fnv1a64(keys[i], i == 0 ? "head" : "def", i == 0 ? 4 : 3);
+        piece = NULL;
+        if (archive != NULL) {
+            piece = (CodePiece*)bsearch(&keys[i], archive->pieces, archive->piece_count, sizeof(*archive->pieces), key_compare);
+        }
+        if (piece != NULL) {
+            pieces[i] = code_piece(archive, piece - archive->pieces);
+        }
+        else {
+            ir = parse_unit(&units[i]);
+            pieces[i] = assemble_relocatable(ir);
+            ir_destroy(ir);
+            misses++;
+        }
+    }
+    parse_finish();
+    cache->unit_hits += count - misses;
+    cache->unit_misses += misses;
+
+    if (archive == NULL || misses > 0 || archive->piece_count != count) {
+        joined = code_join(pieces, keys, count);
+        cache_write(cache, key, CACHE_UNITS_EXTENSION, joined);
+        code_destroy(joined);
+    }
+    else {
+        // mark the archive as recently used, so trimming keeps it
+        utime(path, NULL);
+    }
+    code = code_link(pieces, count, source->name);
+
+    for (i = 0; i < count; i++) {
+        code_destroy(pieces[i]);
+    }
+    if (archive != NULL) {
+        code_destroy(archive);
+    }
+    free(pieces);
+    free(keys);
+    free(path);
+    return code;
+}
+
+// Store machine code as the entry of the last lookup
+
+void cache_store(Cache *cache, Code *code)
+{
+    cache_write(cache, cache->key, CACHE_EXTENSION, code);
+    cache_trim(cache);
+}
+
+// Add the counts of this invocation to the counters of the cache, and close
+// the cache
+
+void cache_close(Cache *cache)
+{
+    unsigned long counters[CACHE_COUNTER_COUNT];
+    char suffix[32];
+    char *temporary;
+    char *path;
+    FILE *handle;
+#if !defined(_WIN32)
+    char *lock_path;
+    int lock;
+#endif
+
+    path = cache_path(cache->dir, CACHE_COUNTERS, "");
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+    temporary = cache_path(cache->dir, CACHE_COUNTERS, suffix);
+
+#if !defined(_WIN32)
+    // the counters file itself is replaced, so the lock is held on another
+    // file. If it cannot be locked, counts may be lost, as without a lock.
+    lock_path = cache_path(cache->dir, CACHE_COUNTERS_LOCK, "");
+    lock = open(lock_path, O_RDWR | O_CREAT, 0666);
+    if (lock >= 0) {
+        flock(lock, LOCK_EX);
+    }
+    free(lock_path);
+#endif
+    cache_read_counters(cache->dir, counters);
+    handle = fopen(temporary, "w");
+    if (handle != NULL) {
+        fprintf(handle, "hits %lu\nmisses %lu\nunit hits %lu\nunit misses %lu\n", counters[0] + cache->hits, counters[1] + cache->misses, counters[2] + cache->unit_hits, counters[3] + cache->unit_misses);
+        if (fclose(handle) != 0 || rename(temporary, path) != 0) {
+            remove(temporary);
+        }
+    }
+#if !defined(_WIN32)
+    // closing the file releases the lock
+    if (lock >= 0) {
+        close(lock);
+    }
+#endif
+    free(temporary);
+    free(path);
+    free(cache->dir);
+    free(cache);
+}
+
+// Display the counters of the cache in a directory, and what its entries take
+// up
+
+void cache_report(const char *dir)
+{
+    unsigned long counters[CACHE_COUNTER_COUNT];
+    unsigned long count;
+    unsigned long bytes;
+    DIR *handle;
+    struct dirent *dirent;
+    struct stat st;
+    char *path;
+
+    cache_read_counters(dir, counters);
+    count = 0;
+    bytes = 0;
+    handle = opendir(dir);
+    if (handle != NULL) {
+        while ((dirent = readdir(handle)) != NULL) {
+            if (!cache_is_entry(dirent->d_name)) {
+                continue;
+            }
+            path = cache_path(dir, dirent->d_name, "");
+            if (stat(path, &st) == 0) {
+                count++;
+                bytes += st.st_size;
+            }
+            free(path);
+        }
+        closedir(handle);
+    }
+    printf("%s: compile cache\n", dir);
+    printf("hits:        %lu\n", counters[0]);
+    printf("misses:      %lu\n", counters[1]);
+    printf("unit hits:   %lu\n", counters[2]);
+    printf("unit misses: %lu\n", counters[3]);
+    printf("entries:     %lu (%lu bytes)\n", count, bytes);
+}
+
+// Make the path of a file in a cache directory: a name followed by a suffix
+
+static char *cache_path(const char *dir, const char *name, const char *suffix)
+{
+    char *path;
+
+    path = (char*)emalloc(strlen(dir) + strlen(name) + strlen(suffix) + 2);
+    sprintf(path, "%s/%s%s", dir, name, suffix);
+    return path;
+}
+
+// Write machine code as an entry of the cache, under a key and an extension.
+// The code is written to a file of its own and renamed into place.
+
+static void cache_write(Cache *cache, const char *key, const char *extension, Code *code)
+{
+    char suffix[32];
+    char *temporary;
+    char *path;
+    File *file;
+
+    snprintf(suffix, sizeof(suffix), "%s.%ld.tmp", extension, (long)getpid());
+    temporary = cache_path(cache->dir, key, suffix);
+    path = cache_path(cache->dir, key, extension);
+    file = file_try_open(temporary, "wb");
+    if (file == NULL) {
+        error("cache: could not write cache entry `%s'", temporary);
+    }
+    else {
+        code_write(code, file);
+        file_close(file);
+        if (rename(temporary, path) != 0) {
+            remove(temporary);
+        }
+    }
+    free(temporary);
+    free(path);
+}
+
+// Tell if a file name is the name of an entry: a key and an entry extension
+
+static bool cache_is_entry(const char *name)
+{
+    int i;
+
+    for (i = 0; i < CACHE_KEY_DIGITS; i++) {
+        if (name[i] == '\0' || strchr("0123456789abcdef", name[i]) == NULL) {
+            return false;
+        }
+    }
+    return strcmp(name + CACHE_KEY_DIGITS, CACHE_EXTENSION) == 0 || strcmp(name + CACHE_KEY_DIGITS, CACHE_UNITS_EXTENSION) == 0;
+}
+
+// Remove the least recently used entries until the entries fit the limit
+
+static void cache_trim(Cache *cache)
+{
+    Entry *entries;
+    size_t count;
+    size_t capacity;
+    unsigned long total;
+    DIR *handle;
+    struct dirent *dirent;
+    struct stat st;
+    char *path;
+    size_t i;
+
+    handle = opendir(cache->dir);
+    if (handle == NULL) {
+        return;
+    }
+    entries = NULL;
+    count = 0;
+    capacity = 0;
+    total = 0;
+    while ((dirent = readdir(handle)) != NULL) {
+        if (!cache_is_entry(dirent->d_name)) {
+            continue;
+        }
+        path = cache_path(cache->dir, dirent->d_name, "");
+        if (stat(path, &st) != 0) {
+            free(path);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            entries = (Entry*)erealloc(entries, capacity * sizeof(*entries));
+        }
+        entries[count].name = path;
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        count++;
+        total += st.st_size;
+    }
+    closedir(handle);
+
+    if (total > cache->limit) {
+        qsort(entries, count, sizeof(*entries), entry_compare);
+        for (i = 0; i < count && total > cache->limit; i++) {
+            // another invocation may have removed the entry already
+            if (remove(entries[i].name) == 0 || errno == ENOENT) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    for (i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+// Read the counters of the cache in a directory: program hits and misses,
+// and unit hits and misses. Counters that are missing read as zero.
+
+static void cache_read_counters(const char *dir, unsigned long *counters)
+{
+    FILE *handle;
+    char *path;
+    int i;
+
+    for (i = 0; i < CACHE_COUNTER_COUNT; i++) {
+        counters[i] = 0;
+    }
+    path = cache_path(dir, CACHE_COUNTERS, "");
+    handle = fopen(path, "r");
+    if (handle != NULL) {
+        if (fscanf(handle, "hits %lu misses %lu unit hits %lu unit misses %lu", &counters[0], &counters[1], &counters[2], &counters[3]) < 2) {
+            counters[0] = 0;
+            counters[1] = 0;
+        }
+        fclose(handle);
+    }
+    free(path);
+}
+
+// Order entries from the least to the most recently used
+
+static int entry_compare(const void *a, const void *b)
+{
+    const Entry *x = (const Entry *)a;
+    const Entry *y = (const Entry *)b;
+
+    if (x->mtime != y->mtime) {
+        return x->mtime < y->mtime ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Order pieces by key
+
+static int piece_compare(const void *a, const void *b)
+{
+    const CodePiece *x = (const CodePiece *)a;
+    const CodePiece *y = (const CodePiece *)b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return 0;
+}
+
+// Compare a key with the key of a piece, to look it up among pieces ordered
+// by piece_compare()
+
+static int key_compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = ((const CodePiece *)b)->key;
+
+    if (x != y) {
+        return x < y ? -1 : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef __PARTICLE_CACHE_H__
+#define __PARTICLE_CACHE_H__
+
+#include "file.h"
+#include "asm.h"
+
+// The number of hex digits in a cache key
+#define CACHE_KEY_DIGITS 16
+
+// The default limit on the bytes the entries of a cache may take up
+#define CACHE_DEFAULT_LIMIT (64UL * 1024 * 1024)
+
+// A compile cache
+typedef struct Cache {
+    char *dir;                         // the cache directory
+    unsigned long limit;               // the most bytes the entries may take up
+    unsigned long long salt;           // the hash of the salt of the last lookup
+    char key[CACHE_KEY_DIGITS + 1];    // the key of the last lookup
+    unsigned long hits;                // the lookups that found an entry
+    unsigned long misses;              // the lookups that did not
+    unsigned long unit_hits;           // the units of compiled programs found in the cache
+    unsigned long unit_misses;         // the units that were not
+} Cache;
+
+// Prototypes
+Cache *cache_open(const char *, unsigned long);
+File *cache_lookup(Cache *, File *, const char *);
+Code *cache_compile(Cache *, File *);
+void cache_store(Cache *, Code *);
+void cache_close(Cache *);
+void cache_report(const char *);
+
+#endif /* __PARTICLE_CACHE_H__ */
@@ -1,57 +1,90 @@
 #include <stdio.h>
-#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include "error.h"
 #include "emit.h"
 #include "file.h"
-#include "vm.h"
 #include "utils.h"
 #include "debug.h"
 
-// Emit byte
+// Create an emitter that writes to a file. Output collects in a buffer and
+// goes to the file a whole buffer at a time.
 
-/*
-void emitb(void *ptr, size_t size, byte data)
+Emitter *emitter_create(File *file)
 {
-    void *new_ptr;
-    new_ptr = erealloc(ptr, (size + sizeof(byte)) * sizeof *ptr);
-    new_ptr[size+sizeof(byte)] = data;
-    return new_ptr;
+    Emitter *emitter;
+
+    emitter = (Emitter*)emalloc(sizeof(*emitter));
+    emitter->file = file;
+    emitter->capacity = EMIT_BUFFER_SIZE;
+    emitter->buffer = (char*)emalloc(emitter->capacity);
+    emitter->size = 0;
+    return emitter;
 }
 
-void emitw(void *ptr, size_t size, word data)
+// Write the buffered output to the file
+
+void emitter_flush(Emitter *emitter)
 {
+    if (emitter->size > 0 && fwrite(emitter->buffer, 1, emitter->size, emitter->file->handle) != emitter->size) {
+        fail("Unable to write to file %s", emitter->file->name);
+    }
+    emitter->size = 0;
+}
 
+// Flush and destroy an emitter. The file is left open.
+
+void emitter_destroy(Emitter *emitter)
+{
+    emitter_flush(emitter);
+    free(emitter->buffer);
+    free(emitter);
 }
 
-void emitd(void *ptr, size_t size, dword data)
+// Make room in the buffer for a number of characters
+
+static void emit_reserve(Emitter *emitter, size_t length)
 {
+    if (emitter->capacity - emitter->size >= length) {
+        return;
+    }
+    emitter_flush(emitter);
+    if (emitter->capacity < length) {
+        emitter->capacity = length;
+        emitter->buffer = (char*)erealloc(emitter->buffer, emitter->capacity);
+    }
+}
+
+// Emit a character
 
+void emit_char(Emitter *emitter, int c)
+{
+    if (emitter->size == emitter->capacity) {
+        emitter_flush(emitter);
+    }
+    emitter->buffer[emitter->size++] = c;
 }
-*/
 
-void emit(File *file, const char *format, ... )
+// Emit a string of the given length
+
+void emit_string(Emitter *emitter, const char *s, size_t length)
 {
-    char *s;
-    s = (char*)emalloc(strlen(format)+1);
-    va_list args;
-    va_start(args, format);
-    vsprintf(s, format, args);
-    va_end(args);
-    fprintf(file->handle, "%s", s);
-    //free(s);
+    emit_reserve(emitter, length);
+    memcpy(emitter->buffer + emitter->size, s, length);
+    emitter->size += length;
 }
 
-void emitln(File *file, const char *format, ... )
+// Emit an unsigned integer in decimal
+
+void emit_uint(Emitter *emitter, unsigned long value)
 {
-    char *s;
-    s = (char*)emalloc(strlen(format)+1);
-    va_list args;
-    va_start(args, format);
-    vsprintf(s, format, args);
-    va_end(args);
-    //fseek(file->handle,0,SEEK_CUR);
-    fprintf(file->handle, "%s", s);
-    free(s);
+    char digits[24]; // enough for 64 bits
+    int i;
+
+    i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    emit_string(emitter, digits + i, sizeof(digits) - i);
 }
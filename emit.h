@@ -1,10 +1,25 @@
 #ifndef __PARTICLE_EMIT_H__
 #define __PARTICLE_EMIT_H__
 
-#include <stdarg.h>
+#include <stddef.h>
 #include "file.h"
 
-void emit(File *file, const char *format, ... );
-void emitln(File *file, const char *format, ... );
+// The size of the buffer an emitter collects output in
+#define EMIT_BUFFER_SIZE (64 * 1024)
+
+// Emitter
+typedef struct Emitter {
+    File *file;      // the file output goes to
+    char *buffer;    // output not yet written to the file
+    size_t size;     // the number of characters in the buffer
+    size_t capacity; // the size of the buffer
+} Emitter;
+
+Emitter *emitter_create(File *);
+void emitter_flush(Emitter *);
+void emitter_destroy(Emitter *);
+void emit_char(Emitter *, int);
+void emit_string(Emitter *, const char *, size_t);
+void emit_uint(Emitter *, unsigned long);
 
 #endif /* __PARTICLE_EMIT_H__ */
@@ -26,7 +26,7 @@ void fail(const char *format, ... )
     char s[256];
     va_list args;
     va_start(args, format);
-    vsprintf(s, format, args);
+    vsnprintf(s, sizeof(s), format, args);
     va_end(args);
     error("%s", s);
     exit(EXIT_FAILURE);
@@ -37,7 +37,7 @@ void report(File *file, Token *token, const char *format, ... )
     char s[256];
     va_list args;
     va_start(args,format);
-    vsprintf(s,format,args);
+    vsnprintf(s, sizeof(s), format, args);
     va_end(args);
     fail("%s:%d:%d: %s", file->name, token->lineno, token->colno, s);
 }
@@ -48,7 +48,7 @@ void expected(File *file, Token *token, const char *format, ... )
     char s[256];
     va_list args;
     va_start(args,format);
-    vsprintf(s,format,args);
+    vsnprintf(s, sizeof(s), format, args);
     va_end(args);
-    report(file, token, "Expected %s; found %s `%s'", s, token_meaning(token->type), token->lexeme);
+    report(file, token, "Expected %s; found %s `%.*s'", s, token_meaning(token->type), (int)token->length, token->lexeme);
 }
@@ -20,6 +20,27 @@ struct File *file_open(const char *name, const char *mode)
     return file;
 }
 
+// Like file_open(), but returns NULL instead of failing if the file cannot be
+// opened
+
+struct File *file_try_open(const char *name, const char *mode)
+{
+    File *file;
+    FILE *handle;
+
+    handle = fopen(name, mode);
+    if (handle == NULL) {
+        return NULL;
+    }
+    file = (File*)emalloc(sizeof(*file));
+    file->handle = handle;
+    file_reset(file);
+    file->name = dupstr(name);
+    file->lineno = 1;
+    file->colno = 1;
+    return file;
+}
+
 int file_getc(File *file)
 {
     int c;
@@ -61,5 +82,6 @@ long int file_size(File *file)
 void file_close(File *file)
 {
     fclose(file->handle);
+    free(file->name);
     free(file);
 }
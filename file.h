@@ -13,6 +13,7 @@ typedef struct File {
 
 // Prototypes
 File *file_open(const char *, const char *);
+File *file_try_open(const char *, const char *);
 int file_getc(File *);
 int file_reset(File *);
 long int file_size(File *);
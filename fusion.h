@@ -0,0 +1,33 @@
+#ifndef __PARTICLE_FUSION_H__
+#define __PARTICLE_FUSION_H__
+
+// Superinstructions
+//
+// The threaded engine fuses each of the opcode sequences listed below into a
+// single handler, so that the sequence costs one dispatch instead of two or
+// three. F2 lists a pair and F3 lists a triple; names are the opcode names
+// in opcode.h without the OC_ prefix. Only the last instruction of a sequence
+// may transfer control or write to memory, and HALT may not be fused.
+//
+// This is the built-in default table. To build a table tuned for a workload,
+// record an opcode profile and run `particle -F PROFILE > fusion.h`.
+
+#define FUSION_SET(F2, F3) \
+    F3(LOADBI, PUSHBI, SUBBI) \
+    F3(LOADDI, PUSHDI, ADDDI) \
+    F3(PUSHDI, ADDDI, JMP) \
+    F3(PUSHBI, ADDBI, JMP) \
+    F2(PUSHBI, JZ) \
+    F2(PUSHBI, JNZ) \
+    F2(DUPBI, PULLBI) \
+    F2(DUPDI, PULLDI) \
+    F2(POPBI, JMP) \
+    F2(POPDI, JMP) \
+    F2(PUSHBI, ADDBI) \
+    F2(PUSHBI, SUBBI) \
+    F2(PUSHDI, ADDDI) \
+    F2(PUSHDI, SUBDI) \
+    F2(LOADBI, JZ) \
+    F2(LOADDI, PUSHDI)
+
+#endif /* __PARTICLE_FUSION_H__ */
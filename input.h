@@ -1,18 +1,13 @@
 #ifndef __PARTICLE_INPUT_H__
 #define __PARTICLE_INPUT_H__
 
-#include <stdio.h>
-#include "file.h"
+#include <stddef.h>
 
-// Input represents an input from a file.
+// Input represents a character of the source text. Its line and column
+// numbers are worked out from its offset when they are needed.
 typedef struct Input {
-    char c;
-    unsigned int lineno; // stores the line number where input was found
-    unsigned int colno;  // stores the column number where input was found
-    File *file;          // stores the parent file
+    int c;         // the character, or EOF past the end of the text
+    size_t offset; // stores the offset in the source text where input was found
 } Input;
 
-Input *input_create();
-void input_destroy(Input *);
-
 #endif /* __PARTICLE_INPUT_H__ */
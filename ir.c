@@ -0,0 +1,142 @@
+// Assembly source
+//
+// The translator emits assembly as a list of lines in memory, and the
+// assembler reads the same list. Text assembly is only produced from the list
+// when it is asked for, so a compile never formats and re-lexes its own
+// output.
+
+#include <stdio.h>
+#include <string.h>
+#include "ir.h"
+#include "arena.h"
+#include "emit.h"
+#include "utils.h"
+
+// Create an empty assembly source. The name is that of the file the assembly
+// is read or translated from.
+
+Ir *ir_create(const char *name)
+{
+    Ir *ir;
+
+    ir = (Ir*)emalloc(sizeof(*ir));
+    ir->arena = arena_create(ARENA_BLOCK_SIZE);
+    ir->name = arena_dupstr(ir->arena, name);
+    ir->head = NULL;
+    ir->tail = NULL;
+    ir->count = 0;
+    return ir;
+}
+
+// Copy a name, such as a label or a mnemonic, into the assembly source. The
+// name need not be NUL-terminated; the copy is.
+
+const char *ir_name(Ir *ir, const char *name, size_t length)
+{
+    return arena_substr(ir->arena, name, length);
+}
+
+// Append a line to the assembly source. The label and the mnemonic may be
+// NULL; otherwise they must come from ir_name() or be string literals.
+
+IrLine *ir_emit(Ir *ir, const char *label, const char *mnemonic, unsigned int lineno)
+{
+    IrLine *line;
+
+    line = (IrLine*)arena_alloc(ir->arena, sizeof(*line));
+    line->label = label;
+    line->mnemonic = mnemonic;
+    line->operand.type = IR_OPERAND_NONE;
+    line->operand.text = NULL;
+    line->operand.length = 0;
+    line->operand.quote = '\0';
+    line->operand.value = 0;
+    line->lineno = lineno;
+    line->next = NULL;
+
+    if (ir->tail == NULL) {
+        ir->head = line;
+    }
+    else {
+        ir->tail->next = line;
+    }
+    ir->tail = line;
+    ir->count++;
+    return line;
+}
+
+// Give a line a symbol operand. The name must come from ir_name().
+
+void ir_operand_symbol(IrLine *line, const char *name)
+{
+    line->operand.type = IR_OPERAND_SYMBOL;
+    line->operand.text = name;
+    line->operand.length = strlen(name);
+}
+
+// Give a line an integer operand
+
+void ir_operand_int(IrLine *line, unsigned long value)
+{
+    line->operand.type = IR_OPERAND_INT;
+    line->operand.value = value;
+}
+
+// Give a line a string operand. The text is copied, and the quotation mark is
+// kept so the string is written back as it was read.
+
+void ir_operand_string(Ir *ir, IrLine *line, const char *text, size_t length, char quote)
+{
+    line->operand.type = IR_OPERAND_STRING;
+    line->operand.text = arena_substr(ir->arena, text, length);
+    line->operand.length = length;
+    line->operand.quote = quote;
+}
+
+// Write the assembly source as text
+
+void ir_write(Ir *ir, File *file)
+{
+    Emitter *emitter;
+    IrLine *line;
+
+    emitter = emitter_create(file);
+    for (line = ir->head; line != NULL; line = line->next) {
+        if (line->label != NULL) {
+            emit_string(emitter, line->label, strlen(line->label));
+            emit_char(emitter, ':');
+        }
+        if (line->mnemonic != NULL) {
+            emit_string(emitter, "    ", line->label != NULL ? 1 : 4);
+            emit_string(emitter, line->mnemonic, strlen(line->mnemonic));
+            switch (line->operand.type) {
+                case IR_OPERAND_SYMBOL:
+                    emit_char(emitter, ' ');
+                    emit_string(emitter, line->operand.text, line->operand.length);
+                    break;
+                case IR_OPERAND_INT:
+                    emit_char(emitter, ' ');
+                    emit_uint(emitter, line->operand.value);
+                    break;
+                case IR_OPERAND_STRING:
+                    emit_char(emitter, ' ');
+                    emit_char(emitter, line->operand.quote);
+                    emit_string(emitter, line->operand.text, line->operand.length);
+                    emit_char(emitter, line->operand.quote);
+                    break;
+                case IR_OPERAND_NONE:
+                    break;
+            }
+        }
+        emit_char(emitter, '\n');
+    }
+    emitter_destroy(emitter);
+}
+
+// Destroy an assembly source and all of its lines
+
+void ir_destroy(Ir *ir)
+{
+    arena_destroy(ir->arena);
+    free(ir);
+}
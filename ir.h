@@ -0,0 +1,56 @@
+#ifndef __PARTICLE_IR_H__
+#define __PARTICLE_IR_H__
+
+#include <stddef.h>
+#include "arena.h"
+#include "file.h"
+
+// Operand types
+typedef enum IrOperandType {
+    IR_OPERAND_NONE,   // the line has no operand
+    IR_OPERAND_SYMBOL, // a label or equate name
+    IR_OPERAND_INT,    // an integer
+    IR_OPERAND_STRING  // a string
+} IrOperandType;
+
+// Operand of an assembly line
+typedef struct IrOperand {
+    IrOperandType type;  // operand type
+    const char *text;    // the name of a symbol or the text of a string; NUL-terminated
+    size_t length;       // the length of the text
+    char quote;          // the quotation mark a string was written with
+    unsigned long value; // the value of an integer
+} IrOperand;
+
+// An assembly line. Any part of a line may be missing: a line can hold just a
+// label, just an instruction, or both.
+typedef struct IrLine {
+    const char *label;    // the label defined on the line, or NULL
+    const char *mnemonic; // the mnemonic of the instruction or directive, or NULL
+    IrOperand operand;    // the operand of the instruction or directive
+    unsigned int lineno;  // the line of the source the line was translated from
+    struct IrLine *next;  // the next line
+} IrLine;
+
+// An assembly source is a linked list of assembly lines. The parser emits it
+// and the assembler reads it, so that assembly is only written out as text
+// when asked for.
+typedef struct Ir {
+    const char *name; // the name of the file the assembly comes from, for messages
+    IrLine *head;     // the first line
+    IrLine *tail;     // the last line
+    size_t count;     // the number of lines
+    Arena *arena;     // the lines and their names are allocated from here
+} Ir;
+
+// IR operations
+Ir *ir_create(const char *);
+const char *ir_name(Ir *, const char *, size_t);
+IrLine *ir_emit(Ir *, const char *, const char *, unsigned int);
+void ir_operand_symbol(IrLine *, const char *);
+void ir_operand_int(IrLine *, unsigned long);
+void ir_operand_string(Ir *, IrLine *, const char *, size_t, char);
+void ir_write(Ir *, File *);
+void ir_destroy(Ir *);
+
+#endif /* __PARTICLE_IR_H__ */
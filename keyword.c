@@ -0,0 +1,89 @@
+// Keyword tables
+//
+// A keyword table maps a fixed set of names (keywords, operators, opcode
+// mnemonics) to values. When a table is set up it searches for a hash seed
+// under which every name gets a slot of its own. A lookup is then one hash of
+// the name and at most one comparison, however many names the table holds.
+
+#include <stdlib.h>
+#include <string.h>
+#include "keyword.h"
+#include "error.h"
+#include "utils.h"
+
+// Seeds to try at each table size before the table is doubled
+#define KEYWORD_SEED_TRIES 4096
+
+static bool keyword_place(KeywordTable *);
+
+// Set up a keyword table. If a name is listed more than once, the first entry
+// wins.
+
+void keyword_table_init(KeywordTable *table, const Keyword *keywords, int count)
+{
+    unsigned int size;
+    int tries;
+
+    table->keywords = keywords;
+    table->count = count;
+
+    // start with at least twice as many slots as keywords
+    size = 1;
+    while (size < 2 * (unsigned int)count) {
+        size *= 2;
+    }
+    table->slots = NULL;
+    for (;;) {
+        table->mask = size - 1;
+        table->slots = (short*)erealloc(table->slots, size * sizeof(*table->slots));
+        for (tries = 0; tries < KEYWORD_SEED_TRIES; tries++) {
+            table->seed = FNV1A32_BASIS + tries;
+            if (keyword_place(table)) {
+                return;
+            }
+        }
+        size *= 2;
+    }
+}
+
+// Look up a name of the given length. Returns the value of the keyword, or -1
+// if the name is not a keyword.
+
+int keyword_lookup(const KeywordTable *table, const char *name, size_t length)
+{
+    const Keyword *keyword;
+    int index;
+
+    index = table->slots[fnv1a32(table->seed, name, length) & table->mask];
+    if (index < 0) {
+        return -1;
+    }
+    keyword = &table->keywords[index];
+    if (strncmp(keyword->name, name, length) != 0 || keyword->name[length] != '\0') {
+        return -1;
+    }
+    return keyword->value;
+}
+
+// Place every keyword in a slot using the table's seed. Returns FALSE if two
+// different names collide.
+
+static bool keyword_place(KeywordTable *table)
+{
+    unsigned int slot;
+    int other;
+    int i;
+
+    memset(table->slots, -1, (table->mask + 1) * sizeof(*table->slots));
+    for (i = 0; i < table->count; i++) {
+        slot = fnv1a32(table->seed, table->keywords[i].name, strlen(table->keywords[i].name)) & table->mask;
+        other = table->slots[slot];
+        if (other < 0) {
+            table->slots[slot] = i;
+        }
+        else if (strcmp(table->keywords[other].name, table->keywords[i].name) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
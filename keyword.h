@@ -0,0 +1,27 @@
+#ifndef __PARTICLE_KEYWORD_H__
+#define __PARTICLE_KEYWORD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A keyword and the value it stands for
+typedef struct Keyword {
+    const char *name; // the keyword
+    int value;        // the value it stands for
+} Keyword;
+
+// A keyword table finds a keyword with one hash and one comparison. The table
+// is a perfect hash: the seed is chosen so that no two keywords share a slot.
+typedef struct KeywordTable {
+    const Keyword *keywords; // the keywords
+    int count;               // the number of keywords
+    unsigned int seed;       // the hash seed that spreads the keywords without collisions
+    unsigned int mask;       // the number of slots minus one; the number of slots is a power of two
+    short *slots;            // index of the keyword in each slot, or -1 for an empty slot
+} KeywordTable;
+
+// Keyword table operations
+void keyword_table_init(KeywordTable *, const Keyword *, int);
+int keyword_lookup(const KeywordTable *, const char *, size_t);
+
+#endif /* __PARTICLE_KEYWORD_H__ */
@@ -7,37 +7,55 @@
 #include "lexer.h"
 #include "token.h"
 #include "input.h"
+#include "source.h"
+#include "keyword.h"
+#include "arena.h"
 #include "debug.h"
 #include "utils.h"
 
+// Results of integer evaluation
+#define INT_VALID    0 // the lexeme is an integer that fits in a dword
+#define INT_INVALID  1 // the lexeme is not an integer
+#define INT_OVERFLOW 2 // the lexeme is an integer that does not fit in a dword
+
+// The largest integer a dword holds
+#define INT_DWORD_MAX 0xFFFFFFFFUL
+
+// Runs of whitespace and comment bodies are skipped a vector at a time where
+// the target has vector instructions
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LEXER_SKIP_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LEXER_SKIP_SSE2
+#endif
+
+// Scanner
+static void lexer_locate(Lexer *, Token *);
+static void lexer_take(Lexer *, Token *);
+static void lexer_scan(Lexer *, Token *, bool);
+static void lexer_scan_table(Lexer *, Token *, bool);
+static void lexer_tokenize(Lexer *, Token *);
+static void lexer_tables_init(void);
+static void lexer_skip_whitespace(Lexer *);
+static void lexer_skip_comment(Lexer *);
+static size_t skip_whitespace(const char *, size_t, size_t);
+static size_t skip_comment(const char *, size_t, size_t);
+
 // Evaluators
-static int eval_bin(const char *);
-static int eval_oct(const char *);
-static int eval_dec(const char *);
-static int eval_hex(const char *);
-static int eval(const char *, int);
+static int eval_int(const char *, size_t, int *);
 static int eval_digit(int);
-static char *eval_dqstr(char *);
-static char *eval_sqstr(char *);
-
-// Terminal recognizer
-static bool is_terminal(const char *, const char *);
+static char *eval_dqstr(Arena *, const char *, size_t);
+static char *eval_sqstr(Arena *, const char *, size_t);
 
 // Token recognizers
-static bool is_id(const char *);
-static bool is_int(const char *);
-static bool is_bin(const char *);
-static bool is_oct(const char *);
-static bool is_dec(const char *);
-static bool is_hex(const char *);
-static bool is_sqstr(const char *);
-static bool is_dqstr(const char *);
+static int lexeme_char(const char *, size_t, size_t);
+static bool is_id(const char *, size_t);
+static bool is_sqstr(const char *, size_t);
+static bool is_dqstr(const char *, size_t);
 
 // Atom recognizers
-static bool is_bindigit(int);
-static bool is_octdigit(int);
-static bool is_decdigit(int);
-static bool is_hexdigit(int);
 static bool is_digit(int);
 static bool is_letter(int);
 static bool is_visible_ascii_character(int);
@@ -59,47 +77,421 @@ static bool is_backslash(int);
 static bool is_symbol(int);
 static bool is_whitespace(int);
 
+//==============================================================================
+// Terminals
+//==============================================================================
+
+// Operators, punctuators and keywords, and their token types
+
+static const Keyword terminal_list[] = {
+    { "+", t_add_op },
+    { "-", t_sub_op },
+    { "*", t_mul_op },
+    { "/", t_div_op },
+    { "%", t_mod_op },
+    { "$", t_sizeof_op },
+    { "&", t_addrof_op },
+    { "~", t_bitwise_neg_op },
+    { ",", t_comma },
+    { "(", t_lparen },
+    { ")", t_rparen },
+    { "[", t_lbracket },
+    { "]", t_rbracket },
+    { "^", t_bitwise_xor_op },
+    { ";", t_semicolon },
+    { ":", t_colon },
+    { "::", t_base_op },
+    { "|", t_bitwise_or_op },
+    { "||", t_logical_or_op },
+    { "&&", t_logical_and_op },
+    { "=", t_assign_op },
+    { "==", t_eq_op },
+    { "!", t_logical_neg_op },
+    { "!=", t_neq_op },
+    { "<", t_lt_op },
+    { "<<", t_bitwise_shl_op },
+    { "<<<", t_bitwise_rol_op },
+    { ">", t_gt_op },
+    { ">>", t_bitwise_shr_op },
+    { ">>>", t_bitwise_ror_op },
+    { "entry", t_entry },
+    { "def", t_def },
+    { "enddef", t_enddef },
+    { "var", t_var },
+    { "endvar", t_endvar },
+    { "body", t_body },
+    { "end", t_end },
+    { "void", t_void },
+    { "byte", t_byte },
+    { "word", t_word },
+    { "dword", t_dword },
+    { "null", t_null },
+    { "false", t_false },
+    { "true", t_true },
+    { "break", t_break },
+    { "continue", t_continue },
+    { "next", t_next },
+    { "ret", t_ret },
+    { "if", t_if },
+    { "endif", t_endif },
+    { "else", t_else },
+    { "elseif", t_elseif },
+    { "while", t_while },
+    { "endwhile", t_endwhile },
+    { "for", t_for },
+    { "endfor", t_endfor },
+};
+
+static KeywordTable terminals; // lookup table for terminal_list
+static bool terminals_ready;   // TRUE once the lookup table is set up
+
+//==============================================================================
+// States
+//==============================================================================
+
+// States of the scanner. See the state transition table in lexer_scan().
+
+enum State {
+    S0,
+    S1,
+    S2,
+    S2_1,
+    S2_2,
+    S2_3,
+    S2_4,
+    S2_5,
+    S2_6,
+    S2_6_1,
+    S2_7,
+    S2_7_1,
+    S3,
+    S4,
+    S5,
+    S5_1,
+    S5_1_1,
+    S6,
+    S6_1,
+    S6_1_1,
+    S7,
+    S7_1,
+    S8
+};
+
+#define S_COUNT (S8 + 1) // the number of states
+
+//==============================================================================
+// Transition tables
+//==============================================================================
+
+// The table-driven scanner runs the state transition table documented in
+// lexer_scan() from a dense array, indexed by state and character class.
+
+// Character classes. Characters in a class drive the same transitions.
+enum CharClass {
+    C_WHITESPACE, // see is_whitespace()
+    C_EOL,        // "\n"
+    C_EOF,        // end of the source text
+    C_SQMARK,     // "'"
+    C_DQMARK,     // '"'
+    C_COMMENT,    // "#"
+    C_BACKSLASH,  // "\\"
+    C_COLON,      // ":"
+    C_BAR,        // "|"
+    C_AMPERSAND,  // "&"
+    C_EQUALS,     // "="
+    C_BANG,       // "!"
+    C_LT,         // "<"
+    C_GT,         // ">"
+    C_SYMBOL,     // any other symbol; see is_symbol()
+    C_OTHER,      // anything else
+    C_ANY,        // stands for every class in a rule
+    C_COUNT = C_ANY // the number of classes
+};
+
+// Actions of a transition, taken before the next state is entered
+#define A_NONE    0x00 // do nothing
+#define A_LOCATE  0x01 // start the token at the input
+#define A_TAKE    0x02 // push input to lexeme; get next input
+#define A_IGNORE  0x04 // ignore input; get next input
+#define A_SKIP    0x08 // ignore the run of whitespace; get next input
+#define A_COMMENT 0x10 // ignore input up to eol or eof; get next input
+
+// A transition of the table-driven scanner
+typedef struct Transition {
+    unsigned char next;   // the next state
+    unsigned char action; // the actions to take
+} Transition;
+
+// A line of the state transition table. Rules for C_ANY come first for a
+// state, and the rules after them override it for single classes.
+typedef struct TransitionRule {
+    unsigned char state;  // the current state
+    unsigned char class;  // the class of the input
+    unsigned char next;   // the next state
+    unsigned char action; // the actions to take
+} TransitionRule;
+
+static const TransitionRule transition_rules[] = {
+    { S1,     C_ANY,        S8,     A_LOCATE },
+    { S1,     C_WHITESPACE, S1,     A_SKIP },
+    { S1,     C_COLON,      S2,     A_LOCATE },
+    { S1,     C_BAR,        S2,     A_LOCATE },
+    { S1,     C_AMPERSAND,  S2,     A_LOCATE },
+    { S1,     C_EQUALS,     S2,     A_LOCATE },
+    { S1,     C_BANG,       S2,     A_LOCATE },
+    { S1,     C_LT,         S2,     A_LOCATE },
+    { S1,     C_GT,         S2,     A_LOCATE },
+    { S1,     C_SYMBOL,     S2,     A_LOCATE },
+    { S1,     C_EOL,        S3,     A_LOCATE }, // without EOL tokens, see lexer_tables_init()
+    { S1,     C_EOF,        S4,     A_LOCATE },
+    { S1,     C_SQMARK,     S5,     A_LOCATE },
+    { S1,     C_DQMARK,     S6,     A_LOCATE },
+    { S1,     C_COMMENT,    S7,     A_NONE },
+    { S2,     C_ANY,        S0,     A_NONE },
+    { S2,     C_COLON,      S2_1,   A_TAKE },
+    { S2,     C_BAR,        S2_2,   A_TAKE },
+    { S2,     C_AMPERSAND,  S2_3,   A_TAKE },
+    { S2,     C_EQUALS,     S2_4,   A_TAKE },
+    { S2,     C_BANG,       S2_5,   A_TAKE },
+    { S2,     C_LT,         S2_6,   A_TAKE },
+    { S2,     C_GT,         S2_7,   A_TAKE },
+    { S2,     C_SYMBOL,     S0,     A_TAKE },
+    { S2_1,   C_ANY,        S0,     A_NONE },
+    { S2_1,   C_COLON,      S0,     A_TAKE },
+    { S2_2,   C_ANY,        S0,     A_NONE },
+    { S2_2,   C_BAR,        S0,     A_TAKE },
+    { S2_3,   C_ANY,        S0,     A_NONE },
+    { S2_3,   C_AMPERSAND,  S0,     A_TAKE },
+    { S2_4,   C_ANY,        S0,     A_NONE },
+    { S2_4,   C_EQUALS,     S0,     A_TAKE },
+    { S2_5,   C_ANY,        S0,     A_NONE },
+    { S2_5,   C_EQUALS,     S0,     A_TAKE },
+    { S2_6,   C_ANY,        S0,     A_NONE },
+    { S2_6,   C_LT,         S2_6_1, A_TAKE },
+    { S2_6,   C_EQUALS,     S0,     A_TAKE },
+    { S2_6_1, C_ANY,        S0,     A_NONE },
+    { S2_6_1, C_LT,         S0,     A_TAKE },
+    { S2_7,   C_ANY,        S0,     A_NONE },
+    { S2_7,   C_GT,         S2_7_1, A_TAKE },
+    { S2_7,   C_EQUALS,     S0,     A_TAKE },
+    { S2_7_1, C_ANY,        S0,     A_NONE },
+    { S2_7_1, C_GT,         S0,     A_TAKE },
+    { S3,     C_ANY,        S0,     A_IGNORE },
+    { S4,     C_ANY,        S0,     A_NONE },
+    { S5,     C_ANY,        S5_1,   A_TAKE },
+    { S5_1,   C_ANY,        S5_1,   A_TAKE },
+    { S5_1,   C_BACKSLASH,  S5_1_1, A_TAKE },
+    { S5_1,   C_EOL,        S0,     A_NONE },
+    { S5_1,   C_EOF,        S0,     A_NONE },
+    { S5_1,   C_SQMARK,     S0,     A_TAKE },
+    { S5_1_1, C_ANY,        S5_1,   A_TAKE },
+    { S5_1_1, C_EOL,        S0,     A_NONE },
+    { S5_1_1, C_EOF,        S0,     A_NONE },
+    { S6,     C_ANY,        S6_1,   A_TAKE },
+    { S6_1,   C_ANY,        S6_1,   A_TAKE },
+    { S6_1,   C_BACKSLASH,  S6_1_1, A_TAKE },
+    { S6_1,   C_EOL,        S0,     A_NONE },
+    { S6_1,   C_EOF,        S0,     A_NONE },
+    { S6_1,   C_DQMARK,     S0,     A_TAKE },
+    { S6_1_1, C_ANY,        S6_1,   A_TAKE },
+    { S6_1_1, C_EOL,        S0,     A_NONE },
+    { S6_1_1, C_EOF,        S0,     A_NONE },
+    { S7,     C_ANY,        S7_1,   A_COMMENT },
+    { S7_1,   C_ANY,        S7_1,   A_IGNORE },
+    { S7_1,   C_EOL,        S1,     A_NONE },
+    { S7_1,   C_EOF,        S1,     A_NONE },
+    { S8,     C_ANY,        S0,     A_NONE },
+    { S8,     C_OTHER,      S8,     A_TAKE },
+    { S8,     C_BACKSLASH,  S8,     A_TAKE },
+};
+
+// The class of every character, indexed by the character plus one so that
+// EOF has a class too
+static unsigned char char_classes[1 + 256];
+
+// The transition tables, one for scanning without EOL tokens and one for
+// scanning with them
+static Transition transitions[2][S_COUNT][C_COUNT];
+
 //==============================================================================
 // Scanner
 //==============================================================================
 
-// Create lexer
+int lexer_engine = LEXER_ENGINE_SWITCH; // the scanner of new lexers
+unsigned long long lexer_tokens = 0;    // the tokens read by all lexers
+
+// Create lexer for a source file. The lexer, and the values of the tokens it
+// reads, are allocated from the given arena and last as long as it does.
 
-Lexer *lexer_create()
+Lexer *lexer_create(File *file, Arena *arena)
 {
     Lexer *ptr;
-    ptr = emalloc(sizeof(*ptr));
+    ptr = (Lexer*)arena_alloc(arena, sizeof(*ptr));
+    if (!terminals_ready) {
+        keyword_table_init(&terminals, terminal_list, sizeof(terminal_list) / sizeof(terminal_list[0]));
+        lexer_tables_init();
+        terminals_ready = true;
+    }
+
+    ptr->file = file;
+    ptr->engine = lexer_engine;
+    ptr->arena = arena;
+    ptr->source = source_create(file);
+    ptr->pos = 0;
+    ptr->ring_next = 0;
+
+    // Get first character for the lexer to start with
+    lexer_next_char(ptr);
     return ptr;
 }
 
+// Destroy lexer. The source text is released; the file is left open, and the
+// lexer's memory goes with its arena.
+
+void lexer_destroy(Lexer *lexer)
+{
+    source_destroy(lexer->source);
+}
+
+// Move the lexer to an offset in the source text. The next token is read
+// from there.
+//
+// \param Lexer lexer:   The lexer context
+// \param size_t offset: The offset to read from
+void lexer_seek(Lexer *lexer, size_t offset)
+{
+    lexer->pos = offset;
+    lexer_next_char(lexer);
+}
+
 // Get next character from source file
 //
 // \param Lexer lexer: The lexer context
-// \return
-Input *lexer_next_char(Lexer *lexer)
+void lexer_next_char(Lexer *lexer)
 {
+    lexer->input.offset = lexer->pos;
+    if (lexer->pos < lexer->source->size) {
+        lexer->input.c = (unsigned char)lexer->source->text[lexer->pos++];
+    }
+    else {
+        lexer->input.c = EOF;
+    }
+}
 
-    int c;
-    Input *input;
-
-
-    input = input_create();
-
+// Store the location of the current input character to a token, for the
+// compiler to display. The token's lexeme starts here.
+static void lexer_locate(Lexer *lexer, Token *token)
+{
+    token->offset = lexer->input.offset;
+    token->lexeme = lexer->source->text + token->offset;
+    source_locate(lexer->source, lexer->input.offset, &token->lineno, &token->colno);
+}
 
-    input->c = file_getc(lexer->file);
+// Add the current input character to the token's lexeme and get the next
+// input. The lexeme is a slice of the source text, so this only extends it.
+static void lexer_take(Lexer *lexer, Token *token)
+{
+    token->length++;
+    lexer_next_char(lexer);
+}
 
+// Skip the run of whitespace that starts at the current input character, and
+// get the first input after it
+static void lexer_skip_whitespace(Lexer *lexer)
+{
+    lexer->pos = skip_whitespace(lexer->source->text, lexer->pos, lexer->source->size);
+    lexer_next_char(lexer);
+}
 
-    if (ferror(lexer->file->handle)) {
+// Skip the rest of a comment, up to the EOL or EOF that ends it, and get that
+// EOL or EOF as input
+static void lexer_skip_comment(Lexer *lexer)
+{
+    lexer->pos = skip_comment(lexer->source->text, lexer->pos, lexer->source->size);
+    lexer_next_char(lexer);
+}
 
-        fail("Unable to read character from source file.");
+// Find the end of a run of whitespace in a text. Returns the offset of the
+// first character from pos on that is not whitespace, or size if there is
+// none. See is_whitespace() for what counts as whitespace.
+static size_t skip_whitespace(const char *text, size_t pos, size_t size)
+{
+#if defined(LEXER_SKIP_AVX2)
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i del = _mm256_set1_epi8(127);
+    const __m256i eol = _mm256_set1_epi8('\n');
+    __m256i v;
+    __m256i visible;
+    unsigned int stop;
+
+    while (pos + 32 <= size) {
+        // Visible characters are the bytes between space and DEL, exclusive.
+        // Compared as signed bytes, the bytes from 128 up are below space.
+        v = _mm256_loadu_si256((const __m256i*)(text + pos));
+        visible = _mm256_and_si256(_mm256_cmpgt_epi8(v, space), _mm256_cmpgt_epi8(del, v));
+        stop = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(visible, _mm256_cmpeq_epi8(v, eol)));
+        if (stop != 0) {
+            return pos + __builtin_ctz(stop);
+        }
+        pos += 32;
     }
+#elif defined(LEXER_SKIP_SSE2)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i del = _mm_set1_epi8(127);
+    const __m128i eol = _mm_set1_epi8('\n');
+    __m128i v;
+    __m128i visible;
+    unsigned int stop;
+
+    while (pos + 16 <= size) {
+        // Visible characters are the bytes between space and DEL, exclusive.
+        // Compared as signed bytes, the bytes from 128 up are below space.
+        v = _mm_loadu_si128((const __m128i*)(text + pos));
+        visible = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, del));
+        stop = (unsigned int)_mm_movemask_epi8(_mm_or_si128(visible, _mm_cmpeq_epi8(v, eol)));
+        if (stop != 0) {
+            return pos + __builtin_ctz(stop);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < size && is_whitespace((unsigned char)text[pos])) {
+        pos++;
+    }
+    return pos;
+}
 
-
-    input->file = lexer->file;
-    input->colno = lexer->file->colno;
-    input->lineno = lexer->file->lineno;
-
-    return input;
+// Find the end of a comment body in a text. Returns the offset of the first
+// EOL from pos on, or size if there is none.
+static size_t skip_comment(const char *text, size_t pos, size_t size)
+{
+#if defined(LEXER_SKIP_AVX2)
+    const __m256i eol = _mm256_set1_epi8('\n');
+    unsigned int stop;
+
+    while (pos + 32 <= size) {
+        stop = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(text + pos)), eol));
+        if (stop != 0) {
+            return pos + __builtin_ctz(stop);
+        }
+        pos += 32;
+    }
+#elif defined(LEXER_SKIP_SSE2)
+    const __m128i eol = _mm_set1_epi8('\n');
+    unsigned int stop;
+
+    while (pos + 16 <= size) {
+        stop = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(text + pos)), eol));
+        if (stop != 0) {
+            return pos + __builtin_ctz(stop);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < size && !is_eol((unsigned char)text[pos])) {
+        pos++;
+    }
+    return pos;
 }
 
 // Get next token (greedy tokenizer)
@@ -108,6 +500,36 @@ Input *lexer_next_char(Lexer *lexer)
 // \param bool using_eol: If TRUE the T_EOL token is scanned for; otherwise
 //                        the T_EOF is not scanned for
 Token *lexer_next_token(Lexer *lexer, bool using_eol)
+{
+    Token *token; // stores the token to return
+
+    // Hand out the next token of the ring
+    token = &lexer->ring[lexer->ring_next];
+    lexer->ring_next = (lexer->ring_next + 1) % LEXER_TOKEN_RING_SIZE;
+    token->lexeme = "";
+    token->length = 0;
+    token->eol = false;
+    token->eof = false;
+    token->intval = 0;
+    token->strval = NULL;
+
+    if (lexer->engine == LEXER_ENGINE_TABLE) {
+        lexer_scan_table(lexer, token, using_eol);
+    }
+    else {
+        lexer_scan(lexer, token, using_eol);
+    }
+    lexer_tokenize(lexer, token);
+    lexer_tokens++;
+    return token;
+}
+
+// Scan the lexeme of the next token
+//
+// \param Lexer lexer:    The lexer context
+// \param Token token:    The token to store the lexeme to
+// \param bool using_eol: If TRUE the T_EOL token is scanned for
+static void lexer_scan(Lexer *lexer, Token *token, bool using_eol)
 {
     /*
     State transition table:
@@ -119,7 +541,7 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
     -------------   ------------------  ----------  ------------------------------------
     current state   input               next state  action
     -------------   ------------------  ----------  ------------------------------------
-    1               whitespace          1           ignore input; get next input
+    1               whitespace          1           ignore the run of whitespace; get next input
     1               symbol              2           do nothing
     1               eol && using_eol    3           do nothing
     1               eol && !using eol   1           ignore input; get next input
@@ -190,7 +612,7 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
     6.1.1           eol                 0           do nothing
     6.1.1           eof                 0           do nothing
     6.1.1           anything else       6.1         push input to lexeme; get next input
-    7               comment initiator   7.1         ignore input; get next input
+    7               comment initiator   7.1         ignore input up to eol or eof; get next input
     7.1             eol                 1           do nothing
     7.1             eof                 1           do nothing
     7.1             anything else       7.1         ignore input; get next input
@@ -206,41 +628,11 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
     -------------   ------------------  ----------  ------------------------------------
     */
 
-    enum State {
-        S0,
-        S1,
-        S2,
-        S2_1,
-        S2_2,
-        S2_3,
-        S2_4,
-        S2_5,
-        S2_6,
-        S2_6_1,
-        S2_7,
-        S2_7_1,
-        S3,
-        S4,
-        S5,
-        S5_1,
-        S5_1_1,
-        S6,
-        S6_1,
-        S6_1_1,
-        S7,
-        S7_1,
-        S8
-    };
 
     enum State next_state;
     enum State current_state;
     bool done; // indicates the end of the tokenization process
-    Token *token; // stores the token to return
-
 
-    token = token_create();
-
-    token_flush_lexeme(token);
     done = false;
     next_state = S1;
 
@@ -251,99 +643,84 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
         switch (current_state) {
             // Scanner
             case S1:
-                if (is_whitespace(lexer->input->c)) {
-                    lexer->input = lexer_next_char(lexer);
+                if (is_whitespace(lexer->input.c)) {
+                    lexer_skip_whitespace(lexer);
                     next_state = current_state;
                 }
-                else if (is_symbol(lexer->input->c)) {
-                    token->lineno = lexer->input->lineno; // store the location where the token was encountered
-                    token->colno = lexer->input->colno; //   to the token, for the compiler to display
+                else if (is_symbol(lexer->input.c)) {
+                    lexer_locate(lexer, token);
                     next_state = S2;
                 }
                 // if we are using EOL lets process it
-                else if (using_eol && is_eol(lexer->input->c)) {
+                else if (using_eol && is_eol(lexer->input.c)) {
 
-                    token->lineno = lexer->input->lineno;
-                    token->colno = lexer->input->colno;
+                    lexer_locate(lexer, token);
                     next_state = S3;
                 }
                 // if we are not using EOL then treat the EOL like whitespace and skip over it
-                else if (!using_eol && is_eol(lexer->input->c)) {
-                    lexer->input = lexer_next_char(lexer);
+                else if (!using_eol && is_eol(lexer->input.c)) {
+                    lexer_next_char(lexer);
                     next_state = current_state;
                 }
-                else if (is_eof(lexer->input->c)) {
-                    token->lineno = lexer->input->lineno;
-                    token->colno = lexer->input->colno;
+                else if (is_eof(lexer->input.c)) {
+                    lexer_locate(lexer, token);
                     next_state = S4;
                 }
-                else if (is_sqmark(lexer->input->c)) {
-                    token->lineno = lexer->input->lineno;
-                    token->colno = lexer->input->colno;
+                else if (is_sqmark(lexer->input.c)) {
+                    lexer_locate(lexer, token);
                     next_state = S5;
                 }
-                else if (is_dqmark(lexer->input->c)) {
-                    token->lineno = lexer->input->lineno;
-                    token->colno = lexer->input->colno;
+                else if (is_dqmark(lexer->input.c)) {
+                    lexer_locate(lexer, token);
                     next_state = S6;
                 }
-                else if (is_comment_initiator(lexer->input->c)) {
+                else if (is_comment_initiator(lexer->input.c)) {
                     next_state = S7;
                 }
                 else {
-                    token->lineno = lexer->input->lineno;
-                    token->colno = lexer->input->colno;
+                    lexer_locate(lexer, token);
                     next_state = S8;
                 }
                 break;
             case S2:
                 // Check for first character of a digraph symbol below
-                if (lexer->input->c == ':') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == ':') {
+                    lexer_take(lexer, token);
                     next_state = S2_1;
                 }
-                else if (lexer->input->c == '|') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '|') {
+                    lexer_take(lexer, token);
                     next_state = S2_2;
                 }
-                else if (lexer->input->c == '&') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '&') {
+                    lexer_take(lexer, token);
                     next_state = S2_3;
                 }
-                else if (lexer->input->c == '=') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '=') {
+                    lexer_take(lexer, token);
                     next_state = S2_4;
                 }
-                else if (lexer->input->c == '!') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '!') {
+                    lexer_take(lexer, token);
                     next_state = S2_5;
                 }
-                else if (lexer->input->c == '<') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '<') {
+                    lexer_take(lexer, token);
                     next_state = S2_6;
                 }
-                else if (lexer->input->c == '>') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '>') {
+                    lexer_take(lexer, token);
                     next_state = S2_7;
                 }
                 // Check for regular symbol below
-                else if (is_symbol(lexer->input->c)) {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (is_symbol(lexer->input.c)) {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 break;
             case S2_1:
-                if (lexer->input->c == ':') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == ':') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -351,9 +728,8 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_2:
-                if (lexer->input->c == '|') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '|') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -361,9 +737,8 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_3:
-                if (lexer->input->c == '&') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '&') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -371,9 +746,8 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_4:
-                if (lexer->input->c == '=') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '=') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -381,9 +755,8 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_5:
-                if (lexer->input->c == '=') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '=') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -391,14 +764,12 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_6:
-                if (lexer->input->c == '<') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '<') {
+                    lexer_take(lexer, token);
                     next_state = S2_6_1;
                 }
-                else if (lexer->input->c == '=') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '=') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -406,9 +777,8 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_6_1:
-                if (lexer->input->c == '<') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '<') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -416,14 +786,12 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_7:
-                if (lexer->input->c == '>') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
-                    next_state = S2_6_1;
+                if (lexer->input.c == '>') {
+                    lexer_take(lexer, token);
+                    next_state = S2_7_1;
                 }
-                else if (lexer->input->c == '=') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (lexer->input.c == '=') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -431,9 +799,8 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 }
                 break;
             case S2_7_1:
-                if (lexer->input->c == '>') {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (lexer->input.c == '>') {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
@@ -442,514 +809,444 @@ Token *lexer_next_token(Lexer *lexer, bool using_eol)
                 break;
             case S3:
                 token->eol = true;
-                token_push_to_lexeme(token,'[');
-                token_push_to_lexeme(token,'E');
-                token_push_to_lexeme(token,'O');
-                token_push_to_lexeme(token,'L');
-                token_push_to_lexeme(token,']');
-                lexer->input = lexer_next_char(lexer);
+                token->lexeme = "[EOL]";
+                token->length = 5;
+                lexer_next_char(lexer);
                 next_state = S0;
                 break;
             case S4:
                 token->eof = true;
-                token_push_to_lexeme(token,'[');
-                token_push_to_lexeme(token,'E');
-                token_push_to_lexeme(token,'O');
-                token_push_to_lexeme(token,'F');
-                token_push_to_lexeme(token,']');
+                token->lexeme = "[EOF]";
+                token->length = 5;
                 next_state = S0;
                 break;
             case S5:
-                token_push_to_lexeme(token, lexer->input->c);
-                lexer->input = lexer_next_char(lexer);
+                lexer_take(lexer, token);
                 next_state = S5_1;
                 break;
             case S5_1:
-                if (is_backslash(lexer->input->c)) {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (is_backslash(lexer->input.c)) {
+                    lexer_take(lexer, token);
                     next_state = S5_1_1;
                 }
-                else if (is_eol(lexer->input->c)) {
+                else if (is_eol(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_eof(lexer->input->c)) {
+                else if (is_eof(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_sqmark(lexer->input->c)) {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (is_sqmark(lexer->input.c)) {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                    lexer_take(lexer, token);
                     next_state = S5_1;
                 }
                 break;
             case S5_1_1:
-                if (is_eol(lexer->input->c)) {
+                if (is_eol(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_eof(lexer->input->c)) {
+                else if (is_eof(lexer->input.c)) {
                     next_state = S0;
                 }
                 else {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                    lexer_take(lexer, token);
                     next_state = S5_1;
                 }
                 break;
             case S6:
-                token_push_to_lexeme(token, lexer->input->c);
-                lexer->input = lexer_next_char(lexer);
+                lexer_take(lexer, token);
                 next_state = S6_1;
                 break;
             case S6_1:
-                if (is_backslash(lexer->input->c)) {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                if (is_backslash(lexer->input.c)) {
+                    lexer_take(lexer, token);
                     next_state = S6_1_1;
                 }
-                else if (is_eol(lexer->input->c)) {
+                else if (is_eol(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_eof(lexer->input->c)) {
+                else if (is_eof(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_dqmark(lexer->input->c)) {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                else if (is_dqmark(lexer->input.c)) {
+                    lexer_take(lexer, token);
                     next_state = S0;
                 }
                 else {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                    lexer_take(lexer, token);
                     next_state = S6_1;
                 }
                 break;
             case S6_1_1:
-                if (is_eol(lexer->input->c)) {
+                if (is_eol(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_eof(lexer->input->c)) {
+                else if (is_eof(lexer->input.c)) {
                     next_state = S0;
                 }
                 else {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                    lexer_take(lexer, token);
                     next_state = S6_1;
                 }
                 break;
             case S7:
-                lexer->input = lexer_next_char(lexer);
+                lexer_skip_comment(lexer);
                 next_state = S7_1;
                 break;
             case S7_1:
-                if (is_eol(lexer->input->c)) {
+                if (is_eol(lexer->input.c)) {
                     next_state = S1;
                 }
-                else if (is_eof(lexer->input->c)) {
+                else if (is_eof(lexer->input.c)) {
                     next_state = S1;
                 }
                 else {
-                    lexer->input = lexer_next_char(lexer);
+                    lexer_next_char(lexer);
                     next_state = current_state;
                 }
                 break;
             case S8:
-                if (is_whitespace(lexer->input->c)) {
+                if (is_whitespace(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_symbol(lexer->input->c)) {
+                else if (is_symbol(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_eol(lexer->input->c)) {
+                else if (is_eol(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_eof(lexer->input->c)) {
+                else if (is_eof(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_sqmark(lexer->input->c)) {
+                else if (is_sqmark(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_dqmark(lexer->input->c)) {
+                else if (is_dqmark(lexer->input.c)) {
                     next_state = S0;
                 }
-                else if (is_comment_initiator(lexer->input->c)) {
+                else if (is_comment_initiator(lexer->input.c)) {
                     next_state = S0;
                 }
                 else {
-                    token_push_to_lexeme(token, lexer->input->c);
-                    lexer->input = lexer_next_char(lexer);
+                    lexer_take(lexer, token);
                     next_state = current_state;
                 }
                 break;
             // tokenizer:
             case S0:
                 done = true;
-                if (token->eol) {
-                    token->type = t_eol;
-                }
-                else if (token->eof) {
-                    token->type = t_eof;
-                }
-                else if (is_terminal("+", token->lexeme)) {
-                    token->type = t_add_op;
-                }
-                else if (is_terminal("-", token->lexeme)) {
-                    token->type = t_sub_op;
-                }
-                else if (is_terminal("*", token->lexeme)) {
-                    token->type = t_mul_op;
-                }
-                else if (is_terminal("/", token->lexeme)) {
-                    token->type = t_div_op;
-                }
-                else if (is_terminal("%", token->lexeme)) {
-                    token->type = t_mod_op;
-                }
-                else if (is_terminal("$", token->lexeme)) {
-                    token->type = t_sizeof_op;
-                }
-                else if (is_terminal("&", token->lexeme)) {
-                    token->type = t_addrof_op;
-                }
-                else if (is_terminal("~", token->lexeme)) {
-                    token->type = t_bitwise_neg_op;
-                }
-                else if (is_terminal(",", token->lexeme)) {
-                    token->type = t_comma;
-                }
-                else if (is_terminal("(", token->lexeme)) {
-                    token->type = t_lparen;
-                }
-                else if (is_terminal(")", token->lexeme)) {
-                    token->type = t_rparen;
-                }
-                else if (is_terminal("[", token->lexeme)) {
-                    token->type = t_lbracket;
-                }
-                else if (is_terminal("]", token->lexeme)) {
-                    token->type = t_rbracket;
-                }
-                else if (is_terminal("^", token->lexeme)) {
-                    token->type = t_bitwise_xor_op;
-                }
-                else if (is_terminal(";", token->lexeme)) {
-                    token->type = t_semicolon;
-                }
-                else if (is_terminal(":", token->lexeme)) {
-                    token->type = t_colon;
-                }
-                else if (is_terminal("::", token->lexeme)) {
-                    token->type = t_base_op;
-                }
-                else if (is_terminal("|", token->lexeme)) {
-                    token->type = t_bitwise_or_op;
-                }
-                else if (is_terminal("||", token->lexeme)) {
-                    token->type = t_logical_or_op;
-                }
-                else if (is_terminal("&", token->lexeme)) {
-                    token->type = t_bitwise_and_op;
-                }
-                else if (is_terminal("&&", token->lexeme)) {
-                    token->type = t_logical_and_op;
-                }
-                else if (is_terminal("=", token->lexeme)) {
-                    token->type = t_assign_op;
-                }
-                else if (is_terminal("==", token->lexeme)) {
-                    token->type = t_eq_op;
-                }
-                else if (is_terminal("!", token->lexeme)) {
-                    token->type = t_logical_neg_op;
-                }
-                else if (is_terminal("!=", token->lexeme)) {
-                    token->type = t_neq_op;
-                }
-                else if (is_terminal("<", token->lexeme)) {
-                    token->type = t_lt_op;
-                }
-                else if (is_terminal("<<", token->lexeme)) {
-                    token->type = t_bitwise_shl_op;
-                }
-                else if (is_terminal("<<<", token->lexeme)) {
-                    token->type = t_bitwise_rol_op;
-                }
-                else if (is_terminal(">", token->lexeme)) {
-                    token->type = t_gt_op;
-                }
-                else if (is_terminal(">>", token->lexeme)) {
-                    token->type = t_bitwise_shr_op;
-                }
-                else if (is_terminal(">>>", token->lexeme)) {
-                    token->type = t_bitwise_ror_op;
-                }
-                else if (is_terminal("entry", token->lexeme)) {
-                    token->type = t_entry;
-                }
-                else if (is_terminal("def", token->lexeme)) {
-                    token->type = t_def;
-                }
-                else if (is_terminal("enddef", token->lexeme)) {
-                    token->type = t_enddef;
-                }
-                else if (is_terminal("var", token->lexeme)) {
-                    token->type = t_var;
-                }
-                else if (is_terminal("endvar", token->lexeme)) {
-                    token->type = t_endvar;
-                }
-                else if (is_terminal("body", token->lexeme)) {
-                    token->type = t_body;
-                }
-                else if (is_terminal("end", token->lexeme)) {
-                    token->type = t_end;
-                }
-                else if (is_terminal("void", token->lexeme)) {
-                    token->type = t_void;
-                }
-                else if (is_terminal("byte", token->lexeme)) {
-                    token->type = t_byte;
-                }
-                else if (is_terminal("word", token->lexeme)) {
-                    token->type = t_word;
-                }
-                else if (is_terminal("dword", token->lexeme)) {
-                    token->type = t_dword;
-                }
-                else if (is_terminal("null", token->lexeme)) {
-                    token->type = t_null;
-                }
-                else if (is_terminal("false", token->lexeme)) {
-                    token->type = t_false;
-                }
-                else if (is_terminal("true", token->lexeme)) {
-                    token->type = t_true;
-                }
-                else if (is_terminal("break", token->lexeme)) {
-                    token->type = t_break;
-                }
-                else if (is_terminal("continue", token->lexeme)) {
-                    token->type = t_continue;
-                }
-                else if (is_terminal("next", token->lexeme)) {
-                    token->type = t_next;
-                }
-                else if (is_terminal("ret", token->lexeme)) {
-                    token->type = t_ret;
-                }
-                else if (is_terminal("if", token->lexeme)) {
-                    token->type = t_if;
-                }
-                else if (is_terminal("endif", token->lexeme)) {
-                    token->type = t_endif;
-                }
-                else if (is_terminal("else", token->lexeme)) {
-                    token->type = t_else;
-                }
-                else if (is_terminal("elseif", token->lexeme)) {
-                    token->type = t_elseif;
-                }
-                else if (is_terminal("endif", token->lexeme)) {
-                    token->type = t_endif;
-                }
-                else if (is_terminal("while", token->lexeme)) {
-                    token->type = t_while;
-                }
-                else if (is_terminal("endwhile", token->lexeme)) {
-                    token->type = t_endwhile;
-                }
-                else if (is_terminal("for", token->lexeme)) {
-                    token->type = t_for;
-                }
-                else if (is_terminal("endfor", token->lexeme)) {
-                    token->type = t_endfor;
-                }
-                else if (is_id(token->lexeme)) {
-                    token->type = t_id;
-                }
-                else if (is_bin(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_bin(token->lexeme);
-                }
-                else if (is_oct(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_oct(token->lexeme);
-                }
-                else if (is_dec(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_dec(token->lexeme);
-                }
-                else if (is_hex(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_hex(token->lexeme);
-                }
-                else if (is_sqstr(token->lexeme)) {
-                    token->type = t_sqstr;
-                    token->strval = eval_sqstr(token->lexeme);
-                }
-                else if (is_dqstr(token->lexeme)) {
-                    token->type = t_dqstr;
-                    token->strval = eval_dqstr(token->lexeme);
-                }
-                else {
-                    token->type = t_unknown;
-                }
                 break;
         }
     }
-    return token;
 }
 
-//==============================================================================
-// Evaluators
-//==============================================================================
+// Scan the lexeme of the next token with the transition tables. Takes the
+// same transitions as lexer_scan(), so the tokens are the same.
+//
+// \param Lexer lexer:    The lexer context
+// \param Token token:    The token to store the lexeme to
+// \param bool using_eol: If TRUE the T_EOL token is scanned for
+static void lexer_scan_table(Lexer *lexer, Token *token, bool using_eol)
+{
+    Transition (*table)[C_COUNT]; // the transition table in use
+    Transition transition;        // the transition taken
+    unsigned int state;           // the current state
+
+    table = transitions[using_eol];
+    state = S1;
+    for (;;) {
+        transition = table[state][char_classes[lexer->input.c + 1]];
+        if (transition.action != A_NONE) {
+            if (transition.action & A_LOCATE) {
+                lexer_locate(lexer, token);
+            }
+            else if (transition.action & A_TAKE) {
+                lexer_take(lexer, token);
+            }
+            else if (transition.action & A_IGNORE) {
+                lexer_next_char(lexer);
+            }
+            else if (transition.action & A_SKIP) {
+                lexer_skip_whitespace(lexer);
+            }
+            else {
+                lexer_skip_comment(lexer);
+            }
+        }
+        if (transition.next == S0) {
+            break;
+        }
+        state = transition.next;
+    }
 
-// Evaluate binary
+    if (state == S3) {
+        token->eol = true;
+        token->lexeme = "[EOL]";
+        token->length = 5;
+    }
+    else if (state == S4) {
+        token->eof = true;
+        token->lexeme = "[EOF]";
+        token->length = 5;
+    }
+}
 
-static int eval_bin(const char *s)
+// Compile the transition rules into the character class map and the dense
+// transition tables
+static void lexer_tables_init(void)
 {
-    // Remove appended symbol and evaluate binary number
-    char *p;
-    p = dupstr(s);
-    p[strlen(p)-1] = '\0';
-    return eval(p,2);
-}
+    const TransitionRule *rule;
+    int c;
+    int class;
+    int using_eol;
 
-// Evaluate octal
+    // Classify every character
+    for (c = 0; c < 256; c++) {
+        if (is_eol(c)) {
+            class = C_EOL;
+        }
+        else if (is_whitespace(c)) {
+            class = C_WHITESPACE;
+        }
+        else if (is_sqmark(c)) {
+            class = C_SQMARK;
+        }
+        else if (is_dqmark(c)) {
+            class = C_DQMARK;
+        }
+        else if (is_comment_initiator(c)) {
+            class = C_COMMENT;
+        }
+        else if (is_backslash(c)) {
+            class = C_BACKSLASH;
+        }
+        else if (c == ':') {
+            class = C_COLON;
+        }
+        else if (c == '|') {
+            class = C_BAR;
+        }
+        else if (c == '&') {
+            class = C_AMPERSAND;
+        }
+        else if (c == '=') {
+            class = C_EQUALS;
+        }
+        else if (c == '!') {
+            class = C_BANG;
+        }
+        else if (c == '<') {
+            class = C_LT;
+        }
+        else if (c == '>') {
+            class = C_GT;
+        }
+        else if (is_symbol(c)) {
+            class = C_SYMBOL;
+        }
+        else {
+            class = C_OTHER;
+        }
+        char_classes[c + 1] = class;
+    }
+    char_classes[EOF + 1] = C_EOF;
 
-static int eval_oct(const char *s)
-{
-    // Remove appended symbol and evaluate octal number
-    char *p;
-    p = dupstr(s);
-    p[strlen(p)-1] = '\0';
-    return eval(p,8);
-}
+    // Fill in the tables rule by rule. A rule for C_ANY fills the whole row.
+    for (using_eol = 0; using_eol < 2; using_eol++) {
+        for (rule = transition_rules; rule < transition_rules + sizeof(transition_rules) / sizeof(transition_rules[0]); rule++) {
+            for (class = 0; class < C_COUNT; class++) {
+                if (rule->class == C_ANY || rule->class == class) {
+                    transitions[using_eol][rule->state][class].next = rule->next;
+                    transitions[using_eol][rule->state][class].action = rule->action;
+                }
+            }
+        }
+    }
 
-// Evaluate decimal
+    // Without EOL tokens, an EOL between tokens is skipped like whitespace
+    transitions[0][S1][C_EOL].next = S1;
+    transitions[0][S1][C_EOL].action = A_IGNORE;
+}
 
-static int eval_dec(const char *s)
+// Work out the type and the value of a scanned token
+static void lexer_tokenize(Lexer *lexer, Token *token)
 {
-    // Evaluate a decimal. Unlike the other numerical representations,
-    // decimals are valid with or without the appended symbol. Check for
-    // the symbol and remove it before performing evaluation.
+    int type; // stores the token type of a terminal
 
-    char *p;
-    p = dupstr(s);
-    if (lowercase(s[strlen(s)-1]) == 'd') {
-        p[strlen(p)-1] = '\0';
+    if (token->eol) {
+        token->type = t_eol;
+    }
+    else if (token->eof) {
+        token->type = t_eof;
+    }
+    else if (is_digit(token->lexeme[0])) {
+        // Only integers start with a digit
+        switch (eval_int(token->lexeme, token->length, &token->intval)) {
+            case INT_VALID:
+                token->type = t_int;
+                break;
+            case INT_OVERFLOW:
+                report(lexer->file, token, "Integer `%.*s' does not fit in a dword", (int)token->length, token->lexeme);
+                break;
+            default:
+                token->type = t_unknown;
+                break;
+        }
+    }
+    else if ((type = keyword_lookup(&terminals, token->lexeme, token->length)) >= 0) {
+        token->type = type;
+    }
+    else if (is_id(token->lexeme, token->length)) {
+        token->type = t_id;
+    }
+    else if (is_sqstr(token->lexeme, token->length)) {
+        token->type = t_sqstr;
+        token->strval = eval_sqstr(lexer->arena, token->lexeme, token->length);
+    }
+    else if (is_dqstr(token->lexeme, token->length)) {
+        token->type = t_dqstr;
+        token->strval = eval_dqstr(lexer->arena, token->lexeme, token->length);
+    }
+    else {
+        token->type = t_unknown;
     }
-    return eval(p,10);
 }
 
-// Evaluate hexadecimal
+//==============================================================================
+// Evaluators
+//==============================================================================
 
-static int eval_hex(const char *s)
-{
-    char *p;
-    p = dupstr(s);
-    p[strlen(p)-1] = '\0';
-    return eval(p,16);
-}
+// Evaluate integer
+//
+// Recognize an integer literal and work out its value in one pass. The
+// notation symbol at the end of the literal gives the base: b for binary, o
+// for octal, d or none for decimal, and h for hexadecimal. Values up to the
+// largest dword are accepted.
+//
+// Returns INT_VALID and stores the value if the literal is valid;
+// INT_INVALID if it is not an integer; INT_OVERFLOW if it does not fit in a
+// dword.
 
-// Evaluators
-static int eval(const char *s, int base)
+static int eval_int(const char *s, size_t length, int *value)
 {
-    int i;       // loop counter
-    int val;     // store integer value of digit
-    int integer; // store converted integer
-    int place;   // store place value
-
-    integer = 0; // zero it
-    place = 1;   // start at place value 1
-
-    // Convert the given string to an integer value. Starting from end of
-    // string and working our way back to the beginning, get the integer value
-    // for each digit and calculate its corresponding place value.
-    // Sum the (calculated) place value for all digits.
-    for (i=strlen(s)-1; i>=0; i--) {
-        val = eval_digit(s[i]); // get the actual value of the current digit
-        integer += val * place; // put digit at its place value
-        place *= base;          // go to next place value
+    size_t i;              // loop counter
+    size_t digits;         // the number of digits before the notation symbol
+    int base;              // the base the literal is written in
+    int val;               // store integer value of digit
+    unsigned long integer; // store converted integer
+
+    // The last character is the notation symbol, unless it is a digit
+    digits = length - 1;
+    if (is_binsym(s[length-1])) {
+        base = 2;
+    }
+    else if (is_octsym(s[length-1])) {
+        base = 8;
+    }
+    else if (is_decsym(s[length-1])) {
+        base = 10;
+    }
+    else if (is_hexsym(s[length-1])) {
+        base = 16;
     }
-    return integer;
+    else {
+        base = 10;
+        digits = length;
+    }
+    if (digits == 0) {
+        return INT_INVALID;
+    }
+
+    // Sum the digits from the most significant one on, and check that each
+    // step stays within a dword
+    integer = 0;
+    for (i=0; i<digits; i++) {
+        val = eval_digit(s[i]);
+        if (val < 0 || val >= base) {
+            return INT_INVALID;
+        }
+        if (integer > (INT_DWORD_MAX - val) / base) {
+            // Finish recognizing the literal; it overflows only if it is valid
+            for (i++; i<digits; i++) {
+                val = eval_digit(s[i]);
+                if (val < 0 || val >= base) {
+                    return INT_INVALID;
+                }
+            }
+            return INT_OVERFLOW;
+        }
+        integer = integer * base + val;
+    }
+    *value = (int)integer;
+    return INT_VALID;
 }
 
 // Lookup digit value
 
 static int eval_digit(int c)
 {
-    // Get the value of any digit. To do this, we use a lookup table,
-    // a simple character array. This array is a map. Each digit (array element)
-    // maps to its corresponding integer value (array index).
-
-    int i; // indexer
-    char d[] = "0123456789abcdef"; // table map
-    int dlen = strlen(d); // stores the string length
-
-    // Search table for digit and returns its corresponding integer value
-    for (i=0; i<dlen; i++) {
-        if (lowercase(c) == d[i]) {
-            return i;
-        }
+    // Get the value of any digit, or -1 if the character is not a digit
+    if (is_digit(c)) {
+        return c - '0';
+    }
+    c = lowercase(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
     }
-
-    // Return an error indicator if no match
     return -1;
 }
 
 // Evaluate single-quote string
 
-static char *eval_sqstr(char *s)
+static char *eval_sqstr(Arena *arena, const char *s, size_t length)
 {
     // Simple string. Only remove quotation marks.
     char *p;
-    p = (char*)substr(s+1,strlen(s)-2);
+    p = arena_substr(arena, s+1, length-2);
     return p;
 }
 
 // Evaluate double-quote string
-static char *eval_dqstr(char *s)
+static char *eval_dqstr(Arena *arena, const char *s, size_t length)
 {
-    return eval_sqstr(s);
+    return eval_sqstr(arena, s, length);
 }
 
 //==============================================================================
 // Recognizers
 //==============================================================================
 
-// TERMINAL RECOGNIZER
+// TOKEN RECOGNIZERS
 
-// Match token lexeme to terminal
+// Get a character of a lexeme. Past the end of the lexeme, the end-of-string
+// character is returned, so the recognizers can treat the lexeme like a
+// NUL-terminated string.
 
-static bool is_terminal(const char *terminal, const char *token)
+static int lexeme_char(const char *s, size_t length, size_t i)
 {
-    if (strcmp(terminal,token) == 0) {
-        return true;
+    if (i < length) {
+        return (unsigned char)s[i];
     }
-    return false;
+    return '\0';
 }
 
-// TOKEN RECOGNIZERS
-
 // Recognize identifier
 
-static bool is_id(const char *s)
+static bool is_id(const char *s, size_t length)
 {
     int current_state;
     int next_state;
     int c;
-    int i;
+    size_t i;
 
     i = 0;
     next_state = 2;
 
     while (true) {
-        c = s[i++];
+        c = lexeme_char(s, length, i++);
         current_state = next_state;
         switch (current_state) {
             case 0:
@@ -984,259 +1281,20 @@ static bool is_id(const char *s)
     }
 }
 
-// Recognize any integer representation
-
-static bool is_int(const char *s)
-{
-    if (is_bin(s) || is_oct(s) || is_dec(s) || is_hex(s)) {
-        return true;
-    }
-    return false;
-}
-
-// Recognize binary numerals
-
-static bool is_bin(const char *s)
-{
-    int current_state;
-    int next_state;
-    int c;
-    int i;
-
-    i = 0;
-    next_state = 2;
-
-    while (true) {
-        c = s[i++];
-        current_state = next_state;
-        switch (current_state) {
-            case 0:
-                // Invalid
-                return false;
-            case 1:
-                // Valid
-                return true;
-            case 2:
-                // Accept one binary digits. Deny anything else.
-                if (is_bindigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 3:
-                // Accept zero or more binary digits. Deny anything else.
-                if (is_bindigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_binsym(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-            case 4:
-                // Accept EOS; deny anything else
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-        }
-    }
-
-}
-
-
-// Recognize octal numeral
-
-static bool is_oct(const char *s)
-{
-    int current_state;
-    int next_state;
-    int c;
-    int i;
-
-    i = 0;
-    next_state = 2;
-
-    while (true) {
-        c = s[i++];
-        current_state = next_state;
-        switch (current_state) {
-            case 0:
-                // Invalid
-                return false;
-            case 1:
-                // Valid
-                return true;
-            case 2:
-                // Accept one octal digit; deny anything else.
-                if (is_octdigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 3:
-                // Accept zero or more octal digits; deny anything else.
-                if (is_octdigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_octsym(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 4:
-                // Accept EOS; deny anything else.
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-        }
-    }
-}
-
-// Recognize decimal numeral
-
-static bool is_dec(const char *s)
-{
-    int current_state;
-    int next_state;
-    int c;
-    int i;
-
-    i = 0;
-    next_state = 2;
-
-    while (true) {
-        c = s[i++];
-        current_state = next_state;
-        switch (current_state) {
-            case 0:
-                // Invalid
-                return false;
-            case 1:
-                // Valid
-                return true;
-            case 2:
-                // Accept one decimal digit; deny anything else.
-                if (is_decdigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 3:
-                // Accept zero or more decimal digits; deny anything else.
-                if (is_decdigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_decsym(c)) {
-                    next_state = 4;
-                }
-                else if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 4:
-                // Accept EOS; deny anything else.
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-        }
-    }
-}
-
-// Recognize hexadecimal numeral
-
-static bool is_hex(const char *s)
-{
-    int current_state;
-    int next_state;
-    int c;
-    int i;
-
-    i = 0;
-    next_state = 2;
-
-    while (true) {
-        c = s[i++];
-        current_state = next_state;
-        switch (current_state) {
-            case 0:
-                // Invalid
-                return false;
-            case 1:
-                // Valid
-                return true;
-            case 2:
-                // Accept one hex digit; deny anything else.
-                if (is_hexdigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 3:
-                // Accept zero or more hex digits; or accept hexadecimal symbol.
-                // Deny anything else.
-                if (is_hexdigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_hexsym(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-            case 4:
-                // Accept EOS; deny anything else.
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-        }
-    }
-}
-
 // Recognize single-quote string
 
-static bool is_sqstr(const char *s)
+static bool is_sqstr(const char *s, size_t length)
 {
     int current_state;
     int next_state;
     int c;
-    int i;
+    size_t i;
 
     i = 0;
     next_state = 2;
 
     while (true) {
-        c = s[i++];
+        c = lexeme_char(s, length, i++);
         current_state = next_state;
         switch (current_state) {
             case 0:
@@ -1295,18 +1353,18 @@ static bool is_sqstr(const char *s)
 
 // Recognize double-quote string
 
-static bool is_dqstr(const char *s)
+static bool is_dqstr(const char *s, size_t length)
 {
     int current_state;
     int next_state;
     int c;
-    int i;
+    size_t i;
 
     i = 0;
     next_state = 2;
 
     while (true) {
-        c = s[i++];
+        c = lexeme_char(s, length, i++);
         current_state = next_state;
         switch (current_state) {
             case 0:
@@ -1365,49 +1423,6 @@ static bool is_dqstr(const char *s)
 
 // ATOM/CHARACTER-LEVEL RECOGNIZERS
 
-// Recognize binary digit
-
-static bool is_bindigit(int c)
-{
-    if (c == '0' || c == '1') {
-        return true;
-    }
-    return false;
-}
-
-// Recognize octal digit
-
-static bool is_octdigit(int c)
-{
-    if (is_digit(c) && (c < '8')) {
-        return true;
-    }
-    return false;
-}
-
-// Recognize decimal digit
-
-static bool is_decdigit(int c)
-{
-    if (is_digit(c)) {
-        return true;
-    }
-    return false;
-}
-
-// Recognize hexadecimal digit
-
-static bool is_hexdigit(int c)
-{
-    if (is_digit(c)) {
-        return true;
-    }
-    else if (lowercase(c) >= 'a' && lowercase(c) <= 'f') {
-        return true;
-    }
-    return false;
-}
-
 // Recognize digit
 
 static bool is_digit(int c)
@@ -1629,4 +1644,5 @@ static bool is_whitespace(int c)
     if (!is_visible_ascii_character(c) && !is_eof(c) &&!is_eol(c)) {
         return true;
     }
+    return false;
 }
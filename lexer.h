@@ -3,19 +3,41 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "input.h"
+#include "source.h"
 #include "file.h"
 #include "token.h"
+#include "arena.h"
+
+// Scanners
+#define LEXER_ENGINE_SWITCH 1 // state machine written out as a switch
+#define LEXER_ENGINE_TABLE  2 // state machine run from dense transition tables
+
+// Number of tokens the lexer recycles. A token returned by lexer_next_token()
+// stays valid until this many more tokens have been read.
+#define LEXER_TOKEN_RING_SIZE 4
 
 // Lexer context
 typedef struct Lexer {
-    Input *input;  // stores input read from file
-    File *file;    // points to a source file
+    Input input;    // stores the current input character
+    Source *source; // the text of the source file
+    size_t pos;     // offset of the next character in the source text
+    File *file;     // points to a source file
+    int engine;     // the scanner that reads tokens
+    Arena *arena;   // the arena the lexer and the values of its tokens are allocated from
+    Token ring[LEXER_TOKEN_RING_SIZE]; // tokens handed out by the lexer, reused in turn
+    unsigned int ring_next;            // index of the next token to hand out
 } Lexer;
 
+extern int lexer_engine; // the scanner of new lexers
+extern unsigned long long lexer_tokens; // the tokens read by all lexers
+
 // Lexer operations
-Lexer *lexer_create();
-Input *lexer_next_char(Lexer *);
+Lexer *lexer_create(File *, Arena *);
+void lexer_destroy(Lexer *);
+void lexer_next_char(Lexer *);
+void lexer_seek(Lexer *, size_t);
 Token *lexer_next_token(Lexer *, bool);
 
 #endif /* __PARTICLE_LEXER_H__ */
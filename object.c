@@ -0,0 +1,223 @@
+// Object files
+//
+// An object file holds machine code as sections that are laid out the way
+// they sit in machine memory. Each section starts on a page boundary in the
+// file, so the machine can map a section into its memory instead of reading
+// it, and the header can be read and shown without loading anything. See
+// object.h for the layout.
+
+#include <stdio.h>
+#include <string.h>
+#include "object.h"
+#include "error.h"
+#include "utils.h"
+
+static void object_pad(File *, unsigned long);
+
+// Read the header and section descriptors of an object file. The file is
+// read from the start.
+//
+// Returns OBJECT_OK, OBJECT_RAW if the file has no object header, or
+// OBJECT_INVALID if the header is malformed
+
+int object_read(File *file, Object *object)
+{
+    unsigned char header[OBJECT_HEADER_SIZE];
+    unsigned char descriptor[OBJECT_SECTION_SIZE];
+    Section *section;
+    int i;
+
+    file_reset(file);
+    if (fread(header, 1, sizeof(header), file->handle) != sizeof(header) || memcmp(header, OBJECT_MAGIC, 4) != 0) {
+        return OBJECT_RAW;
+    }
+    object->version = object_get(header + 4, 2);
+    object->flags = object_get(header + 6, 2);
+    object->entry = object_get(header + 8, 4);
+    object->section_count = object_get(header + 12, 4);
+    if (object->section_count > OBJECT_MAX_SECTIONS) {
+        return OBJECT_INVALID;
+    }
+    for (i = 0; i < object->section_count; i++) {
+        if (fread(descriptor, 1, sizeof(descriptor), file->handle) != sizeof(descriptor)) {
+            return OBJECT_INVALID;
+        }
+        section = &object->sections[i];
+        section->type = object_get(descriptor, 4);
+        section->address = object_get(descriptor + 4, 4);
+        section->size = object_get(descriptor + 8, 4);
+        section->offset = object_get(descriptor + 12, 4);
+        section->filesize = object_get(descriptor + 16, 4);
+    }
+    return OBJECT_OK;
+}
+
+// Give every section with contents its offset in the file. The contents
+// follow the section descriptors in the order of the sections, each starting
+// on a page boundary unless the file holds relocatable code.
+
+void object_layout(Object *object)
+{
+    unsigned long offset;
+    int i;
+
+    offset = OBJECT_HEADER_SIZE + object->section_count * OBJECT_SECTION_SIZE;
+    for (i = 0; i < object->section_count; i++) {
+        if (object->sections[i].filesize == 0) {
+            object->sections[i].offset = 0;
+            continue;
+        }
+        if (!(object->flags & OBJECT_RELOCATABLE)) {
+            offset = (offset + OBJECT_PAGE_SIZE - 1) / OBJECT_PAGE_SIZE * OBJECT_PAGE_SIZE;
+        }
+        object->sections[i].offset = offset;
+        offset += object->sections[i].filesize;
+    }
+}
+
+// Write the header and section descriptors of an object file at the start of
+// the file. The sections are laid out already.
+
+void object_write(File *file, const Object *object)
+{
+    unsigned char header[OBJECT_HEADER_SIZE];
+    unsigned char descriptor[OBJECT_SECTION_SIZE];
+    const Section *section;
+    int i;
+
+    memcpy(header, OBJECT_MAGIC, 4);
+    object_put(header + 4, object->version, 2);
+    object_put(header + 6, object->flags, 2);
+    object_put(header + 8, object->entry, 4);
+    object_put(header + 12, object->section_count, 4);
+    if (fwrite(header, sizeof(header), 1, file->handle) != 1) {
+        fail("%s: could not write object file header", file->name);
+    }
+    for (i = 0; i < object->section_count; i++) {
+        section = &object->sections[i];
+        object_put(descriptor, section->type, 4);
+        object_put(descriptor + 4, section->address, 4);
+        object_put(descriptor + 8, section->size, 4);
+        object_put(descriptor + 12, section->offset, 4);
+        object_put(descriptor + 16, section->filesize, 4);
+        if (fwrite(descriptor, sizeof(descriptor), 1, file->handle) != 1) {
+            fail("%s: could not write object file header", file->name);
+        }
+    }
+}
+
+// Write the contents of a section at its offset. Sections must be written in
+// the order they were laid out; the gap before each is filled with zeroes.
+
+void object_write_section(File *file, const Section *section, const void *contents)
+{
+    if (section->filesize == 0) {
+        return;
+    }
+    object_pad(file, section->offset);
+    if (fwrite(contents, section->filesize, 1, file->handle) != 1) {
+        fail("%s: could not write %s section", file->name, object_section_name(section->type));
+    }
+}
+
+// Name a section type
+
+const char *object_section_name(unsigned long type)
+{
+    switch (type) {
+        case SECTION_CODE:
+            return "code";
+        case SECTION_DATA:
+            return "data";
+        case SECTION_BSS:
+            return "bss";
+        case SECTION_DECODED:
+            return "decoded";
+        case SECTION_SYMBOLS:
+            return "symbols";
+        case SECTION_RELOCATIONS:
+            return "relocs";
+        case SECTION_PIECES:
+            return "pieces";
+        default:
+            return "unknown";
+    }
+}
+
+// Display the header and sections of an object file
+
+void object_inspect(File *file)
+{
+    Object object;
+    Section *section;
+    int status;
+    int i;
+
+    status = object_read(file, &object);
+    if (status == OBJECT_RAW) {
+        printf("%s: raw code-segment image, %ld bytes\n", file->name, file_size(file));
+        return;
+    }
+    if (status == OBJECT_INVALID) {
+        fail("%s: malformed object file header", file->name);
+    }
+
+    printf("%s: object file version %u%s\n", file->name, object.version, object.flags & OBJECT_RELOCATABLE ? ", relocatable" : "");
+    printf("entry point: %06lx\n", object.entry);
+    printf("sections:\n");
+    printf("  %-8s %-8s %-10s %-10s %s\n", "type", "address", "size", "offset", "file size");
+    for (i = 0; i < object.section_count; i++) {
+        section = &object.sections[i];
+        printf("  %-8s %06lx   %-10lu %08lx   %lu", object_section_name(section->type), section->address, section->size, section->offset, section->filesize);
+        if (section->type == SECTION_DECODED) {
+            printf(" (%lu instructions)", section->filesize / OBJECT_DECODED_SIZE);
+        }
+        else if (section->type == SECTION_PIECES) {
+            printf(" (%lu pieces)", section->filesize / OBJECT_PIECE_SIZE);
+        }
+        printf("\n");
+    }
+}
+
+// Read a big-endian integer of the given number of bytes
+
+unsigned long object_get(const unsigned char *p, int size)
+{
+    unsigned long value;
+
+    value = 0;
+    while (size-- > 0) {
+        value = value << 8 | *p++;
+    }
+    return value;
+}
+
+// Write a big-endian integer of the given number of bytes
+
+void object_put(unsigned char *p, unsigned long value, int size)
+{
+    while (size-- > 0) {
+        *p++ = (unsigned char)(value >> (8 * size));
+    }
+}
+
+// Fill a file with zeroes up to the given offset
+
+static void object_pad(File *file, unsigned long offset)
+{
+    static const unsigned char zeroes[OBJECT_PAGE_SIZE];
+    long int position;
+    unsigned long count;
+
+    position = ftell(file->handle);
+    if (position < 0 || (unsigned long)position > offset) {
+        fail("%s: could not lay out object file", file->name);
+    }
+    while ((unsigned long)position < offset) {
+        count = offset - position < sizeof(zeroes) ? offset - position : sizeof(zeroes);
+        if (fwrite(zeroes, count, 1, file->handle) != 1) {
+            fail("%s: could not write object file", file->name);
+        }
+        position += count;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef __PARTICLE_OBJECT_H__
+#define __PARTICLE_OBJECT_H__
+
+#include <stdbool.h>
+#include "file.h"
+
+// Object file layout
+//
+//   offset 0   header: magic, version, flags, entry point, section count
+//   offset 16  section descriptors, OBJECT_SECTION_SIZE bytes each
+//   ...        section contents, each starting on an OBJECT_PAGE_SIZE boundary
+//
+// Every field is an unsigned big-endian integer, like everything else the
+// machine stores. Offsets are from the start of the file and addresses are
+// machine addresses, so nothing in the file needs to be relocated, and a
+// section can be mapped straight into machine memory. The exception is
+// relocatable code, which is linked with other code before it runs: it
+// starts at address 0, carries symbols and relocations sections, and is
+// flagged OBJECT_RELOCATABLE. Since it is never mapped, its sections are not
+// aligned to pages.
+
+#define OBJECT_MAGIC          "PTOB"
+#define OBJECT_VERSION        1
+#define OBJECT_HEADER_SIZE    16
+#define OBJECT_SECTION_SIZE   20
+#define OBJECT_PAGE_SIZE      4096
+#define OBJECT_MAX_SECTIONS   8
+
+// Results of reading an object file header
+#define OBJECT_OK      0 // the header was read
+#define OBJECT_RAW     1 // the file has no header: it is a raw code-segment image
+#define OBJECT_INVALID 2 // the header is cut short or lists too many sections
+
+// Header flags
+#define OBJECT_RELOCATABLE 1 // the file holds relocatable code, which must be linked before it runs
+
+// Section types
+#define SECTION_CODE    1 // instructions, loaded into memory
+#define SECTION_DATA    2 // initialized data, loaded into memory
+#define SECTION_BSS     3 // zeroed memory; has no contents in the file
+#define SECTION_DECODED 4 // pre-decoded instructions; not loaded into memory
+#define SECTION_SYMBOLS 5 // symbols defined by relocatable code
+#define SECTION_RELOCATIONS 6 // places in relocatable code that refer to symbols
+#define SECTION_PIECES 7 // the pieces relocatable code was joined from
+
+// A pre-decoded instruction takes OBJECT_DECODED_SIZE bytes:
+//
+//   dword  address of the instruction word
+//   byte   opcode class
+//   byte   operand-size class
+//   byte   addressing-mode class
+//   byte   reserved; zero
+//   dword  immediate field
+//   dword  address of the next instruction
+//
+// In relocatable code, immediates that refer to symbols are zero until the
+// code is linked.
+#define OBJECT_DECODED_SIZE 16
+
+// A symbol takes OBJECT_RECORD_SIZE bytes followed by its name:
+//
+//   dword  the value of an equate, or the address of a label
+//   byte   symbol type (see symtab.h)
+//   byte   reserved; zero
+//   word   the length of the name
+//
+// and a relocation the same, with the fields:
+//
+//   dword  the address of the first byte of the value
+//   byte   the number of bytes of the value
+//   byte   reserved; zero
+//   word   the length of the name of the symbol
+#define OBJECT_RECORD_SIZE 8
+
+// A piece takes OBJECT_PIECE_SIZE bytes:
+//
+//   8 bytes  the key the piece was joined under
+//   dword    the address the piece starts at
+//   dword    the number of bytes of the piece
+//   dword    the first symbol of the piece, and the number of its symbols
+//   dword    ...
+//   dword    the first relocation of the piece, and the number of its relocations
+//   dword    ...
+//   dword    the first instruction of the piece, and the number of its instructions
+//   dword    ...
+#define OBJECT_PIECE_SIZE 40
+
+// A section descriptor
+typedef struct Section {
+    unsigned long type;     // the section type
+    unsigned long address;  // the machine address the section is loaded at
+    unsigned long size;     // the number of bytes the section occupies in memory
+    unsigned long offset;   // the offset of the contents in the file; 0 if there are none
+    unsigned long filesize; // the number of bytes of contents in the file
+} Section;
+
+// The header of an object file and its section descriptors
+typedef struct Object {
+    unsigned int version;                  // the format version
+    unsigned int flags;                    // header flags
+    unsigned long entry;                   // the address execution starts at
+    int section_count;                     // the number of sections
+    Section sections[OBJECT_MAX_SECTIONS]; // the section descriptors
+} Object;
+
+// Object file operations
+int object_read(File *, Object *);
+void object_layout(Object *);
+void object_write(File *, const Object *);
+void object_write_section(File *, const Section *, const void *);
+const char *object_section_name(unsigned long);
+void object_inspect(File *);
+unsigned long object_get(const unsigned char *, int);
+void object_put(unsigned char *, unsigned long, int);
+
+#endif /* __PARTICLE_OBJECT_H__ */
@@ -3,9 +3,10 @@
 #include "parser.h"
 #include "error.h"
 #include "lexer.h"
+#include "arena.h"
 #include "token.h"
 #include "vm.h"
-#include "emit.h"
+#include "ir.h"
 //#include "wrappers.h"
 #include "utils.h"
 #include "file.h"
@@ -16,6 +17,7 @@ static Token *parser_next_token(Lexer *);
 static bool match(TokenType);
 static TokenType lookahead();
 static void program();
+static void unit_end();
 static void entry_point_specifier();
 static void var_block();
 static void var_definition_list();
@@ -57,26 +59,111 @@ static void constant();
 static bool is_constant();
 
 static Token *look; // stores the lookahead
-static File *asmfile;
+static Ir *ir;       // the assembly the translation emits
 static Lexer *lexer;
+static Arena *arena; // memory that lasts as long as the parse phase
+static Unit *units;  // the units of a program that is translated unit by unit
 
 //==============================================================================
 // Parse
 //==============================================================================
 
-File *parse(File *srcfile)
+Ir *parse(File *srcfile)
 {
-    // Prepare assembly output file
-    asmfile = file_open("particle.asm","wb+");
+    ir = ir_create(srcfile->name);
 
-    // Get first character for the lexer to start with
-    lexer = lexer_create();
-    lexer->file = srcfile;
-    lexer->input = lexer_next_char(lexer);
+    arena = arena_create(ARENA_BLOCK_SIZE);
+    lexer = lexer_create(srcfile, arena);
     look = lexer_next_token(lexer, false);
     program();
-    file_reset(asmfile);
-    return asmfile;
+    lexer_destroy(lexer);
+    arena_destroy(arena);
+    return ir;
+}
+
+//==============================================================================
+// Parse unit by unit
+//
+// A program can be translated one unit at a time, so that a unit that has not
+// changed since it was last translated need not be translated again. The
+// program is first split into units. Each unit is hashed by its tokens alone,
+// so that moving a function, or changing the whitespace or comments in it,
+// leaves its hash alone.
+//==============================================================================
+
+// Split a source file into units. The units stay valid, and can be
+// translated with parse_unit(), until parse_finish() is called.
+//
+// Returns the units, and the number of units through count. The first unit is
+// the part before the first function definition.
+
+Unit *parse_split(File *srcfile, size_t *count)
+{
+    size_t capacity;
+    int type;
+
+    arena = arena_create(ARENA_BLOCK_SIZE);
+    lexer = lexer_create(srcfile, arena);
+    capacity = 16;
+    units = (Unit*)emalloc(capacity * sizeof(*units));
+    units[0].offset = 0;
+    units[0].hash = FNV1A64_BASIS;
+    *count = 1;
+    for (look = lexer_next_token(lexer, false); look->type != t_eof; look = lexer_next_token(lexer, false)) {
+        if (look->type == t_def) {
+            if (*count == capacity) {
+                capacity *= 2;
+                units = (Unit*)erealloc(units, capacity * sizeof(*units));
+            }
+            units[*count].offset = look->offset;
+            units[*count].hash = FNV1A64_BASIS;
+            (*count)++;
+        }
+        type = look->type;
+        units[*count - 1].hash = fnv1a64(units[*count - 1].hash, &type, sizeof(type));
+        units[*count - 1].hash = fnv1a64(units[*count - 1].hash, &look->length, sizeof(look->length));
+        units[*count - 1].hash = fnv1a64(units[*count - 1].hash, look->lexeme, look->length);
+    }
+    return units;
+}
+
+// Translate a unit of the program split by parse_split()
+
+Ir *parse_unit(const Unit *unit)
+{
+    ir = ir_create(lexer->file->name);
+    lexer_seek(lexer, unit->offset);
+    look = lexer_next_token(lexer, false);
+    if (unit == &units[0]) {
+        entry_point_specifier();
+        if (look->type == t_var) {
+            var_block();
+        }
+    }
+    else {
+        func_definition();
+    }
+    unit_end();
+    return ir;
+}
+
+// Finish translating a program unit by unit
+
+void parse_finish(void)
+{
+    lexer_destroy(lexer);
+    arena_destroy(arena);
+    free(units);
+    units = NULL;
+}
+
+// Check that a unit ends where the next unit or the program does
+
+static void unit_end()
+{
+    if (look->type != t_def && look->type != t_eof) {
+        expected(lexer->file, look, "%s", token_meaning(t_eof));
+    }
 }
 
 //==============================================================================
@@ -89,7 +176,6 @@ File *parse(File *srcfile)
 static bool match(TokenType type)
 {
     if (look->type == type) {
-        token_destroy(look); // we need to remove our garbage from memory
         look = lexer_next_token(lexer, false);
         return true;
     }
@@ -124,11 +210,16 @@ static void program()
 
 static void entry_point_specifier()
 {
+    IrLine *line;
+
     if (!match(t_entry)) {
         expected(lexer->file, look, "entry point specifier; begins with %s", token_meaning(t_entry));
     }
 
-    emitln(asmfile, "jmp %s", look->lexeme);
+    // the program calls the entry point and halts when it returns
+    line = ir_emit(ir, NULL, "call", look->lineno);
+    ir_operand_symbol(line, ir_name(ir, look->lexeme, look->length));
+    ir_emit(ir, NULL, "halt", look->lineno);
 
     if (!match(t_id)) {
         expected(lexer->file, look, "entry point specifier; ends with %s", token_meaning(t_id));
@@ -242,6 +333,8 @@ static void func_definition()
 
     stmt_list();
 
+    // a function that runs off its end returns
+    ir_emit(ir, NULL, "ret", look->lineno);
     if (!match(t_enddef)) {
         expected(lexer->file, look, "function epilogue (%s)", token_meaning(t_enddef));
     }
@@ -272,9 +365,14 @@ static void func_declarator()
 
 static void func_actual_declarator()
 {
+    Token *name; // the name of the function
+
+    // the function starts at a label of its name
+    name = look;
     if (!match(t_id)) {
         expected(lexer->file, look, "%s", token_meaning(t_id));
     }
+    ir_emit(ir, ir_name(ir, name->lexeme, name->length), NULL, name->lineno);
 
     if (!match(t_lparen)) {
 
@@ -472,6 +570,7 @@ static void next_stmt()
 
 static void return_stmt()
 {
+    ir_emit(ir, NULL, "ret", look->lineno);
     if (!match(t_ret)) {
         expected(lexer->file, look, "%s", token_meaning(t_ret));
     }
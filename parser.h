@@ -2,7 +2,18 @@
 #define __PARTICLE_PARSER_H__
 
 #include "file.h"
+#include "ir.h"
 
-File *parse(struct File *);
+// A unit of a program that can be translated on its own: the part before
+// the first function definition, or a function definition
+typedef struct Unit {
+    size_t offset;           // the offset in the source text the unit starts at
+    unsigned long long hash; // a hash of the tokens of the unit
+} Unit;
+
+Ir *parse(File *);
+Unit *parse_split(File *, size_t *);
+Ir *parse_unit(const Unit *);
+void parse_finish(void);
 
 #endif /* __PARTICLE_PARSER_H__ */
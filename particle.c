@@ -12,8 +12,13 @@
 #include "error.h"
 #include "lexer.h"
 #include "asm.h"
+#include "ir.h"
 #include "parser.h"
 #include "vm.h"
+#include "object.h"
+#include "runner.h"
+#include "cache.h"
+#include "timing.h"
 #include "utils.h"
 #include "file.h"
 #include "debug.h"
@@ -27,6 +32,13 @@
 int particle_input_language = PARTICLE_INPUT_LANGUAGE_PARTICLE; // the input language
 char *particle_asmfile_name = NULL;
 char *particle_objfile_name = NULL;
+int particle_jobs = 0; // the number of worker threads that run machine code; 0 if not given
+bool particle_run = true; // runs compiled or assembled programs if TRUE
+char *particle_cache_dir = NULL; // the compile cache directory; NULL if there is no cache
+unsigned long particle_cache_limit = CACHE_DEFAULT_LIMIT; // the most bytes the compile cache may take up
+bool particle_cache_report = false; // displays the compile cache counters if TRUE
+bool particle_incremental = false; // compiles changed programs function by function if TRUE
+int particle_timing = 0; // the format of the timing report; 0 if there is none
 
 static int opt; // stores opt character from getopt()
 static int i; // counter
@@ -40,7 +52,10 @@ int main(int argc, char *argv[])
     File *srcfile;
     File *asmfile;
     File *objfile;
-    void *objcode;
+    Ir *ir;
+    Code *code;
+    Cache *cache;
+    char salt[64];
 
     // NOTE: This options parser needs to be strengthened. It has many flaws.
 
@@ -51,7 +66,7 @@ int main(int argc, char *argv[])
     }
 
     // Process options
-    while ((opt = getopt(argc,argv,"x:a:m:h")) != -1) {
+    while ((opt = getopt(argc,argv,"x:a:m:e:l:p:F:i:j:C:L:T::P:cdkIsh")) != -1) {
         switch (opt) {
             case 'h':
                 display_usage();
@@ -71,11 +86,96 @@ int main(int argc, char *argv[])
                     fail("option -x: unknown input language specified: `%s'", optarg);
                 }
                 break;
+            case 'e':
+                if (strcmp(optarg,"switch") == 0) {
+                    vm_engine = VM_ENGINE_SWITCH;
+                }
+                else if (strcmp(optarg,"threaded") == 0) {
+                    vm_engine = VM_ENGINE_THREADED;
+                }
+                else {
+                    fail("option -e: unknown execution engine specified: `%s'", optarg);
+                }
+                break;
+            case 'l':
+                if (strcmp(optarg,"switch") == 0) {
+                    lexer_engine = LEXER_ENGINE_SWITCH;
+                }
+                else if (strcmp(optarg,"table") == 0) {
+                    lexer_engine = LEXER_ENGINE_TABLE;
+                }
+                else {
+                    fail("option -l: unknown scanner specified: `%s'", optarg);
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg,"2") == 0) {
+                    asm_passes = ASM_PASSES_TWO;
+                }
+                else if (strcmp(optarg,"1") == 0) {
+                    asm_passes = ASM_PASSES_ONE;
+                }
+                else {
+                    fail("option -p: the assembler makes 1 or 2 passes: `%s'", optarg);
+                }
+                break;
+            case 's':
+                vm_stack_caching = true;
+                break;
+            case 'j':
+                particle_jobs = atoi(optarg);
+                if (particle_jobs < 1) {
+                    fail("option -j: number of jobs must be at least 1: `%s'", optarg);
+                }
+                break;
+            case 'P':
+                vm_profile = optarg;
+                break;
+            case 'F':
+                vm_fusion_generate(file_open(optarg,"rb"));
+                return 0;
+                break;
+            case 'i':
+                object_inspect(file_open(optarg,"rb"));
+                return 0;
+                break;
+            case 'd':
+                asm_predecode = true;
+                break;
+            case 'c':
+                particle_run = false;
+                break;
+            case 'C':
+                particle_cache_dir = optarg;
+                break;
+            case 'L':
+                if (atol(optarg) < 1) {
+                    fail("option -L: cache limit must be at least 1 kilobyte: `%s'", optarg);
+                }
+                particle_cache_limit = (unsigned long)atol(optarg) * 1024;
+                break;
+            case 'k':
+                particle_cache_report = true;
+                break;
+            case 'I':
+                particle_incremental = true;
+                break;
+            case 'T':
+                if (optarg == NULL || strcmp(optarg,"text") == 0) {
+                    particle_timing = TIMING_TEXT;
+                }
+                else if (strcmp(optarg,"json") == 0) {
+                    particle_timing = TIMING_JSON;
+                }
+                else {
+                    fail("option -T: unknown report format specified: `%s'", optarg);
+                }
+                break;
             case 'a':
-                particle_asmfile_name = dupstr(optarg);
+                particle_asmfile_name = optarg;
                 break;
             case 'm':
-                particle_objfile_name = dupstr(optarg);
+                particle_objfile_name = optarg;
                 break;
             case '?':
                 return 0;
@@ -86,6 +186,38 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (particle_cache_report) {
+        if (particle_cache_dir == NULL) {
+            fail("option -k: no cache directory given with -C");
+        }
+        cache_report(particle_cache_dir);
+        return 0;
+    }
+
+    if (particle_incremental && particle_cache_dir == NULL) {
+        fail("option -I: no cache directory given with -C");
+    }
+
+    timing_init();
+
+    // Machine code may come as many files, which run in parallel
+    if (particle_input_language == PARTICLE_INPUT_LANGUAGE_MACHINE && (particle_jobs > 0 || (argc - 1) > optind)) {
+        if (optind == argc) {
+            fail("options: too few arguments.");
+        }
+        if (vm_profile != NULL) {
+            fail("option -P: only one program can be profiled at a time");
+        }
+        timing_start(TIMING_EXECUTE);
+        i = runner_run(&argv[optind], argc - optind, particle_jobs);
+        timing_stop(TIMING_EXECUTE);
+        display_timing();
+        if (i > 0) {
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+
     // There should only be one non-option argument: the file. If there are too
     // many non-option arguments, then report the error
     if ((argc - 1) > optind) {
@@ -100,24 +232,126 @@ int main(int argc, char *argv[])
     }
 
     srcfile = file_open((const char *)argv[optind],"rb");
-    if (particle_input_language == PARTICLE_INPUT_LANGUAGE_PARTICLE) {
-        asmfile = parse(srcfile);
+    if (particle_input_language == PARTICLE_INPUT_LANGUAGE_MACHINE) {
+        timing_start(TIMING_EXECUTE);
+        timing_count(TIMING_INSTRUCTIONS, execute(srcfile));
+        timing_stop(TIMING_EXECUTE);
+        display_timing();
+        return 0;
+    }
+
+    // An unchanged source runs from the machine code cached for it. The cache
+    // is passed over when the assembly or machine code is to be written out.
+    cache = NULL;
+    if (particle_cache_dir != NULL && particle_asmfile_name == NULL && particle_objfile_name == NULL) {
+        timing_start(TIMING_CACHE);
+        cache = cache_open(particle_cache_dir, particle_cache_limit);
+        snprintf(salt, sizeof(salt), "particle %s object %d language %d decoded %d", PARTICLE_VERSION, OBJECT_VERSION, particle_input_language, asm_predecode);
+        objfile = cache_lookup(cache, srcfile, salt);
+        if (objfile != NULL) {
+            file_close(srcfile);
+            cache_close(cache);
+        }
+        timing_stop(TIMING_CACHE);
+        if (objfile != NULL) {
+            if (particle_run) {
+                timing_start(TIMING_EXECUTE);
+                timing_count(TIMING_INSTRUCTIONS, execute(objfile));
+                timing_stop(TIMING_EXECUTE);
+            }
+            else {
+                file_close(objfile);
+            }
+            display_timing();
+            return 0;
+        }
+    }
+
+    // Source is compiled, assembled and run in this process. The assembly and
+    // machine code stay in memory, and are only written out when asked for. In
+    // incremental mode, a changed program is compiled function by function,
+    // and the functions that have not changed come from the cache.
+    if (cache != NULL && particle_incremental && particle_input_language == PARTICLE_INPUT_LANGUAGE_PARTICLE) {
+        timing_start(TIMING_COMPILE);
+        code = cache_compile(cache, srcfile);
         file_close(srcfile);
-        objfile = assemble(asmfile);
-        file_close(asmfile);
+        timing_stop(TIMING_COMPILE);
     }
-    if (particle_input_language == PARTICLE_INPUT_LANGUAGE_ASSEMBLY) {
-        objfile = assemble(srcfile);
+    else {
+        timing_start(TIMING_PARSE);
+        if (particle_input_language == PARTICLE_INPUT_LANGUAGE_PARTICLE) {
+            ir = parse(srcfile);
+        }
+        else {
+            ir = asm_read(srcfile);
+        }
         file_close(srcfile);
+        timing_stop(TIMING_PARSE);
+        if (particle_asmfile_name != NULL) {
+            timing_start(TIMING_WRITE);
+            asmfile = file_open(particle_asmfile_name,"wb");
+            ir_write(ir, asmfile);
+            file_close(asmfile);
+            timing_stop(TIMING_WRITE);
+        }
+        timing_start(TIMING_ASSEMBLE);
+        code = assemble(ir);
+        timing_stop(TIMING_ASSEMBLE);
+        timing_count(TIMING_ASM_LINES, ir->count);
+        ir_destroy(ir);
     }
-    if (particle_input_language == PARTICLE_INPUT_LANGUAGE_MACHINE) {
-        execute(srcfile);
+    timing_count(TIMING_TOKENS, lexer_tokens);
+    timing_count(TIMING_OBJECT_BYTES, code->size);
+    if (particle_objfile_name != NULL) {
+        timing_start(TIMING_WRITE);
+        write_code(code);
+        timing_stop(TIMING_WRITE);
+    }
+    if (cache != NULL) {
+        timing_start(TIMING_CACHE);
+        cache_store(cache, code);
+        cache_close(cache);
+        timing_stop(TIMING_CACHE);
+    }
+    if (particle_run) {
+        timing_start(TIMING_EXECUTE);
+        timing_count(TIMING_INSTRUCTIONS, execute_code(code->bytes, code->size, code->entry));
+        timing_stop(TIMING_EXECUTE);
     }
+    code_destroy(code);
+    display_timing();
 
     // Exit on good terms
     return 0;
 }
 
+//==============================================================================
+// Display timing
+//==============================================================================
+
+// Display the timing report, if one was asked for with -T. A run that faults
+// ends before it gets here, and reports nothing.
+
+void display_timing()
+{
+    if (particle_timing != 0) {
+        timing_report(particle_timing);
+    }
+}
+
+//==============================================================================
+// Write machine code
+//==============================================================================
+
+void write_code(Code *code)
+{
+    File *objfile;
+
+    objfile = file_open(particle_objfile_name, "wb");
+    code_write(code, objfile);
+    file_close(objfile);
+}
+
 //==============================================================================
 // Display usage
 //==============================================================================
@@ -126,16 +360,49 @@ void display_usage()
 {
     // The convention here to to let the usage copy be no more than 80 character wide
     const char usage[] =
-        "Usage: particle [options] file\n\n"
+        "Usage: particle [options] file\n"
+        "       particle -x machine [-j JOBS] [options] file...\n\n"
         "Description:\n"
-        "  Interprets particle files, assembles particle assembly files,\n"
-        "  or runs particle machine code.\n\n"
+        "  Compiles and runs particle files, assembles and runs particle\n"
+        "  assembly files, or runs particle machine code.\n\n"
         "Options:\n"
         "  -h           Display this information\n"
         "  -a FILE      Output generated assembly code to FILE\n"
         "  -m FILE      Output generated machine code to FILE\n"
+        "  -c           Compile or assemble only; do not run the program\n"
         "  -x LANGUAGE  Specify the language of the input file.\n"
         "               Can be: particle (default), assembly, or machine.\n"
+        "  -e ENGINE    Specify the engine that executes machine code.\n"
+        "               Can be: switch (default) or threaded.\n"
+        "  -l SCANNER   Specify the scanner that reads tokens from source files.\n"
+        "               Can be: switch (default) or table.\n"
+        "  -p PASSES    Specify the number of passes the assembler makes.\n"
+        "               Can be: 2 (default) or 1.\n"
+        "  -d           Write pre-decoded instructions with machine code, so\n"
+        "               that the machine need not decode them.\n"
+        "  -s           Keep the top of the expression stack in host variables\n"
+        "               while executing machine code.\n"
+        "  -j JOBS      Run machine code files on JOBS worker threads.\n"
+        "  -P FILE      Profile the opcodes and opcode pairs the program executes,\n"
+        "               and the jumps its conditional jumps take, on the switch\n"
+        "               engine. The profile is written to FILE when the program\n"
+        "               halts, as JSON if FILE ends in .json, and as a profile\n"
+        "               for -F otherwise.\n"
+        "  -F PROFILE   Write a superinstruction table for fusion.h, generated\n"
+        "               from an opcode profile, and exit.\n"
+        "  -i FILE      Display the header and sections of a machine code\n"
+        "               file, and exit.\n"
+        "  -C DIR       Cache compiled machine code in DIR, and run unchanged\n"
+        "               files from the cache.\n"
+        "  -L SIZE      Limit the cache to SIZE kilobytes (default 65536).\n"
+        "  -k           Display the hit and miss counters of the cache given\n"
+        "               with -C, and exit.\n"
+        "  -I           Compile changed particle files function by function,\n"
+        "               and take unchanged functions from the cache given\n"
+        "               with -C.\n"
+        "  -T[FORMAT]   Display the wall and CPU time of each phase, throughputs\n"
+        "               and peak memory use after running. FORMAT can be:\n"
+        "               text (default) or json. Give it as -Tjson.\n"
         "  \n"
         ;
     printf("%s", usage);
@@ -1,6 +1,13 @@
 #ifndef __PARTICLE_H__
 #define __PARTICLE_H__
 
+#include "asm.h"
+
+// The compiler version; compiled code is cached per version
+#define PARTICLE_VERSION "0.1"
+
+void write_code(Code *);
+void display_timing();
 void display_usage();
 
 #endif /* __PARTICLE_H__ */
@@ -0,0 +1,209 @@
+// Runs many object files in parallel
+//
+// The runner spreads object files over a pool of worker threads. Each worker
+// owns one machine and reuses it for every file it takes, so a job costs a
+// load and a run, not a process. A file that is run more than once is loaded
+// once into a snapshot, and its jobs start from the snapshot instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "runner.h"
+#include "vm.h"
+#include "file.h"
+#include "error.h"
+#include "utils.h"
+
+// A job: one run of an object file
+
+typedef struct Job {
+    char *file;           // the name of the object file
+    VmSnapshot *snapshot; // the loaded file, shared with the other jobs of the file; NULL if it is run once
+} Job;
+
+// The shared state of a run
+
+typedef struct Runner {
+    Job *jobs;              // the jobs, in the order the files were given
+    int count;              // the number of jobs
+    VmSnapshot **snapshots; // the snapshots of the files that are run more than once
+    int snapshot_count;     // the number of snapshots
+    int next;               // the index of the next file to hand out
+    int failures;           // the number of files that could not be run
+    pthread_mutex_t lock;   // guards next, failures and error reports
+} Runner;
+
+static void runner_prepare(Runner *, char **);
+static void *runner_worker(void *);
+static void runner_report(Runner *, const char *, const char *);
+static int job_compare(const void *, const void *);
+
+/**
+ * Runs object files on a pool of worker threads
+ *
+ * char **files: The names of the object files
+ * int count:    The number of files
+ * int jobs:     The number of worker threads
+ *
+ * Returns the number of files that failed to load or faulted
+ */
+int runner_run(char **files, int count, int jobs)
+{
+    Runner runner;
+    pthread_t *workers;
+    int i;
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if (jobs > count) {
+        jobs = count;
+    }
+
+    runner.count = count;
+    runner.next = 0;
+    runner.failures = 0;
+    pthread_mutex_init(&runner.lock, NULL);
+    runner_prepare(&runner, files);
+
+    workers = (pthread_t*)emalloc(jobs * sizeof(*workers));
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, runner_worker, &runner) != 0) {
+            fail("runner: unable to start worker thread");
+        }
+    }
+    for (i = 0; i < jobs; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (i = 0; i < runner.snapshot_count; i++) {
+        vm_snapshot_destroy(runner.snapshots[i]);
+    }
+    free(runner.snapshots);
+    free(runner.jobs);
+    pthread_mutex_destroy(&runner.lock);
+    return runner.failures;
+}
+
+// Makes a job for each file, in the order the files were given. The jobs are
+// grouped by file through a sorted index, and each file that is run more than
+// once is loaded into a snapshot for its jobs to share.
+
+static void runner_prepare(Runner *runner, char **files)
+{
+    VmSnapshot *snapshot;
+    Job **order; // the jobs, grouped by file
+    File *file;
+    Vm *vm;
+    int first; // the first job of a group
+    int last;  // the job after the last job of a group
+    int i;
+
+    runner->jobs = (Job*)emalloc(runner->count * sizeof(*runner->jobs));
+    order = (Job**)emalloc(runner->count * sizeof(*order));
+    for (i = 0; i < runner->count; i++) {
+        runner->jobs[i].file = files[i];
+        runner->jobs[i].snapshot = NULL;
+        order[i] = &runner->jobs[i];
+    }
+    qsort(order, runner->count, sizeof(*order), job_compare);
+    runner->snapshots = (VmSnapshot**)emalloc(runner->count * sizeof(*runner->snapshots));
+    runner->snapshot_count = 0;
+
+    vm = NULL;
+    for (first = 0; first < runner->count; first = last) {
+        for (last = first + 1; last < runner->count; last++) {
+            if (strcmp(order[first]->file, order[last]->file) != 0) {
+                break;
+            }
+        }
+        if (last - first < 2) {
+            continue;
+        }
+
+        // files that cannot be loaded are left to the workers to report
+        file = file_try_open(order[first]->file, "rb");
+        if (file == NULL) {
+            continue;
+        }
+        if (vm == NULL) {
+            vm = vm_create();
+        }
+        if (vm_load(vm, file) == VM_OK) {
+            snapshot = vm_snapshot(vm);
+            runner->snapshots[runner->snapshot_count++] = snapshot;
+            for (i = first; i < last; i++) {
+                order[i]->snapshot = snapshot;
+            }
+        }
+        file_close(file);
+    }
+    if (vm != NULL) {
+        vm_destroy(vm);
+    }
+    free(order);
+}
+
+// Takes jobs from the runner and runs them until there are none left
+
+static void *runner_worker(void *arg)
+{
+    Runner *runner = (Runner*)arg;
+    Job *job;
+    File *file;
+    Vm *vm;
+    int i;
+
+    vm = vm_create();
+    for (;;) {
+        pthread_mutex_lock(&runner->lock);
+        i = runner->next++;
+        pthread_mutex_unlock(&runner->lock);
+        if (i >= runner->count) {
+            break;
+        }
+        job = &runner->jobs[i];
+
+        if (job->snapshot != NULL) {
+            vm_restore(vm, job->snapshot);
+            if (vm_run(vm) != VM_OK) {
+                runner_report(runner, job->file, vm_error(vm));
+            }
+            continue;
+        }
+
+        file = file_try_open(job->file, "rb");
+        if (file == NULL) {
+            runner_report(runner, job->file, "unable to open file");
+            continue;
+        }
+        if (vm_load(vm, file) != VM_OK || vm_run(vm) != VM_OK) {
+            runner_report(runner, job->file, vm_error(vm));
+        }
+        file_close(file);
+    }
+    vm_destroy(vm);
+    return NULL;
+}
+
+// Counts a failed file and reports why it failed
+
+static void runner_report(Runner *runner, const char *name, const char *message)
+{
+    pthread_mutex_lock(&runner->lock);
+    runner->failures++;
+    error("%s: %s", name, message);
+    pthread_mutex_unlock(&runner->lock);
+}
+
+// Orders pointers to jobs by file name
+
+static int job_compare(const void *a, const void *b)
+{
+    const Job *x = *(const Job * const *)a;
+    const Job *y = *(const Job * const *)b;
+
+    return strcmp(x->file, y->file);
+}
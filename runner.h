@@ -0,0 +1,8 @@
+#ifndef __PARTICLE_RUNNER_H__
+#define __PARTICLE_RUNNER_H__
+
+// Prototypes
+
+int runner_run(char **, int, int);
+
+#endif /* __PARTICLE_RUNNER_H__ */
@@ -0,0 +1,148 @@
+// Source text
+//
+// A source file is mapped into memory when it is a regular file, and read
+// into memory in large blocks otherwise, so pipes work too. The lexer walks
+// the text with a plain offset.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "source.h"
+#include "error.h"
+#include "utils.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define SOURCE_MMAP // regular files are mapped instead of read
+#endif
+
+// The size of the blocks in which a source that cannot be mapped is read
+#define SOURCE_BLOCK_SIZE (64 * 1024)
+
+static bool source_map(Source *);
+static void source_read(Source *);
+
+// Create source from a file
+
+Source *source_create(File *file)
+{
+    Source *source;
+
+    source = (Source*)emalloc(sizeof(*source));
+    source->text = NULL;
+    source->size = 0;
+    source->mapped = false;
+    source->file = file;
+    source->mark = 0;
+    source->mark_line_start = 0;
+    source->mark_lineno = 1;
+
+    // the file may have just been written through its handle
+    fflush(file->handle);
+    if (!source_map(source)) {
+        source_read(source);
+    }
+    return source;
+}
+
+// Work out the line and column numbers of the character at the given offset.
+// Lines are counted on from the last offset that was located, so locating
+// offsets in increasing order costs one pass over the text in all.
+
+void source_locate(Source *source, size_t offset, unsigned int *lineno, unsigned int *colno)
+{
+    const char *p;
+
+    if (offset > source->size) {
+        offset = source->size;
+    }
+    if (offset < source->mark) {
+        source->mark = 0;
+        source->mark_line_start = 0;
+        source->mark_lineno = 1;
+    }
+
+    while (source->mark < offset && (p = memchr(source->text + source->mark, '\n', offset - source->mark)) != NULL) {
+        source->mark = p - source->text + 1;
+        source->mark_line_start = source->mark;
+        source->mark_lineno++;
+    }
+    source->mark = offset;
+
+    *lineno = source->mark_lineno;
+    *colno = offset - source->mark_line_start + 1;
+}
+
+// Destroy source. The file is left open.
+
+void source_destroy(Source *source)
+{
+#if defined(SOURCE_MMAP)
+    if (source->mapped) {
+        munmap((void*)source->text, source->size);
+        free(source);
+        return;
+    }
+#endif
+    free((void*)source->text);
+    free(source);
+}
+
+// Map the source file into memory. Returns FALSE if the file cannot be mapped.
+
+static bool source_map(Source *source)
+{
+#if defined(SOURCE_MMAP)
+    struct stat status;
+    void *text;
+
+    if (fstat(fileno(source->file->handle), &status) != 0 || !S_ISREG(status.st_mode)) {
+        return false;
+    }
+    // an empty file cannot be mapped, but there is nothing to read either
+    if (status.st_size == 0) {
+        source->text = NULL;
+        source->size = 0;
+        return true;
+    }
+    text = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fileno(source->file->handle), 0);
+    if (text == MAP_FAILED) {
+        return false;
+    }
+    source->text = text;
+    source->size = status.st_size;
+    source->mapped = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Read the source file into memory, a block at a time
+
+static void source_read(Source *source)
+{
+    char *text;
+    size_t capacity;
+    size_t size;
+    size_t count;
+
+    capacity = SOURCE_BLOCK_SIZE;
+    text = (char*)emalloc(capacity);
+    size = 0;
+
+    while ((count = fread(text + size, 1, capacity - size, source->file->handle)) > 0) {
+        size += count;
+        if (size == capacity) {
+            capacity *= 2;
+            text = (char*)erealloc(text, capacity);
+        }
+    }
+    if (ferror(source->file->handle)) {
+        fail("Unable to read source file %s", source->file->name);
+    }
+
+    source->text = text;
+    source->size = size;
+}
@@ -0,0 +1,25 @@
+#ifndef __PARTICLE_SOURCE_H__
+#define __PARTICLE_SOURCE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "file.h"
+
+// Source holds the whole text of a source file in one contiguous buffer.
+// Line and column numbers are not tracked while reading; they are worked out
+// from an offset when they are asked for.
+typedef struct Source {
+    const char *text;         // the source text; not NUL-terminated
+    size_t size;              // the number of bytes of text
+    bool mapped;              // TRUE if the text is mapped from the file rather than read
+    File *file;               // the source file
+    size_t mark;              // offset up to which lines have been counted
+    size_t mark_line_start;   // offset of the start of the line that contains the mark
+    unsigned int mark_lineno; // line number of the line that contains the mark
+} Source;
+
+Source *source_create(File *);
+void source_locate(Source *, size_t, unsigned int *, unsigned int *);
+void source_destroy(Source *);
+
+#endif /* __PARTICLE_SOURCE_H__ */
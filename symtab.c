@@ -0,0 +1,130 @@
+// Symbol tables
+//
+// The assembler keeps its labels and equates in a hash table with open
+// addressing and linear probing. The slots are one flat array, so a lookup
+// hashes the name once and usually compares it against a single slot. The
+// table doubles when it becomes half full.
+
+#include <stdlib.h>
+#include <string.h>
+#include "symtab.h"
+#include "utils.h"
+
+// The number of slots a new table starts with; a power of two
+#define SYMTAB_INITIAL_SIZE 256
+
+static unsigned int symtab_hash(const char *);
+static Symbol *symtab_probe(Symtab *, const char *, unsigned int);
+static void symtab_grow(Symtab *);
+
+// Create an empty symbol table
+
+Symtab *symtab_create(void)
+{
+    Symtab *symtab;
+
+    symtab = (Symtab*)emalloc(sizeof(*symtab));
+    symtab->slots = (Symbol*)emalloc(SYMTAB_INITIAL_SIZE * sizeof(*symtab->slots));
+    memset(symtab->slots, 0, SYMTAB_INITIAL_SIZE * sizeof(*symtab->slots));
+    symtab->mask = SYMTAB_INITIAL_SIZE - 1;
+    symtab->count = 0;
+    return symtab;
+}
+
+// Look up a symbol by name. Returns NULL if the name is not in the table.
+
+Symbol *symtab_lookup(Symtab *symtab, const char *name)
+{
+    Symbol *symbol;
+
+    symbol = symtab_probe(symtab, name, symtab_hash(name));
+    return symbol->name != NULL ? symbol : NULL;
+}
+
+// Find a symbol by name, and add it to the table if it is not there yet. A new
+// symbol is undefined. The name is not copied, so it must outlive the table.
+
+Symbol *symtab_insert(Symtab *symtab, const char *name)
+{
+    Symbol *symbol;
+    unsigned int hash;
+
+    hash = symtab_hash(name);
+    symbol = symtab_probe(symtab, name, hash);
+    if (symbol->name != NULL) {
+        return symbol;
+    }
+
+    // keep the table at most half full so probe sequences stay short
+    if (2 * (symtab->count + 1) > symtab->mask + 1) {
+        symtab_grow(symtab);
+        symbol = symtab_probe(symtab, name, hash);
+    }
+    symbol->name = name;
+    symbol->hash = hash;
+    symbol->type = 0;
+    symbol->value = 0;
+    symbol->lineno = 0;
+    symbol->fixups = NULL;
+    symtab->count++;
+    return symbol;
+}
+
+// Destroy a symbol table
+
+void symtab_destroy(Symtab *symtab)
+{
+    free(symtab->slots);
+    free(symtab);
+}
+
+// FNV-1a hash of a name
+
+static unsigned int symtab_hash(const char *name)
+{
+    return fnv1a32(FNV1A32_BASIS, name, strlen(name));
+}
+
+// Find the slot of a name: the slot that holds it, or the empty slot it would
+// go in
+
+static Symbol *symtab_probe(Symtab *symtab, const char *name, unsigned int hash)
+{
+    Symbol *symbol;
+    size_t i;
+
+    for (i = hash & symtab->mask; ; i = (i + 1) & symtab->mask) {
+        symbol = &symtab->slots[i];
+        if (symbol->name == NULL) {
+            return symbol;
+        }
+        if (symbol->hash == hash && strcmp(symbol->name, name) == 0) {
+            return symbol;
+        }
+    }
+}
+
+// Double the number of slots and move every symbol to its slot in the new
+// array
+
+static void symtab_grow(Symtab *symtab)
+{
+    Symbol *slots;
+    size_t size;
+    size_t i;
+    size_t j;
+
+    slots = symtab->slots;
+    size = symtab->mask + 1;
+    symtab->slots = (Symbol*)emalloc(2 * size * sizeof(*symtab->slots));
+    memset(symtab->slots, 0, 2 * size * sizeof(*symtab->slots));
+    symtab->mask = 2 * size - 1;
+    for (i = 0; i < size; i++) {
+        if (slots[i].name != NULL) {
+            for (j = slots[i].hash & symtab->mask; symtab->slots[j].name != NULL; j = (j + 1) & symtab->mask) {
+            }
+            symtab->slots[j] = slots[i];
+        }
+    }
+    free(slots);
+}
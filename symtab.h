@@ -0,0 +1,43 @@
+#ifndef __PARTICLE_SYMTAB_H__
+#define __PARTICLE_SYMTAB_H__
+
+#include <stddef.h>
+
+// Symbol types
+#define SYMTYPE_LABEL 1 // stands for an address in the program
+#define SYMTYPE_EQU   2 // stands for a value given by the equ directive
+
+// A place in the code image where the value of a symbol goes once the symbol
+// is defined
+typedef struct Fixup {
+    unsigned long address; // the address of the first byte of the value
+    int size;              // the number of bytes of the value
+    unsigned int lineno;   // the line that refers to the symbol
+    struct Fixup *next;    // the next place the symbol is referred to
+} Fixup;
+
+// A symbol of an assembly program
+typedef struct Symbol {
+    const char *name;    // the name of the symbol; NULL for an empty slot
+    unsigned int hash;   // the hash of the name
+    int type;            // the symbol type; 0 until the symbol is defined
+    unsigned long value; // the address or value the symbol stands for
+    unsigned int lineno; // the line the symbol is defined on
+    Fixup *fixups;       // references made before the symbol was defined
+} Symbol;
+
+// A symbol table is a hash table with open addressing. It is kept at most
+// half full, so a lookup takes about one probe however many symbols there are.
+typedef struct Symtab {
+    Symbol *slots;   // the slots; the number of slots is a power of two
+    size_t mask;     // the number of slots minus one
+    size_t count;    // the number of symbols
+} Symtab;
+
+// Symbol table operations
+Symtab *symtab_create(void);
+Symbol *symtab_lookup(Symtab *, const char *);
+Symbol *symtab_insert(Symtab *, const char *);
+void symtab_destroy(Symtab *);
+
+#endif /* __PARTICLE_SYMTAB_H__ */
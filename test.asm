@@ -1,20 +1,23 @@
 main:
-    movd string             # push address of string on expr stack
-    call puts               # display the string
+    call total              # add up the numbers from count down to 1
     halt                    # stop machine
 
-puts:
-    pushb                   # push character from address at top of expr stack
-    jz puts_exit            # if we reached end-of-string then exit
-    put                     # display character
-    dropb                   # drop the character
-    movd 000001h            # lets goto the next character
-    add                     # step to next char by adding 1 to the address at TOES
-    jmp puts                # lets go print the character
-puts_exit:
-    ret                     # exit puts
+total:
+    loadbi count            # push the count on expr stack
+    jz total_exit           # if the count reached zero then exit
+    loadbi sum              # push the sum so far
+    addbi                   # add the count to the sum
+    pullbi sum              # store the new sum
+    loadbi count            # push the count again
+    pushbi 1                # lets step to the next number
+    subbi                   # by subtracting 1 from the count
+    pullbi count            # store the new count
+    jmp total               # lets go add the next number
+total_exit:
+    popbi                   # drop the count
+    ret                     # exit total
 
-
-string:                     # the string to display
-    db "Hello Word"
+count:                      # the numbers to add
+    db 10
+sum:                        # the sum of the numbers added so far
     db 0
@@ -0,0 +1,184 @@
+// Timing
+//
+// Each phase of a run is timed twice: by the monotonic clock, for the time
+// that passed, and by the CPU clock of the process, for the time spent
+// computing. A phase that runs more than once adds up. Along with the phases
+// go the counts they produced, from which throughputs are worked out, and the
+// peak resident set size of the process.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include "timing.h"
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#define TIMING_RSS // the peak resident set size can be asked for
+#endif
+
+static double timing_clock(clockid_t);
+static long timing_peak_rss(void);
+static double timing_rate(unsigned long long, double);
+
+static const char *phase_names[TIMING_PHASES] = {
+    "cache", "parse", "compile", "assemble", "write", "execute"
+};
+static const char *count_names[TIMING_COUNTS] = {
+    "tokens", "asm_lines", "object_bytes", "instructions"
+};
+
+static double begin_wall;                 // the time timing began
+static double begin_cpu;                  // the CPU time timing began
+static double start_wall[TIMING_PHASES];  // the time each running phase started
+static double start_cpu[TIMING_PHASES];   // the CPU time each running phase started
+static double wall[TIMING_PHASES];        // the time spent in each phase, in milliseconds
+static double cpu[TIMING_PHASES];         // the CPU time spent in each phase, in milliseconds
+static bool ran[TIMING_PHASES];           // TRUE for each phase that ran
+static unsigned long long counts[TIMING_COUNTS]; // the counts
+static bool counted[TIMING_COUNTS];       // TRUE for each count that was given
+
+// Start timing the run
+
+void timing_init(void)
+{
+    begin_wall = timing_clock(CLOCK_MONOTONIC);
+    begin_cpu = timing_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Start a phase
+
+void timing_start(int phase)
+{
+    start_wall[phase] = timing_clock(CLOCK_MONOTONIC);
+    start_cpu[phase] = timing_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Stop a phase, and add the time since it started to it
+
+void timing_stop(int phase)
+{
+    wall[phase] += timing_clock(CLOCK_MONOTONIC) - start_wall[phase];
+    cpu[phase] += timing_clock(CLOCK_PROCESS_CPUTIME_ID) - start_cpu[phase];
+    ran[phase] = true;
+}
+
+// Add to a count
+
+void timing_count(int count, unsigned long long value)
+{
+    counts[count] += value;
+    counted[count] = true;
+}
+
+// Display the times of the phases that ran, the counts and their throughputs,
+// and the peak resident set size, as text or as a JSON object
+
+void timing_report(int format)
+{
+    double total_wall;
+    double total_cpu;
+    double rates[TIMING_COUNTS];
+    long rss;
+    bool first;
+    int i;
+
+    total_wall = timing_clock(CLOCK_MONOTONIC) - begin_wall;
+    total_cpu = timing_clock(CLOCK_PROCESS_CPUTIME_ID) - begin_cpu;
+    rss = timing_peak_rss();
+
+    // tokens are read while parsing; instructions are retired while executing
+    rates[TIMING_TOKENS] = timing_rate(counts[TIMING_TOKENS], wall[TIMING_PARSE] + wall[TIMING_COMPILE]);
+    rates[TIMING_ASM_LINES] = timing_rate(counts[TIMING_ASM_LINES], wall[TIMING_ASSEMBLE]);
+    rates[TIMING_OBJECT_BYTES] = 0;
+    rates[TIMING_INSTRUCTIONS] = timing_rate(counts[TIMING_INSTRUCTIONS], wall[TIMING_EXECUTE]);
+
+    if (format == TIMING_JSON) {
+        printf("{\"phases\": {");
+        first = true;
+        for (i = 0; i < TIMING_PHASES; i++) {
+            if (ran[i]) {
+                printf("%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", first ? "" : ", ", phase_names[i], wall[i], cpu[i]);
+                first = false;
+            }
+        }
+        printf("}, \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", total_wall, total_cpu);
+        for (i = 0; i < TIMING_COUNTS; i++) {
+            if (counted[i]) {
+                printf(", \"%s\": %llu", count_names[i], counts[i]);
+                if (rates[i] > 0) {
+                    printf(", \"%s_per_sec\": %.0f", count_names[i], rates[i]);
+                }
+            }
+        }
+        if (counted[TIMING_INSTRUCTIONS]) {
+            printf(", \"mips\": %.3f", rates[TIMING_INSTRUCTIONS] / 1e6);
+        }
+        if (rss >= 0) {
+            printf(", \"peak_rss_kb\": %ld", rss);
+        }
+        else {
+            printf(", \"peak_rss_kb\": null");
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("Timing:\n");
+    printf("  %-18s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+    for (i = 0; i < TIMING_PHASES; i++) {
+        if (ran[i]) {
+            printf("  %-18s %12.3f %12.3f\n", phase_names[i], wall[i], cpu[i]);
+        }
+    }
+    printf("  %-18s %12.3f %12.3f\n", "total", total_wall, total_cpu);
+    if (counted[TIMING_TOKENS]) {
+        printf("  %-18s %12llu   (%.2f M/s)\n", "tokens", counts[TIMING_TOKENS], rates[TIMING_TOKENS] / 1e6);
+    }
+    if (counted[TIMING_ASM_LINES]) {
+        printf("  %-18s %12llu   (%.2f M/s)\n", "assembly lines", counts[TIMING_ASM_LINES], rates[TIMING_ASM_LINES] / 1e6);
+    }
+    if (counted[TIMING_OBJECT_BYTES]) {
+        printf("  %-18s %12llu\n", "object code bytes", counts[TIMING_OBJECT_BYTES]);
+    }
+    if (counted[TIMING_INSTRUCTIONS]) {
+        printf("  %-18s %12llu   (%.2f MIPS)\n", "instructions", counts[TIMING_INSTRUCTIONS], rates[TIMING_INSTRUCTIONS] / 1e6);
+    }
+    if (rss >= 0) {
+        printf("  %-18s %8ld KiB\n", "peak RSS", rss);
+    }
+}
+
+// Read a clock, in milliseconds
+
+static double timing_clock(clockid_t clock)
+{
+    struct timespec now;
+
+    if (clock_gettime(clock, &now) != 0) {
+        return 0;
+    }
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// Find the peak resident set size of the process, in kilobytes. Returns -1
+// if the host does not tell.
+
+static long timing_peak_rss(void)
+{
+#if defined(TIMING_RSS)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_maxrss;
+    }
+#endif
+    return -1;
+}
+
+// Work out the number of things done per second, from a count and the
+// milliseconds it took. Returns 0 if no time was taken.
+
+static double timing_rate(unsigned long long count, double ms)
+{
+    return ms > 0 ? count / (ms / 1e3) : 0;
+}
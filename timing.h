@@ -0,0 +1,33 @@
+#ifndef __PARTICLE_TIMING_H__
+#define __PARTICLE_TIMING_H__
+
+#include <stdbool.h>
+
+// Timed phases
+#define TIMING_CACHE    0 // looking a source up in the compile cache
+#define TIMING_PARSE    1 // reading a source: lexing and parsing, and translating Particle
+#define TIMING_COMPILE  2 // compiling Particle function by function from the cache
+#define TIMING_ASSEMBLE 3 // assembling
+#define TIMING_WRITE    4 // writing assembly and machine code files
+#define TIMING_EXECUTE  5 // loading and running machine code
+#define TIMING_PHASES   6
+
+// Counts reported along with the phases
+#define TIMING_TOKENS       0 // tokens read by the lexer
+#define TIMING_ASM_LINES    1 // assembly lines assembled
+#define TIMING_OBJECT_BYTES 2 // bytes of machine code produced
+#define TIMING_INSTRUCTIONS 3 // instructions the machine retired
+#define TIMING_COUNTS       4
+
+// Report formats
+#define TIMING_TEXT 1
+#define TIMING_JSON 2
+
+// Timing operations
+void timing_init(void);
+void timing_start(int);
+void timing_stop(int);
+void timing_count(int, unsigned long long);
+void timing_report(int);
+
+#endif /* __PARTICLE_TIMING_H__ */
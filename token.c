@@ -2,269 +2,222 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include "token.h"
+#include "arena.h"
 #include "error.h"
 #include "utils.h"
 #include "debug.h"
 
-// Create new token
-Token *token_create()
-{
-    Token *ptr;
-
-    ptr = (Token*)emalloc(sizeof(Token));
-    ptr->eol = false;
-    ptr->eof = false;
-    return ptr;
-}
-
-// Destroy token
-void token_destroy(Token *token)
-{
-    free(token);
-}
-
-// Push character to lexeme
-
-void token_push_to_lexeme(Token *token, int c)
-{
-    if (token->top == TOKEN_LEXEME_SIZE) {
-        fail("Overflow has occurred on token lexeme stack. Culprit: `%s'. To avoid an overflow,"
-             "keep the length of your tokens under %d characters", token->lexeme, TOKEN_LEXEME_SIZE);
-    }
-    token->lexeme[token->top++] = c;
-    token->lexeme[token->top] = '\0';
-}
-
-// Pop character from lexeme
-
-int token_pop_from_lexeme(Token *token)
-{
-    int c;
-
-    if (token->top == -1) {
-        fail(
-            "Underflow has occurred on token lexeme stack. Something went wrong."
-            "There is a bug creeping around inside the compiler");
-    }
-    token->top--;
-    c = token->lexeme[token->top];
-    token->lexeme[token->top] = '\0';
-
-    return c;
-}
-
-// Flush lexeme
+// Get a NUL-terminated copy of a token's lexeme, allocated from an arena
 
-void token_flush_lexeme(Token *token)
+char *token_string(const Token *token, Arena *arena)
 {
-    token->top = 0;
-    token->lexeme[token->top] = '\0';
+    return arena_substr(arena, token->lexeme, token->length);
 }
 
-char *token_meaning(TokenType type)
+const char *token_meaning(TokenType type)
 {
-    char *s;
+    const char *s;
     switch (type) {
         case t_id:
-            s = dupstr("identifier");
+            s = "identifier";
             break;
         case t_int:
-            s = dupstr("integer");
+            s = "integer";
             break;
         case t_byte:
-            s = dupstr("byte");
+            s = "byte";
             break;
         case t_word:
-            s = dupstr("word");
+            s = "word";
             break;
         case t_dword:
-            s = dupstr("dword");
+            s = "dword";
             break;
         case t_null:
-            s = dupstr("null");
+            s = "null";
             break;
         case t_false:
-            s = dupstr("false");
+            s = "false";
             break;
         case t_true:
-            s = dupstr("true");
+            s = "true";
             break;
         case t_void:
-            s = dupstr("void");
+            s = "void";
             break;
         case t_entry:
-            s = dupstr("entry");
+            s = "entry";
             break;
         case t_def:
-            s = dupstr("def`");
+            s = "def`";
             break;
         case t_enddef:
-            s = dupstr("enddef");
+            s = "enddef";
             break;
         case t_var:
-            s = dupstr("var");
+            s = "var";
             break;
         case t_endvar:
-            s = dupstr("endvar");
+            s = "endvar";
             break;
         case t_body:
-            s = dupstr("body");
+            s = "body";
             break;
         case t_end:
-            s = dupstr("end");
+            s = "end";
             break;
         case t_break:
-            s = dupstr("break");
+            s = "break";
             break;
         case t_continue:
-            s = dupstr("continue");
+            s = "continue";
             break;
         case t_next:
-            s = dupstr("next");
+            s = "next";
             break;
         case t_ret:
-            s = dupstr("ret");
+            s = "ret";
             break;
         case t_if:
-            s = dupstr("if");
+            s = "if";
             break;
         case t_else:
-            s = dupstr("else");
+            s = "else";
             break;
         case t_elseif:
-            s = dupstr("elseif");
+            s = "elseif";
             break;
         case t_endif:
-            s = dupstr("endif");
+            s = "endif";
             break;
         case t_while:
-            s = dupstr("while");
+            s = "while";
             break;
         case t_endwhile:
-            s = dupstr("endwhile");
+            s = "endwhile";
             break;
         case t_for:
-            s = dupstr("for");
+            s = "for";
             break;
         case t_endfor:
-            s = dupstr("endfor");
+            s = "endfor";
             break;
         case t_sqstr:
-            s = dupstr("single-quote string");
+            s = "single-quote string";
             break;
         case t_dqstr:
-            s = dupstr("double-quote string");
+            s = "double-quote string";
             break;
         case t_assign_op:
-            s = dupstr("assignment operator");
+            s = "assignment operator";
             break;
         case t_add_op:
-            s = dupstr("addition operator");
+            s = "addition operator";
             break;
         case t_sub_op:
-            s = dupstr("subtraction operator");
+            s = "subtraction operator";
             break;
         case t_mul_op:
-            s = dupstr("multiplication operator");
+            s = "multiplication operator";
             break;
         case t_div_op:
-            s = dupstr("division operator");
+            s = "division operator";
             break;
         case t_mod_op:
-            s = dupstr("modulus operator");
+            s = "modulus operator";
             break;
         case t_sizeof_op:
-            s = dupstr("sizeof operator");
+            s = "sizeof operator";
             break;
         case t_addrof_op:
-            s = dupstr("address-of operator");
+            s = "address-of operator";
             break;
         case t_bitwise_neg_op:
-            s = dupstr("bitwise NEG operator");
+            s = "bitwise NEG operator";
             break;
         case t_bitwise_or_op:
-            s = dupstr("bitwise OR operator");
+            s = "bitwise OR operator";
             break;
         case t_bitwise_xor_op:
-            s = dupstr("bitwise XOR operator");
+            s = "bitwise XOR operator";
             break;
         case t_bitwise_and_op:
-            s = dupstr("bitwise AND operator");
+            s = "bitwise AND operator";
             break;
         case t_bitwise_shl_op:
-            s = dupstr("bitwise SHL operator");
+            s = "bitwise SHL operator";
             break;
         case t_bitwise_shr_op:
-            s = dupstr("bitwise SHR operator");
+            s = "bitwise SHR operator";
             break;
         case t_bitwise_rol_op:
-            s = dupstr("bitwise ROL operator");
+            s = "bitwise ROL operator";
             break;
         case t_bitwise_ror_op:
-            s = dupstr("bitwise ROR operator");
+            s = "bitwise ROR operator";
             break;
         case t_eq_op:
-            s = dupstr("equal operator");
+            s = "equal operator";
             break;
         case t_neq_op:
-            s = dupstr("not-equal operator");
+            s = "not-equal operator";
             break;
         case t_lt_op:
-            s = dupstr("less-than operator");
+            s = "less-than operator";
             break;
         case t_lte_op:
-            s = dupstr("less-than-equal operator");
+            s = "less-than-equal operator";
             break;
         case t_gt_op:
-            s = dupstr("greater-than operator");
+            s = "greater-than operator";
             break;
         case t_gte_op:
-            s = dupstr("greater-than-equal operator");
+            s = "greater-than-equal operator";
             break;
         case t_logical_and_op:
-            s = dupstr("logical AND operator");
+            s = "logical AND operator";
             break;
         case t_logical_or_op:
-            s = dupstr("logical OR operator");
+            s = "logical OR operator";
             break;
         case t_logical_neg_op:
-            s = dupstr("logical NEG operator");
+            s = "logical NEG operator";
             break;
         case t_comma:
-            s = dupstr("comma");
+            s = "comma";
             break;
         case t_lparen:
-            s = dupstr("left parentheses");
+            s = "left parentheses";
             break;
         case t_rparen:
-            s = dupstr("right parentheses");
+            s = "right parentheses";
             break;
         case t_lbracket:
-            s = dupstr("left bracket");
+            s = "left bracket";
             break;
         case t_rbracket:
-            s = dupstr("right bracket");
+            s = "right bracket";
             break;
         case t_colon:
-            s = dupstr("colon");
+            s = "colon";
             break;
         case t_semicolon:
-            s = dupstr("semicolon");
+            s = "semicolon";
             break;
         case t_base_op:
-            s = dupstr("base operator");
+            s = "base operator";
             break;
         case t_newline:
-            s = dupstr("newline");
+            s = "newline";
             break;
         case t_eof:
-            s = dupstr("end-of-file");
+            s = "end-of-file";
             break;
         case t_eol:
-            s = dupstr("end-of-line");
+            s = "end-of-line";
             break;
         case t_unknown:
-            s = dupstr("unknown");
+            s = "unknown";
             break;
     }
     return s;
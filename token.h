@@ -2,10 +2,8 @@
 #define __PARTICLE_TOKEN_H__
 
 #include <stdbool.h>
-
-// Constant
-
-#define TOKEN_LEXEME_SIZE 256
+#include <stddef.h>
+#include "arena.h"
 
 // Token types
 
@@ -87,25 +85,25 @@ typedef enum TokenType {
 
 // Token
 
+// A token does not own its lexeme. The lexeme is a slice of the source text,
+// given by a pointer and a length, and is not NUL-terminated; print it with
+// "%.*s". Use token_string() for a NUL-terminated copy.
 typedef struct Token {
-    char lexeme[TOKEN_LEXEME_SIZE]; // string that's treated like a stack; it stores the lexeme captured from source
-    int top;              // used by stack operations; points to top of lexeme
+    const char *lexeme;   // the lexeme captured from source; not NUL-terminated
+    size_t length;        // the number of characters in the lexeme
+    size_t offset;        // the offset in the source text where the token was found
     bool eol;             // special flag used to represent an EOL token
     bool eof;             // also a special flag that represents the EOF token
     TokenType type;       // token type
     int intval;           // store evaluated value of an integer literal
-    char *strval;         // store evaluated value of a string literal
+    char *strval;         // store evaluated value of a string literal; allocated from the lexer's arena
     unsigned int lineno;  // the line number on which the token was found
     unsigned int colno;   // the column number on which the token was found
 } Token;
 
 // Token operations
 
-Token *token_create();
-void token_destroy(Token *);
-void token_push_to_lexeme(Token *, int);
-int token_pop_from_lexeme(Token *);
-void token_flush_lexeme(Token *);
-char *token_meaning(TokenType);
+char *token_string(const Token *, Arena *);
+const char *token_meaning(TokenType);
 
 #endif /* __PARTICLE_TOKEN_H__ */
@@ -56,6 +56,38 @@ char *dupstr(const char *s)
     return p;
 }
 
+//=============================================================================
+// Hash functions
+//=============================================================================
+
+// Continue a 32-bit FNV-1a hash over more bytes. A hash starts from
+// FNV1A32_BASIS, or from another seed to get a different spread.
+
+unsigned int fnv1a32(unsigned int hash, const void *bytes, size_t count)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+
+    while (count-- > 0) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Continue a 64-bit FNV-1a hash over more bytes. A hash starts from
+// FNV1A64_BASIS.
+
+unsigned long long fnv1a64(unsigned long long hash, const void *bytes, size_t count)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+
+    while (count-- > 0) {
+        hash ^= *p++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 
 //=============================================================================
 // Error-trapped functions
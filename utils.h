@@ -11,6 +11,12 @@ int lowercase(int);
 char *substr(const char *, size_t);
 char *dupstr(const char *);
 
+// Hash utils
+#define FNV1A32_BASIS 2166136261u             // the offset basis of the 32-bit FNV-1a hash
+#define FNV1A64_BASIS 14695981039346656037ULL // the offset basis of the 64-bit FNV-1a hash
+unsigned int fnv1a32(unsigned int, const void *, size_t);
+unsigned long long fnv1a64(unsigned long long, const void *, size_t);
+
 // Error-trapped utils
 FILE *efopen(const char *, const char *);
 void *emalloc(size_t);
@@ -2,12 +2,30 @@
 // Includes
 //==============================================================================
 
+#if defined(__linux__)
+#define _GNU_SOURCE // memfd_create()
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <setjmp.h>
 #include "vm.h"
 #include "opcode.h"
+#include "fusion.h"
 #include "error.h"
 #include "utils.h"
+#include "keyword.h"
+#include "object.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VM_MMAP // memory, snapshots and object files are mapped copy-on-write
+#endif
 
 //==============================================================================
 // VM data sizes
@@ -15,7 +33,7 @@
 
 #define uint8 unsigned char
 #define uint16 unsigned short int
-#define uint32 unsigned long int
+#define uint32 unsigned int
 
 typedef uint8 byte;
 typedef uint16 word;
@@ -26,14 +44,14 @@ typedef uint32 dword;
 //==============================================================================
 
 #define ADDRESS_MASK                    0x3fffff   // mask for 22-bit address
-#define OPCODE_CLASS_MASK               0xfffffff0 // unmakes bits 5 to 31 in the instruction encoding where the opcode is located
-#define OPCODE_CLASS_NORMALIZER         0xf  // 0xf = 1111b: used to normalize the opcode class value to its actual value
+#define OPCODE_CLASS_MASK               0xff00 // unmasks bits 8 to 15 in the instruction encoding where the opcode is located
+#define OPCODE_CLASS_NORMALIZER         8  // used to normalize the opcode class value to its actual value
 #define OPERAND_SIZE_CLASS_MASK         12  // 12 = 1100b: unmasks bits 2 and 3 in the instruction encoding where opcode size is located
-#define OPERAND_SIZE_CLASS_NORMALIZER   3 // 3 = 0011b: used to normalize the operand-size class  to its actual value
-#define ADDRESSING_MODE_CLASS_MASK      2 // 2 = 0001b: unmasks bit 1 in the instruction encoding where the addressing mode of the instruction is located
+#define OPERAND_SIZE_CLASS_NORMALIZER   2 // used to normalize the operand-size class  to its actual value
+#define ADDRESSING_MODE_CLASS_MASK      2 // 2 = 0010b: unmasks bit 1 in the instruction encoding where the addressing mode of the instruction is located
 
 #define ADDRESSING_MODE_IMMEDIATE 0
-#define ADDRESSING_MODE_IMMEDIATE 0
+#define ADDRESSING_MODE_DIRECT    2
 
 #define OPERAND_SIZE_BYTE  1
 #define OPERAND_SIZE_WORD  2
@@ -68,9 +86,284 @@ typedef uint32 dword;
 #define CALL_STACK_SEGMENT_END   (CALL_STACK_SEGMENT_START + (SEGMENT_SIZE - 1))
 #define CALL_STACK_SEGMENT_SIZE  SEGMENT_SIZE
 
-// Memory data structure
+// The longest instruction is an instruction word followed by a dword
+// immediate field
+#define INSTRUCTION_MAX_SIZE     (WORD + DWORD)
+
+// The longest stretch of code covered by a single translation: a fused
+// sequence of instructions
+#define FUSION_MAX_LENGTH        3
+#define TRANSLATION_MAX_SIZE     (FUSION_MAX_LENGTH * INSTRUCTION_MAX_SIZE)
+
+// Memory is allocated with padding past its end. The padding absorbs the tail
+// of a word or dword access at the top of memory. The allocation is rounded
+// up to a whole number of pages so that it can be mapped from a snapshot.
+
+#define MEMORY_PAD               (DWORD - 1)
+#define MEMORY_ALLOC_SIZE        (MEMORY_SIZE + 64 * KB)
+
+//==============================================================================
+// Instruction set
+//==============================================================================
+
+// The instruction set is listed once and expanded by each execution engine.
+// Each entry gives the opcode name (as found in opcode.h), whether the
+// instruction reads its operand into the MDR, and the operation itself.
+// HALT is not listed because each engine stops in its own way.
+//
+// Stack items are big-endian like everything else in memory. JZ, JNZ, JE
+// and JNE test the byte at TOES (and SOES). ROT and ROTC work on the top
+// three items; ROLL moves the item at the depth given by its operand to TOES.
+// Arithmetic and bitwise operations pull TOES then SOES and push the result.
+
+#define INSTRUCTION_SET(X) \
+    /* Stack */ \
+    X(PUSHBI, true,  es_push(vm, BYTE, vm->mdr)) \
+    X(PUSHWI, true,  es_push(vm, WORD, vm->mdr)) \
+    X(PUSHDI, true,  es_push(vm, DWORD, vm->mdr)) \
+    X(PUSHSP, false, es_push(vm, DWORD, vm->ep)) \
+    X(PUSHFP, false, es_push(vm, DWORD, vm->fp)) \
+    X(POPBI,  false, es_pull(vm, BYTE)) \
+    X(POPWI,  false, es_pull(vm, WORD)) \
+    X(POPDI,  false, es_pull(vm, DWORD)) \
+    X(DUPBI,  false, es_push(vm, BYTE, es_read(vm, BYTE, 0))) \
+    X(DUPWI,  false, es_push(vm, WORD, es_read(vm, WORD, 0))) \
+    X(DUPDI,  false, es_push(vm, DWORD, es_read(vm, DWORD, 0))) \
+    X(OVERBI, false, es_push(vm, BYTE, es_read(vm, BYTE, BYTE))) \
+    X(OVERWI, false, es_push(vm, WORD, es_read(vm, WORD, WORD))) \
+    X(OVERDI, false, es_push(vm, DWORD, es_read(vm, DWORD, DWORD))) \
+    X(SWAPBI, false, es_roll(vm, BYTE, 1)) \
+    X(SWAPWI, false, es_roll(vm, WORD, 1)) \
+    X(SWAPDI, false, es_roll(vm, DWORD, 1)) \
+    X(ROLLBI, true,  es_roll(vm, BYTE, vm->mdr)) \
+    X(ROLLWI, true,  es_roll(vm, WORD, vm->mdr)) \
+    X(ROLLDI, true,  es_roll(vm, DWORD, vm->mdr)) \
+    X(ROTBI,  false, es_roll(vm, BYTE, 2)) \
+    X(ROTWI,  false, es_roll(vm, WORD, 2)) \
+    X(ROTDI,  false, es_roll(vm, DWORD, 2)) \
+    X(ROTCBI, false, es_rollc(vm, BYTE, 2)) \
+    X(ROTCWI, false, es_rollc(vm, WORD, 2)) \
+    X(ROTCDI, false, es_rollc(vm, DWORD, 2)) \
+    /* Memory */ \
+    X(LOADBI, true,  es_push(vm, BYTE, mem_load(vm, BYTE, vm->mdr))) \
+    X(LOADWI, true,  es_push(vm, WORD, mem_load(vm, WORD, vm->mdr))) \
+    X(LOADDI, true,  es_push(vm, DWORD, mem_load(vm, DWORD, vm->mdr))) \
+    X(PULLBI, true,  mem_store(vm, BYTE, vm->mdr, es_pull(vm, BYTE))) \
+    X(PULLWI, true,  mem_store(vm, WORD, vm->mdr, es_pull(vm, WORD))) \
+    X(PULLDI, true,  mem_store(vm, DWORD, vm->mdr, es_pull(vm, DWORD))) \
+    /* Jumps */ \
+    X(JMP,    true,  vm->pc = vm->mdr) \
+    X(JZ,     true,  if (es_read(vm, BYTE, 0) == 0) vm->pc = vm->mdr) \
+    X(JNZ,    true,  if (es_read(vm, BYTE, 0) != 0) vm->pc = vm->mdr) \
+    X(JE,     true,  if (es_read(vm, BYTE, 0) == es_read(vm, BYTE, BYTE)) vm->pc = vm->mdr) \
+    X(JNE,    true,  if (es_read(vm, BYTE, 0) != es_read(vm, BYTE, BYTE)) vm->pc = vm->mdr) \
+    X(CALL,   true,  cs_push(vm, vm->pc); vm->pc = vm->mdr) \
+    X(RET,    true,  vm->pc = cs_pull(vm); cs_drop(vm, vm->mdr)) \
+    /* Math */ \
+    X(ADDBI,  false, es_alu(vm, ALU_ADD, BYTE)) \
+    X(ADDWI,  false, es_alu(vm, ALU_ADD, WORD)) \
+    X(ADDDI,  false, es_alu(vm, ALU_ADD, DWORD)) \
+    X(SUBBI,  false, es_alu(vm, ALU_SUB, BYTE)) \
+    X(SUBWI,  false, es_alu(vm, ALU_SUB, WORD)) \
+    X(SUBDI,  false, es_alu(vm, ALU_SUB, DWORD)) \
+    X(MULBI,  false, es_alu(vm, ALU_MUL, BYTE)) \
+    X(MULWI,  false, es_alu(vm, ALU_MUL, WORD)) \
+    X(MULDI,  false, es_alu(vm, ALU_MUL, DWORD)) \
+    X(DIVBI,  false, es_alu(vm, ALU_DIV, BYTE)) \
+    X(DIVWI,  false, es_alu(vm, ALU_DIV, WORD)) \
+    X(DIVDI,  false, es_alu(vm, ALU_DIV, DWORD)) \
+    X(MODBI,  false, es_alu(vm, ALU_MOD, BYTE)) \
+    X(MODWI,  false, es_alu(vm, ALU_MOD, WORD)) \
+    X(MODDI,  false, es_alu(vm, ALU_MOD, DWORD)) \
+    /* Bitwise */ \
+    X(ANDBI,  false, es_alu(vm, ALU_AND, BYTE)) \
+    X(ANDWI,  false, es_alu(vm, ALU_AND, WORD)) \
+    X(ANDDI,  false, es_alu(vm, ALU_AND, DWORD)) \
+    X(ORBI,   false, es_alu(vm, ALU_OR, BYTE)) \
+    X(ORWI,   false, es_alu(vm, ALU_OR, WORD)) \
+    X(ORDI,   false, es_alu(vm, ALU_OR, DWORD)) \
+    X(XORBI,  false, es_alu(vm, ALU_XOR, BYTE)) \
+    X(XORWI,  false, es_alu(vm, ALU_XOR, WORD)) \
+    X(XORDI,  false, es_alu(vm, ALU_XOR, DWORD)) \
+    X(NOTBI,  false, es_not(vm, BYTE)) \
+    X(NOTWI,  false, es_not(vm, WORD)) \
+    X(NOTDI,  false, es_not(vm, DWORD)) \
+    X(SHLBI,  false, es_alu(vm, ALU_SHL, BYTE)) \
+    X(SHLWI,  false, es_alu(vm, ALU_SHL, WORD)) \
+    X(SHLDI,  false, es_alu(vm, ALU_SHL, DWORD)) \
+    X(SHRBI,  false, es_alu(vm, ALU_SHR, BYTE)) \
+    X(SHRWI,  false, es_alu(vm, ALU_SHR, WORD)) \
+    X(SHRDI,  false, es_alu(vm, ALU_SHR, DWORD)) \
+    /* Machine */ \
+    X(NOP,    false, )
+
+// Arithmetic and logic operations
+
+typedef enum AluOp {
+    ALU_ADD,
+    ALU_SUB,
+    ALU_MUL,
+    ALU_DIV,
+    ALU_MOD,
+    ALU_AND,
+    ALU_OR,
+    ALU_XOR,
+    ALU_SHL,
+    ALU_SHR
+} AluOp;
+
+//==============================================================================
+// Decoded instructions
+//==============================================================================
+
+// A decoded instruction holds everything the decode sequence derives from an
+// instruction word and its immediate field
+
+typedef struct Insn {
+    byte opcode;   // opcode class
+    byte oprsize;  // operand-size class
+    byte addrmode; // addressing-mode class
+    dword imm;     // immediate field: the operand or the address of the operand
+    dword next;    // address of the next instruction; 0 if not decoded yet
+} Insn;
+
+// Decoded-instruction cache. The switch engine remembers every instruction it
+// decodes in a table indexed by address, so that it decodes each instruction
+// in the code segment only once.
+
+// Threaded code. The threaded engine translates the code segment into a table
+// indexed by address. Each entry holds the address of the handler that
+// executes the instruction at that address, and the decoded instruction.
+// An entry without a handler has not been translated yet.
+
+typedef struct Thread {
+    const void *handler; // address of the handler label in run_threaded()
+    Insn insn;           // the decoded instruction
+} Thread;
+
+// Expression stack cache. In stack-caching mode the items at TOES and SOES
+// live in the machine instead of in memory, and are only spilled to memory
+// when an instruction reads or writes the expression stack segment through an
+// address. The EP always reflects the cached items.
+
+typedef struct StackItem {
+    dword data; // the item, truncated to its size
+    dword size; // the size of the item (BYTE, WORD or DWORD)
+} StackItem;
+
+#define STACK_CACHE_SIZE 2
+
+// Superinstructions. A fusion replaces the handler of the first instruction of
+// an opcode sequence with a handler that executes the whole sequence. The
+// instructions after the first keep their own entries, so that jumps into the
+// middle of a sequence still work.
+
+typedef struct Fusion {
+    byte opcodes[FUSION_MAX_LENGTH]; // the opcode sequence
+    int length;                      // the number of opcodes in the sequence
+    const void *handler;             // address of the fused handler in run_threaded()
+} Fusion;
+
+// An opcode sequence and the number of times it was seen in a profile
+
+typedef struct Sequence {
+    byte opcodes[FUSION_MAX_LENGTH];
+    int length;
+    unsigned long count;
+} Sequence;
+
+// The maximum number of fusions vm_fusion_generate() writes
+#define FUSION_TABLE_SIZE 32
+
+// The opcodes a profiling machine has executed. Pairs are counted by the
+// opcode executed first, then the one executed right after it.
+
+typedef struct Profile {
+    const char *name;                    // the file the profile is written to at HALT
+    unsigned long counts[256];           // the executions of each opcode
+    unsigned long pairs[256][256];       // the executions of each opcode pair
+    unsigned long taken[256];            // the conditional jumps that jumped, by opcode
+    int last;                            // the opcode executed last; -1 if none was
+} Profile;
+
+// Opcode names, as found in opcode.h, by opcode and by name
+
+static const char *opcode_names[256] = {
+#define X(name, operand, operation) [OC_##name] = #name,
+    INSTRUCTION_SET(X)
+#undef X
+    [OC_HALT] = "HALT"
+};
+
+static const Keyword opcode_keywords[] = {
+#define X(name, operand, operation) { #name, OC_##name },
+    INSTRUCTION_SET(X)
+#undef X
+    { "HALT", OC_HALT }
+};
+
+//==============================================================================
+// Machine
+//==============================================================================
 
-static char mem[MEMORY_SIZE];
+// A machine owns its memory, registers and decoded code, so that any number of
+// machines can run side by side in one process. Machines share nothing but
+// read-only tables.
+
+struct Vm {
+    byte *mem;          // memory: MEMORY_SIZE bytes followed by padding
+    bool mapped;        // TRUE if memory was mapped from the host rather than allocated
+    long int code_size; // number of bytes loaded into the code segment
+    bool clean;         // TRUE if memory is all zeroes
+    int engine;         // the execution engine
+    bool stack_caching; // keeps TOES and SOES out of memory if TRUE
+
+    // Status flags
+
+    bool sz; // zero flag
+    bool sn; // negative flag
+    bool sv; // overflow flag
+    bool sc; // carry flag
+
+    // Internal registers
+
+    dword pc;  // program counter
+    dword cir; // current instruction register
+    dword mar; // memory address register - stores the address for a memory operation
+    dword mdr; // memory data register - stores the data for a memory operation
+    dword ep;  // expression stack pointer
+    dword cp;  // call stack pointer
+    dword fp;  // frame pointer
+    dword t0;  // temporary register 0
+    dword t1;  // temporary register 1
+    dword t2;  // temporary register 2
+
+    StackItem stack_cache[STACK_CACHE_SIZE]; // TOES at index 0, SOES at index 1
+    int stack_cached;                        // the number of cached items
+
+    Insn *decoded;   // decoded instructions in the code segment; NULL until the switch engine runs
+    Thread *thread;  // threaded code for the code segment; NULL until the threaded engine runs
+    dword table_end; // one past the highest address with an entry in either table
+
+    byte *predecoded;       // instructions decoded by the assembler, as object file records, for the next run; NULL if none
+    dword predecoded_count; // the number of pre-decoded instructions
+
+    unsigned long long retired; // the instructions executed since the program was loaded
+    Profile *profile;           // the opcode profile; NULL if the machine does not profile
+
+    jmp_buf fault;   // where a machine fault unwinds to
+    char error[256]; // the message of the last fault
+};
+
+// A snapshot holds the memory and registers of a machine at one point in time.
+// Machines started from a snapshot share its memory copy-on-write where the
+// host allows it, and copy it otherwise.
+
+struct VmSnapshot {
+    Vm state;  // registers, flags and settings; the memory and tables are left out
+    int fd;    // memfd holding the memory; -1 if the memory is in `mem'
+    byte *mem; // a copy of the memory; NULL if the memory is in `fd'
+};
 
 //==============================================================================
 // CPU FSM
@@ -80,11 +373,13 @@ static char mem[MEMORY_SIZE];
 
 typedef enum CpuState {
     // instructions
-    I_NOP = OC_NOP,
+#define X(name, operand, operation) I_##name = OC_##name,
+    INSTRUCTION_SET(X)
+#undef X
     I_HALT = OC_HALT,
 
     // CPU fetch-decode-execute sequence
-    S_INIT,
+    S_INIT = 0x100, // states follow the 8-bit opcode range
     S_FETCH,
     S_DECODE,
     S_COUNTER_INCREMENT,
@@ -99,71 +394,436 @@ typedef enum CpuState {
 
 // Prototypes
 
-static int run();
-static void mem_writeb(dword, byte);
-static byte mem_readb(dword);
-static void mem_writew(dword, word);
-static word mem_readw(dword);
-static void mem_writed(dword, dword);
-static dword mem_readd(dword);
-/*
-static void es_pushb();
-static byte es_pullb();
-static es_pushw();
-static es_pullw();
-static es_pushd();
-static es_pulld();
-static toes_setb(byte);
-static byte toes_getb();
-static toes_setw(word);
-static word toes_getw();
-static toes_setd(dword);
-static dword toes_getd();*/
-
-// Status flags
-
-static bool sz; // zero flag
-static bool sn; // negative flag
-static bool sv; // overflow flag
-static bool sc; // carry flag
-
-// Internal registers
-
-static dword pc;  // program counter
-static dword cir; // current instruction register
-static dword mar; // memory address register - stores the address for a memory operation
-static dword mdr; // memory data register - stores the data for a memory operation
-static dword ep;  // expression stack pointer
-static dword cp;  // call stack pointer`
-static dword fp;  // frame pointer
-static dword t0;  // temporary register 0
-static dword t1;  // temporary register 1
-static dword t2;  // temporary register 2
-
-//==============================================================================
-// Entry point
-//==============================================================================
-
-void execute(File *file)
+#if defined(__GNUC__)
+#define VM_NORETURN __attribute__((noreturn))
+#define VM_INLINE inline __attribute__((always_inline))
+#else
+#define VM_NORETURN
+#define VM_INLINE inline
+#endif
+
+static void vm_fail(Vm *, const char *, ...) VM_NORETURN;
+static void unload(Vm *);
+static void reset(Vm *);
+static void mem_alloc(Vm *);
+static void mem_release(Vm *);
+static void mem_map(Vm *, VmSnapshot *);
+static bool mem_map_file(Vm *, File *, long int, dword, long int);
+static int load_image(Vm *, File *);
+static int load_object(Vm *, File *, Object *);
+static bool load_section(Vm *, File *, Section *);
+static bool load_decoded(Vm *, File *, Section *);
+static bool check_decoded(Vm *, unsigned long);
+static int run(Vm *);
+static int run_profiled(Vm *);
+static VM_INLINE int run_switch(Vm *, Profile *);
+static int run_threaded(Vm *);
+static void profile_count(Profile *, byte);
+static void profile_write(Profile *);
+static bool is_conditional(byte);
+static void tables_prepare(Vm *);
+static void decode(Vm *, dword, Insn *);
+static dword fetch_operand(Vm *, Insn *);
+static void code_invalidate(Vm *, dword, dword);
+static void fuse(Vm *, const Fusion *, int);
+static bool is_transfer(byte);
+static bool is_sequence_end(byte);
+static int opcode_lookup(const char *);
+static int sequence_compare(const void *, const void *);
+static void mem_writeb(Vm *, dword, byte);
+static byte mem_readb(Vm *, dword);
+static void mem_writew(Vm *, dword, word);
+static word mem_readw(Vm *, dword);
+static void mem_writed(Vm *, dword, dword);
+static dword mem_readd(Vm *, dword);
+static void mem_write(Vm *, dword, dword, dword);
+static dword mem_read(Vm *, dword, dword);
+static void mem_store(Vm *, dword, dword, dword);
+static dword mem_load(Vm *, dword, dword);
+static void es_push(Vm *, dword, dword);
+static dword es_pull(Vm *, dword);
+static dword es_read(Vm *, dword, dword);
+static void es_write(Vm *, dword, dword, dword);
+static void es_roll(Vm *, dword, dword);
+static void es_rollc(Vm *, dword, dword);
+static void es_alu(Vm *, AluOp, dword);
+static void es_not(Vm *, dword);
+static void es_spill(Vm *);
+static dword size_mask(dword);
+static void cs_push(Vm *, dword);
+static dword cs_pull(Vm *);
+static void cs_drop(Vm *, dword);
+static dword alu(Vm *, AluOp, dword, dword, dword);
+static void set_flags(Vm *, dword, dword);
+
+// Externally exposed
+
+int vm_engine = VM_ENGINE_SWITCH; // the execution engine of new machines
+bool vm_stack_caching = false;    // keeps TOES and SOES out of memory in new machines if TRUE
+char *vm_profile = NULL;          // the file new machines write an opcode profile to; NULL if they do not profile
+
+//==============================================================================
+// Machine lifecycle
+//==============================================================================
+
+/**
+ * Creates a machine. The machine uses the engine and stack caching selected
+ * by vm_engine and vm_stack_caching at the time it is created. If vm_profile
+ * names a file, the machine profiles the opcodes it executes instead, on the
+ * switch engine, and writes the profile there when it halts.
+ */
+Vm *vm_create()
 {
-    long int filesize;
-    size_t bytes_read;
+    Vm *vm;
+
+    vm = (Vm*)emalloc(sizeof(*vm));
+    memset(vm, 0, sizeof(*vm));
+    mem_alloc(vm);
+    vm->engine = vm_engine;
+    vm->stack_caching = vm_stack_caching;
+    if (vm_profile != NULL) {
+        vm->profile = (Profile*)emalloc(sizeof(*vm->profile));
+        vm->profile->name = vm_profile;
+        vm->engine = VM_ENGINE_SWITCH;
+    }
+    reset(vm);
+    return vm;
+}
 
-    filesize = file_size(file);
-    if (filesize > CODE_SEGMENT_SIZE) {
-        fail("Object file size (%dB) exceeds VM memory size of %dB", filesize, MEMORY_SIZE);
+/**
+ * Loads an object file into the memory of a machine and puts the machine in
+ * its initial state, with the PC at the entry point. A file without an object
+ * header is loaded as a raw image of the code segment. Memory left over from
+ * an earlier program is cleared first. The file stays open.
+ *
+ * Returns VM_OK, or VM_FAULT if the file cannot be loaded
+ */
+int vm_load(Vm *vm, File *file)
+{
+    Object object;
+    int status;
+
+    unload(vm);
+    status = object_read(file, &object);
+    if (status == OBJECT_RAW) {
+        return load_image(vm, file);
+    }
+    if (status == OBJECT_INVALID) {
+        snprintf(vm->error, sizeof(vm->error), "Malformed object file header");
+        return VM_FAULT;
+    }
+    return load_object(vm, file, &object);
+}
+
+/**
+ * Loads machine code from memory into the code segment of a machine and puts
+ * the machine in its initial state, with the PC at the given entry point.
+ * This is how a program compiled in the same process gets to run without
+ * going through a file.
+ *
+ * Returns VM_OK, or VM_FAULT if the code cannot be loaded
+ */
+int vm_load_code(Vm *vm, const unsigned char *code, long int size, unsigned long entry)
+{
+    unload(vm);
+    if (size > CODE_SEGMENT_SIZE) {
+        snprintf(vm->error, sizeof(vm->error), "Machine code size (%ldB) exceeds VM code segment size of %dB", size, CODE_SEGMENT_SIZE);
+        return VM_FAULT;
+    }
+    if (entry > CODE_SEGMENT_END) {
+        snprintf(vm->error, sizeof(vm->error), "Entry point (%06lx) lies outside the code segment", entry);
+        return VM_FAULT;
+    }
+    memcpy(vm->mem + CODE_SEGMENT_START, code, size);
+    vm->clean = false;
+    vm->code_size = size;
+    vm->pc = entry;
+    return VM_OK;
+}
+
+/**
+ * Runs the machine from its current state until it halts or faults. After a
+ * halt the PC points past the HALT, so running the machine again resumes the
+ * program there.
+ *
+ * Returns VM_OK, or VM_FAULT if the machine faulted. vm_error() tells why.
+ */
+int vm_run(Vm *vm)
+{
+    vm->clean = false;
+    if (setjmp(vm->fault) != 0) {
+        return VM_FAULT;
+    }
+
+    tables_prepare(vm);
+    if (vm->profile != NULL) {
+        run_profiled(vm);
+    }
+    else if (vm->engine == VM_ENGINE_THREADED) {
+        run_threaded(vm);
+    }
+    else {
+        run(vm);
+    }
+    return VM_OK;
+}
+
+/**
+ * Returns the number of instructions a machine executed since its program was
+ * loaded, the HALT included
+ */
+unsigned long long vm_retired(Vm *vm)
+{
+    return vm->retired;
+}
+
+/**
+ * Returns the message of the last fault of a machine
+ */
+const char *vm_error(Vm *vm)
+{
+    return vm->error;
+}
+
+void vm_destroy(Vm *vm)
+{
+    free(vm->predecoded);
+    free(vm->decoded);
+    free(vm->thread);
+    free(vm->profile);
+    mem_release(vm);
+    free(vm);
+}
+
+/**
+ * Takes a snapshot of the memory and registers of a machine. The machine is
+ * left as it was.
+ */
+VmSnapshot *vm_snapshot(Vm *vm)
+{
+    VmSnapshot *snapshot;
+#if defined(VM_MMAP)
+    long int page;   // the host page size
+    long int offset; // the offset of a page in memory
+#endif
+
+    snapshot = (VmSnapshot*)emalloc(sizeof(*snapshot));
+    snapshot->state = *vm;
+    snapshot->state.mem = NULL;
+    snapshot->state.mapped = false;
+    snapshot->state.decoded = NULL;
+    snapshot->state.thread = NULL;
+    snapshot->state.table_end = 0;
+    snapshot->state.predecoded = NULL;
+    snapshot->state.predecoded_count = 0;
+    snapshot->state.profile = NULL;
+    snapshot->fd = -1;
+    snapshot->mem = NULL;
+
+#if defined(VM_MMAP)
+    // write the pages that are not all zeroes to a memfd. The rest of the
+    // file reads as zeroes.
+    page = sysconf(_SC_PAGESIZE);
+    if (page > 0 && MEMORY_ALLOC_SIZE % page == 0) {
+        snapshot->fd = memfd_create("particle-vm", MFD_CLOEXEC);
+    }
+    if (snapshot->fd >= 0 && ftruncate(snapshot->fd, MEMORY_ALLOC_SIZE) == 0) {
+        for (offset = 0; offset < MEMORY_ALLOC_SIZE; offset += page) {
+            // a page is all zeroes if its first byte is zero and every byte
+            // equals the one after it
+            if (vm->mem[offset] == 0 && memcmp(&vm->mem[offset], &vm->mem[offset + 1], page - 1) == 0) {
+                continue;
+            }
+            if (pwrite(snapshot->fd, &vm->mem[offset], page, offset) != page) {
+                break;
+            }
+        }
+        if (offset >= MEMORY_ALLOC_SIZE) {
+            return snapshot;
+        }
+    }
+    // no memfd; fall back to a copy
+    if (snapshot->fd >= 0) {
+        close(snapshot->fd);
+        snapshot->fd = -1;
+    }
+#endif
+
+    snapshot->mem = (byte*)emalloc(MEMORY_ALLOC_SIZE);
+    memcpy(snapshot->mem, vm->mem, MEMORY_ALLOC_SIZE);
+    return snapshot;
+}
+
+/**
+ * Creates a machine in the state of a snapshot
+ */
+Vm *vm_fork(VmSnapshot *snapshot)
+{
+    Vm *vm;
+
+    vm = (Vm*)emalloc(sizeof(*vm));
+    memset(vm, 0, sizeof(*vm));
+    vm_restore(vm, snapshot);
+    return vm;
+}
+
+/**
+ * Puts a machine back in the state of a snapshot. Whatever the machine held
+ * before is dropped, but its tables and profile are kept for reuse.
+ */
+void vm_restore(Vm *vm, VmSnapshot *snapshot)
+{
+    Insn *decoded;
+    Thread *thread;
+    dword table_end;
+    Profile *profile;
+
+    decoded = vm->decoded;
+    thread = vm->thread;
+    table_end = vm->table_end;
+    profile = vm->profile;
+    free(vm->predecoded);
+    mem_release(vm);
+
+    *vm = snapshot->state;
+    vm->decoded = decoded;
+    vm->thread = thread;
+    vm->table_end = table_end;
+    vm->profile = profile;
+    mem_map(vm, snapshot);
+}
+
+void vm_snapshot_destroy(VmSnapshot *snapshot)
+{
+#if defined(VM_MMAP)
+    if (snapshot->fd >= 0) {
+        close(snapshot->fd);
     }
+#endif
+    free(snapshot->mem);
+    free(snapshot);
+}
+
+/**
+ * Runs an object file on a machine of its own and closes the file. A fault
+ * ends the process.
+ *
+ * Returns the number of instructions executed
+ */
+unsigned long long execute(File *file)
+{
+    Vm *vm;
+    unsigned long long retired;
 
-    bytes_read = fread((char*)mem, 1, filesize, file->handle);
-    if (bytes_read != filesize) {
-        fail("Unable to read entire file. Read %d bytes of file containing %d bytes", bytes_read, filesize);
+    vm = vm_create();
+    if (vm_load(vm, file) != VM_OK) {
+        fail("%s", vm_error(vm));
     }
     file_close(file);
+    if (vm_run(vm) != VM_OK) {
+        fail("%s", vm_error(vm));
+    }
+    retired = vm->retired;
+    vm_destroy(vm);
+    return retired;
+}
+
+/**
+ * Runs machine code from memory on a machine of its own. A fault ends the
+ * process.
+ *
+ * Returns the number of instructions executed
+ */
+unsigned long long execute_code(const unsigned char *code, long int size, unsigned long entry)
+{
+    Vm *vm;
+    unsigned long long retired;
+
+    vm = vm_create();
+    if (vm_load_code(vm, code, size, entry) != VM_OK || vm_run(vm) != VM_OK) {
+        fail("%s", vm_error(vm));
+    }
+    retired = vm->retired;
+    vm_destroy(vm);
+    return retired;
+}
+
+/**
+ * Stops a running machine with a fault. The message is kept for vm_error().
+ */
+static void vm_fail(Vm *vm, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(vm->error, sizeof(vm->error), format, args);
+    va_end(args);
+    longjmp(vm->fault, 1);
+}
+
+// Clear a machine of its program, so that another can be loaded, and put it in
+// its initial state
+
+static void unload(Vm *vm)
+{
+    // fresh memory is cheaper than clearing the old one
+    if (!vm->clean) {
+        mem_release(vm);
+        mem_alloc(vm);
+    }
+    reset(vm);
+    free(vm->predecoded);
+    vm->predecoded = NULL;
+    vm->predecoded_count = 0;
+}
+
+// Put the machine in its initial state
+
+static void reset(Vm *vm)
+{
+    vm->pc  = CODE_SEGMENT_START;
+    vm->sz  = false;
+    vm->sn  = false;
+    vm->sv  = false;
+    vm->sc  = false;
+    vm->t0  = 0;
+    vm->t1  = 0;
+    vm->t2  = 0;
+    vm->cir = 0;
+    vm->mar = 0x000000;
+    vm->mdr = 0;
+    vm->ep  = EXPR_STACK_SEGMENT_END;
+    vm->cp  = CALL_STACK_SEGMENT_END;
+    vm->fp  = 0x000000;
+    vm->stack_cached = 0;
+    vm->retired = 0;
+    if (vm->profile != NULL) {
+        memset(vm->profile->counts, 0, sizeof(vm->profile->counts));
+        memset(vm->profile->pairs, 0, sizeof(vm->profile->pairs));
+        memset(vm->profile->taken, 0, sizeof(vm->profile->taken));
+        vm->profile->last = -1;
+    }
+}
+
+//==============================================================================
+// Switch engine
+//==============================================================================
+
+// The switch engine comes in two builds: a plain one, and one that profiles
+// the opcodes it executes. The profile is a constant NULL in the plain build,
+// so the profiling code drops out of it and it pays nothing.
+
+static int run(Vm *vm)
+{
+    return run_switch(vm, NULL);
+}
 
-    run();
+static int run_profiled(Vm *vm)
+{
+    return run_switch(vm, vm->profile);
 }
 
-static int run()
+static VM_INLINE int run_switch(Vm *vm, Profile *profile)
 {
     CpuState next_state;
     CpuState current_state;
@@ -172,6 +832,9 @@ static int run()
     uint32 opcode_class = 0; // stores opcode class
     uint32 oprsize_class = 0; // stores operand size class
     uint32 addrmode_class = 0; // stores addressing mode class
+    dword addr = 0; // stores the address of the instruction being run
+    dword next = 0; // stores the address of the instruction after the one being executed
+    Insn *insn; // points to the cached decoding of the instruction at the PC
 
     done = false;
     next_state = S_INIT;
@@ -182,30 +845,31 @@ static int run()
             // Fetch-Decode sequence
 
             case S_INIT:
-                // the init state initializes the machine
-                pc  = CODE_SEGMENT_START;
-                sz  = false;
-                sn  = false;
-                sv  = false;
-                sc  = false;
-                t0  = 0;
-                t1  = 0;
-                t2  = 0;
-                cir = 0;
-                mar = 0x000000;
-                mdr = 0;
-                ep  = EXPR_STACK_SEGMENT_END;
-                cp  = CODE_SEGMENT_END;
-                fp  = 0x000000;
+                // the init state starts the machine where it stands. The
+                // machine was put in its initial state when it was loaded.
                 next_state = S_FETCH;
                 break;
 
             case S_FETCH:
                 // the fetch state retrieves the next instruction from memory
                 // The PC always points to the next instruction.
+                vm->retired++;
+
+                // if the instruction was decoded before then skip the
+                // decode sequence and go straight to the operation
+                if (vm->pc <= CODE_SEGMENT_END && vm->decoded[vm->pc].next != 0) {
+                    addr = vm->pc;
+                    insn = &vm->decoded[addr];
+                    opcode_class = insn->opcode;
+                    vm->pc = insn->next;
+                    vm->mdr = fetch_operand(vm, insn);
+                    next_state = opcode_class;
+                    break;
+                }
 
                 // get instruction and store it in the CIR
-                cir = mem_readw(pc);
+                addr = vm->pc;
+                vm->cir = mem_readw(vm, vm->pc);
                 next_state = S_COUNTER_INCREMENT;
                 break;
 
@@ -213,7 +877,7 @@ static int run()
                 // the counter-increment state increments the PC too the next instruction
 
                 // go to next instruction. all instructions are a word wide
-                pc += WORD;
+                vm->pc += WORD;
                 next_state = S_DECODE;
                 break;
 
@@ -225,13 +889,13 @@ static int run()
                 // decoding. We let each instruction handle its own decoding
 
                 // get opcode from the CIR
-                opcode_class = cir & OPCODE_CLASS_MASK;
+                opcode_class = vm->cir & OPCODE_CLASS_MASK;
                 opcode_class >>= OPCODE_CLASS_NORMALIZER;
 
                 // the operand size determines whether an instruction has an
                 // operand or not. So first we check the operand size to see if
                 // the instruction has an operand.
-                oprsize_class = cir & OPERAND_SIZE_CLASS_MASK;
+                oprsize_class = vm->cir & OPERAND_SIZE_CLASS_MASK;
                 oprsize_class >>= OPERAND_SIZE_CLASS_NORMALIZER;
 
                 // the addressing mode tells us how to retrieve the operand
@@ -241,7 +905,10 @@ static int run()
                 // addressing mode is 'direct' then it means that the
                 // immediate field stores the address of where the operand
                 // is located in memory
-                addrmode_class = cir & ADDRESSING_MODE_CLASS_MASK;
+                addrmode_class = vm->cir & ADDRESSING_MODE_CLASS_MASK;
+
+                // instructions without an operand see a zero operand
+                vm->mdr = 0;
 
                 // if this instruction supports operands then lets retrieve the operand
                 if (oprsize_class != 0) {
@@ -249,416 +916,1518 @@ static int run()
                     if (addrmode_class == 0) {
                         // if operand is byte then
                         if (oprsize_class == OPERAND_SIZE_BYTE) {
-                            mdr = mem_readb(pc); // get byte operand from immediate field
-                            pc += BYTE; // goto next instruction
+                            vm->mdr = mem_readb(vm, vm->pc); // get byte operand from immediate field
+                            vm->pc += BYTE; // goto next instruction
                         }
                         // if operand is word then
                         if (oprsize_class == OPERAND_SIZE_WORD) {
-                            mdr = mem_readw(pc); // get word operand from immediate field
-                            pc += WORD; // goto next instruction
+                            vm->mdr = mem_readw(vm, vm->pc); // get word operand from immediate field
+                            vm->pc += WORD; // goto next instruction
                         }
                         // if operand is dword then
                         if (oprsize_class == OPERAND_SIZE_DWORD) {
-                            mdr = mem_readd(pc); // get dword operand from immediate field
-                            pc += DWORD; // goto next instruction
+                            vm->mdr = mem_readd(vm, vm->pc); // get dword operand from immediate field
+                            vm->pc += DWORD; // goto next instruction
                         }
                     }
                     // handle direct addressing
                     else {
                         // if operand is byte then
                         if (oprsize_class == OPERAND_SIZE_BYTE) {
-                            mar = mem_readd(pc); // we need the address of operand
-                            mdr = mem_readb(mar); // we need the byte operand to pass to the operation
-                            pc += DWORD; // advance the PC by a dword because the immediate feild stores a dword-sized address
+                            vm->mar = mem_readd(vm, vm->pc); // we need the address of operand
+                            vm->mdr = mem_load(vm, BYTE, vm->mar); // we need the byte operand to pass to the operation
+                            vm->pc += DWORD; // advance the PC by a dword because the immediate feild stores a dword-sized address
                         }
                         // if operand is word then
                         if (oprsize_class == OPERAND_SIZE_WORD) {
-                            mar = mem_readd(pc);
-                            mdr = mem_readw(mar);
-                            pc += DWORD;
+                            vm->mar = mem_readd(vm, vm->pc);
+                            vm->mdr = mem_load(vm, WORD, vm->mar);
+                            vm->pc += DWORD;
                         }
                         // if operand is dword then
                         if (oprsize_class == OPERAND_SIZE_DWORD) {
-                            mar = mem_readd(pc);
-                            mdr = mem_readd(mar);
-                            pc += DWORD;
+                            vm->mar = mem_readd(vm, vm->pc);
+                            vm->mdr = mem_load(vm, DWORD, vm->mar);
+                            vm->pc += DWORD;
                         }
                     }
                 }
 
+                // remember the decoded instruction for the next time the PC
+                // reaches it
+                if (addr <= CODE_SEGMENT_END) {
+                    if (addr >= vm->table_end) {
+                        vm->table_end = addr + 1;
+                    }
+                    insn = &vm->decoded[addr];
+                    insn->opcode = opcode_class;
+                    insn->oprsize = oprsize_class;
+                    insn->addrmode = addrmode_class;
+                    insn->imm = addrmode_class == ADDRESSING_MODE_DIRECT ? vm->mar : vm->mdr;
+                    insn->next = vm->pc;
+                }
+
                 // go execute the operation
                 next_state = opcode_class;
                 break;
 
-            // Expression stack instructions
-            /*
-            case I_PUSHB:
-                es_pushb(mdr);
-                break;
-
-            case I_PUSHW:
-                break;
-
-            case I_PUSHD:
-                break;
-
-            case I_POPB:
-                break;
-
-            case I_POPW:
-                break;
-
-            case I_POPD:
-                break;
-
-            case I_DUPB:
-                break;
-
-            case I_DUPW:
-                break;
-
-            case I_DUPD:
-                break;
-
-            case I_OVERB:
-                break;
-
-            case I_OVERW:
-                break;
-
-            case I_OVERD:
-                break;
-
-            case I_SWAPB:
-                break;
-
-            case I_SWAPW:
-                break;
-
-            case I_SWAPD:
-                break;
-
-            case I_ROLLB:
-                break;
-
-            case I_ROTCB:
-                break;
-
-            case I_PUSHEP:
-                break;
-                break;
-
-            case I_PULLEP:
-                break;
-
-            case I_PUSHCP:
-                break;
-
-            case I_PULLCP:
-                break;
-
-            case I_PUSHFP:
-                break;
-
-            case I_PULLFP:
-                break;
-
-            // Memory instruction
-
-            case I_LODB:
-                break;
-                break;
-
-            case I_LODW:
-                break;
-                break;
-
-            case I_LODD:
-                break;
-                break;
-
-            case I_PULLB:
-                break;
-                break;
-
-            case I_PULLW:
-                break;
-                break;
-
-            case I_PULLD:
-                break;
-
-            case I_PEEKB:
-                break;
-                break;
-
-            case I_PEEKW:
-                break;
-                break;
-
-            case I_PEEKD:
-                break;
-
-            // Jump instructions
-
-            case I_JMP:
-                break;
-
-            case I_JZ:
-                break;
-
-            case I_JNZ:
-                break;
-
-            case I_JE:
-                break;
-
-            case I_JNE:
-                break;
-
-            case I_CALL:
-                break;
-
-            case I_RET:
-                break;
-                */
-
-            case I_NOP:
-                printf("\n\nIF YOU SEE THIS THEN THE VM IS WORK\n\n");
+            // Instructions
+
+#define X(name, operand, operation) \
+            case I_##name: \
+                if (profile != NULL) { \
+                    profile_count(profile, OC_##name); \
+                    next = vm->pc; \
+                } \
+                operation; \
+                if (profile != NULL && is_conditional(OC_##name) && vm->pc != next) { \
+                    profile->taken[OC_##name]++; \
+                } \
+                next_state = S_FETCH; \
                 break;
+            INSTRUCTION_SET(X)
+#undef X
 
             case I_HALT:
+                es_spill(vm);
+                if (profile != NULL) {
+                    profile_count(profile, OC_HALT);
+                    profile_write(profile);
+                }
                 done = true;
                 break;
 
             case E_UNKNOWN_INSTRUCTION:
-                error("vm: unknown instruction (%x)", cir);
+            default:
+                vm_fail(vm, "vm: unknown instruction (%x)", mem_readw(vm, addr));
                 break;
         }
     }
+    return 0;
 }
 
 //==============================================================================
-// Memory operations
+// Threaded engine
 //==============================================================================
 
-/**
- * Writes a byte of data to memory
- *
- * byte  data: The data to write
- * dword addr: The address to write to
- *
- * Returns nothing
- */
-static void mem_writeb(dword addr, byte data)
-{
-    if (addr > MEMORY_MAX_ADDRESS) {
-        fail("Overflow on memory");
-    }
-    else if (addr < MEMORY_MIN_ADDRESS) {
-        fail("Underflow on memory");
-    }
+// The threaded engine uses computed gotos (a GNU C extension) so that each
+// instruction costs a single indirect jump to its handler. Handlers are
+// expanded from the same instruction set as the switch engine.
 
-    // write the byte to memory
-    mem[addr] = data;
-}
+#if defined(__GNUC__)
 
-/**
- * Reads a byte of data from memory and returns it
- */
-static byte mem_readb(dword addr)
+// Executes the operation of the given opcode. Handlers call this with a
+// constant opcode, so the compiler reduces it to that single operation.
+static inline __attribute__((always_inline)) void operate(Vm *vm, byte opcode, Insn *insn)
 {
-    if (addr > MEMORY_MAX_ADDRESS) {
-        fail("Overflow on memory");
+    switch (opcode) {
+#define X(name, operand, operation) \
+        case OC_##name: \
+            if (operand) { \
+                vm->mdr = fetch_operand(vm, insn); \
+            } \
+            operation; \
+            break;
+        INSTRUCTION_SET(X)
+#undef X
     }
-    else if (addr < MEMORY_MIN_ADDRESS) {
-        fail("Underflow on memory");
-    }
-
-    // read the byte from memory
-    return mem[addr];
 }
 
-static void mem_writew(dword addr, word data)
+// Executes one instruction of a fused sequence and steps to the next one
+#define STEP(name) \
+    vm->retired++; \
+    vm->pc = ip->insn.next; \
+    operate(vm, OC_##name, &ip->insn); \
+    ip = &vm->thread[vm->pc]
+
+// Dispatch to the handler for the instruction at the PC. Instructions are
+// translated on first use if the load-time translation did not reach them.
+// Instructions outside the code segment have no table entries; they are
+// decoded each time they run, as the switch engine does.
+#define DISPATCH() \
+    do { \
+        if (vm->pc > CODE_SEGMENT_END) { \
+            goto outside; \
+        } \
+        ip = &vm->thread[vm->pc]; \
+        goto *(ip->handler != NULL ? ip->handler : &&translate); \
+    } while (0)
+
+static int run_threaded(Vm *vm)
 {
-    if (addr > MEMORY_MAX_ADDRESS) {
-        fail("Overflow on memory");
-    }
-    else if (addr < MEMORY_MIN_ADDRESS) {
-        fail("Underflow on memory");
+    static const void *handlers[256] = {
+#define X(name, operand, operation) [OC_##name] = &&L_##name,
+        INSTRUCTION_SET(X)
+#undef X
+        [OC_HALT] = &&L_HALT
+    };
+    static const Fusion fusions[] = {
+#define F2(a, b) { { OC_##a, OC_##b }, 2, &&L_##a##_##b },
+#define F3(a, b, c) { { OC_##a, OC_##b, OC_##c }, 3, &&L_##a##_##b##_##c },
+        FUSION_SET(F2, F3)
+#undef F2
+#undef F3
+    };
+    Thread *ip;   // the instruction being executed
+    Insn insn;    // the decoding of an instruction outside the code segment
+    dword addr;
+
+    // translate the loaded program up front. Instructions that came
+    // pre-decoded only need their handlers.
+    for (addr = CODE_SEGMENT_START; addr < vm->code_size; addr = vm->thread[addr].insn.next) {
+        if (addr >= vm->table_end) {
+            vm->table_end = addr + 1;
+        }
+        if (vm->thread[addr].insn.next == 0) {
+            decode(vm, addr, &vm->thread[addr].insn);
+        }
+        vm->thread[addr].handler = handlers[vm->thread[addr].insn.opcode];
+        if (vm->thread[addr].handler == NULL) {
+            vm->thread[addr].handler = &&L_UNKNOWN;
+        }
     }
+    fuse(vm, fusions, sizeof(fusions) / sizeof(fusions[0]));
 
-    // some vars
-    byte hb; // stores low-order byte
-    byte lb; // stores high-order byte
+    DISPATCH();
 
-    // get the individual bytes from the given data
-    hb = data & 0xf0; // extract high-order byte
-    lb = data & 0x0f; // extract low-order byte
-
-    // write the bytes to memory in big endian
-    mem[addr]   = hb;
-    mem[addr+1] = lb;
-}
+translate:
+    // translate the instruction at the PC and go execute it
+    if (vm->pc >= vm->table_end) {
+        vm->table_end = vm->pc + 1;
+    }
+    decode(vm, vm->pc, &ip->insn);
+    ip->handler = handlers[ip->insn.opcode];
+    if (ip->handler == NULL) {
+        ip->handler = &&L_UNKNOWN;
+    }
+    goto *ip->handler;
 
-static word mem_readw(dword addr)
-{
-    if (addr > MEMORY_MAX_ADDRESS) {
-        fail("Overflow on memory");
+outside:
+    // decode and execute the instruction at the PC without translating it
+    decode(vm, vm->pc, &insn);
+    if (insn.opcode != OC_HALT && handlers[insn.opcode] == NULL) {
+        goto L_UNKNOWN;
     }
-    else if (addr < MEMORY_MIN_ADDRESS) {
-        fail("Underflow on memory");
+    vm->retired++;
+    vm->pc = insn.next;
+    if (insn.opcode == OC_HALT) {
+        es_spill(vm);
+        return 0;
     }
+    operate(vm, insn.opcode, &insn);
+    DISPATCH();
+
+    // Instructions
+
+#define X(name, operand, operation) \
+L_##name: \
+    vm->retired++; \
+    vm->pc = ip->insn.next; \
+    operate(vm, OC_##name, &ip->insn); \
+    DISPATCH();
+    INSTRUCTION_SET(X)
+#undef X
+
+    // Superinstructions
+
+#define F2(a, b) \
+L_##a##_##b: \
+    STEP(a); \
+    vm->retired++; \
+    vm->pc = ip->insn.next; \
+    operate(vm, OC_##b, &ip->insn); \
+    DISPATCH();
+#define F3(a, b, c) \
+L_##a##_##b##_##c: \
+    STEP(a); \
+    STEP(b); \
+    vm->retired++; \
+    vm->pc = ip->insn.next; \
+    operate(vm, OC_##c, &ip->insn); \
+    DISPATCH();
+    FUSION_SET(F2, F3)
+#undef F2
+#undef F3
+
+L_HALT:
+    vm->retired++;
+    vm->pc = ip->insn.next;
+    es_spill(vm);
+    return 0;
+
+L_UNKNOWN:
+    vm_fail(vm, "vm: unknown instruction (%x)", mem_readw(vm, vm->pc));
+    return 1;
+}
 
-    // some vars
-    word hb;   // stores low-order byte
-    word lb;   // stores high-order byte
-    word data; // the data to return
+#undef DISPATCH
+#undef STEP
 
-    // initialize the vars
-    hb = lb = 0;
+#else
 
-    // read the data memory as big endian
-    hb = (word)mem[addr];
-    lb = (word)mem[addr+1];
+static int run_threaded(Vm *vm)
+{
+    vm_fail(vm, "vm: the threaded engine requires a GNU C compiler");
+    return 1;
+}
 
-    // shift the bytes for bitwise joining
-    hb = hb << 8; // move the high-order byte into the high-order-byte position.
+#endif
 
-    // join the bytes into a word
-    data = hb | lb;
+//==============================================================================
+// Instruction decoding
+//==============================================================================
 
-    // return it
-    return data;
+/**
+ * Readies the decoded or threaded code table of the machine's engine for a
+ * run. A table is allocated on first use and kept for later runs, so only the
+ * entries that earlier runs filled in have to be cleared. Pre-decoded
+ * instructions go into the table; they describe the program as it was
+ * loaded, so only the first run gets them.
+ */
+static void tables_prepare(Vm *vm)
+{
+    const byte *record;
+    Insn *insn;
+    dword addr;
+    dword i;
+
+    if (vm->engine == VM_ENGINE_THREADED) {
+        if (vm->thread == NULL) {
+            vm->thread = (Thread*)calloc(CODE_SEGMENT_SIZE, sizeof(*vm->thread));
+            if (vm->thread == NULL) {
+                vm_fail(vm, "Unable to allocate memory");
+            }
+        }
+        else {
+            memset(vm->thread, 0, vm->table_end * sizeof(*vm->thread));
+        }
+    }
+    else {
+        if (vm->decoded == NULL) {
+            vm->decoded = (Insn*)calloc(CODE_SEGMENT_SIZE, sizeof(*vm->decoded));
+            if (vm->decoded == NULL) {
+                vm_fail(vm, "Unable to allocate memory");
+            }
+        }
+        else {
+            memset(vm->decoded, 0, vm->table_end * sizeof(*vm->decoded));
+        }
+    }
+    vm->table_end = 0;
+
+    for (i = 0; i < vm->predecoded_count; i++) {
+        record = vm->predecoded + i * OBJECT_DECODED_SIZE;
+        addr = object_get(record, 4);
+        if (addr > CODE_SEGMENT_END) {
+            continue;
+        }
+        insn = vm->engine == VM_ENGINE_THREADED ? &vm->thread[addr].insn : &vm->decoded[addr];
+        insn->opcode = record[4];
+        insn->oprsize = record[5];
+        insn->addrmode = record[6];
+        insn->imm = object_get(record + 8, 4);
+        insn->next = object_get(record + 12, 4);
+        if (addr >= vm->table_end) {
+            vm->table_end = addr + 1;
+        }
+    }
+    free(vm->predecoded);
+    vm->predecoded = NULL;
+    vm->predecoded_count = 0;
 }
 
-static void mem_writed(dword addr, dword data)
+/**
+ * Decodes the instruction at the given address
+ *
+ * dword addr: The address of the instruction word
+ * Insn *insn: Receives the decoded instruction
+ *
+ * Returns nothing
+ */
+static void decode(Vm *vm, dword addr, Insn *insn)
 {
-    if (addr > MEMORY_MAX_ADDRESS) {
-        fail("Overflow on memory");
+    dword iw; // instruction word
+
+    iw = mem_readw(vm, addr);
+    insn->opcode = (iw & OPCODE_CLASS_MASK) >> OPCODE_CLASS_NORMALIZER;
+    insn->oprsize = (iw & OPERAND_SIZE_CLASS_MASK) >> OPERAND_SIZE_CLASS_NORMALIZER;
+    insn->addrmode = iw & ADDRESSING_MODE_CLASS_MASK;
+    insn->imm = 0;
+    insn->next = addr + WORD;
+
+    if (insn->oprsize == 0) {
+        return;
+    }
+
+    // the immediate field stores a dword-sized address in direct addressing
+    if (insn->addrmode == ADDRESSING_MODE_DIRECT) {
+        insn->imm = mem_readd(vm, insn->next);
+        insn->next += DWORD;
+    }
+    else if (insn->oprsize == OPERAND_SIZE_BYTE) {
+        insn->imm = mem_readb(vm, insn->next);
+        insn->next += BYTE;
+    }
+    else if (insn->oprsize == OPERAND_SIZE_WORD) {
+        insn->imm = mem_readw(vm, insn->next);
+        insn->next += WORD;
     }
-    else if (addr < MEMORY_MIN_ADDRESS) {
-        fail("Underflow on memory");
+    else {
+        insn->imm = mem_readd(vm, insn->next);
+        insn->next += DWORD;
     }
+}
 
-    // some vars
-    byte hwhb; // stores high-order byte at the high-order word
-    byte hwlb; // stores low-order byte at the high-order word
-    byte lwhb; // stores high-order byte at the low-order word
-    byte lwlb; // stores low-order byte at the low-order word
+/**
+ * Returns the operand of a decoded instruction, reading it from memory if the
+ * instruction uses direct addressing
+ */
+static dword fetch_operand(Vm *vm, Insn *insn)
+{
+    if (insn->oprsize == 0) {
+        return 0;
+    }
+    if (insn->addrmode == ADDRESSING_MODE_IMMEDIATE) {
+        return insn->imm;
+    }
+    vm->mar = insn->imm;
+    switch (insn->oprsize) {
+        case OPERAND_SIZE_BYTE:
+            return mem_load(vm, BYTE, vm->mar);
+        case OPERAND_SIZE_WORD:
+            return mem_load(vm, WORD, vm->mar);
+        default:
+            return mem_load(vm, DWORD, vm->mar);
+    }
+}
 
-    // get individual bytes from the given data
-    hwhb = data & 0xf000; // extract high-order byte at high-order word
-    hwlb = data & 0x0f00; // extract low-order byte at high-order word
-    lwhb = data & 0x00f0; // extract high-order byte at low-order word
-    lwlb = data & 0x000f; // extract low-order byte at low-order word
+/**
+ * Forgets the decoding and translation of every instruction that overlaps
+ * the given address range, so that code written by the program is decoded
+ * again
+ */
+static void code_invalidate(Vm *vm, dword addr, dword size)
+{
+    dword first;
+    dword last;
 
-    // write the bytes to memory in big endian
-    mem[addr]   = hwhb;
-    mem[addr+1] = hwlb;
-    mem[addr+2] = lwhb;
-    mem[addr+3] = lwlb;
+    first = addr < TRANSLATION_MAX_SIZE ? CODE_SEGMENT_START : addr - (TRANSLATION_MAX_SIZE - 1);
+    if (first >= vm->table_end) {
+        return; // the range is past every decoded instruction, as data often is
+    }
+    last = addr + size - 1;
+    if (last >= vm->table_end) {
+        last = vm->table_end - 1;
+    }
+    for (; first <= last; first++) {
+        if (vm->decoded != NULL) {
+            vm->decoded[first].next = 0;
+        }
+        if (vm->thread != NULL) {
+            vm->thread[first].handler = NULL;
+        }
+    }
 }
 
-static dword mem_readd(dword addr)
+//==============================================================================
+// Superinstructions
+//==============================================================================
+
+/**
+ * Fuses the translated program. Each instruction that starts one of the given
+ * opcode sequences gets the handler of the longest such sequence.
+ *
+ * const Fusion *fusions: The fusion table
+ * int count:             The number of fusions in the table
+ *
+ * Returns nothing
+ */
+static void fuse(Vm *vm, const Fusion *fusions, int count)
 {
-    if (addr > MEMORY_MAX_ADDRESS) {
-        fail("Overflow on memory");
+    const Fusion *best; // the longest fusion that matches
+    dword addr;         // address of the first instruction of a sequence
+    dword next;         // address of an instruction in the sequence
+    int i;
+    int j;
+
+    for (addr = CODE_SEGMENT_START; addr < vm->code_size; addr = vm->thread[addr].insn.next) {
+        best = NULL;
+        for (i = 0; i < count; i++) {
+            next = addr;
+            for (j = 0; j < fusions[i].length; j++) {
+                if (next > CODE_SEGMENT_END || vm->thread[next].handler == NULL) {
+                    break;
+                }
+                if (vm->thread[next].insn.opcode != fusions[i].opcodes[j]) {
+                    break;
+                }
+                // only the last instruction may leave the sequence or
+                // write to memory
+                if (j < fusions[i].length - 1 && is_sequence_end(fusions[i].opcodes[j])) {
+                    break;
+                }
+                next = vm->thread[next].insn.next;
+            }
+            if (j == fusions[i].length && (best == NULL || best->length < fusions[i].length)) {
+                best = &fusions[i];
+            }
+        }
+        if (best != NULL) {
+            vm->thread[addr].handler = best->handler;
+        }
     }
-    else if (addr < MEMORY_MIN_ADDRESS) {
-        fail("Underflow on memory");
+}
+
+/**
+ * Generates a fusion table from an opcode profile and writes it to the
+ * standard output in the format of fusion.h
+ *
+ * The profile lists one opcode sequence per line: two or three opcode names
+ * followed by the number of times the sequence was executed. Lines that start
+ * with `#' are comments. Sequences that cannot be fused are left out, and only
+ * the most frequent sequences make it into the table.
+ *
+ * File *profile: The opcode profile
+ *
+ * Returns nothing
+ */
+void vm_fusion_generate(File *profile)
+{
+    char line[256];
+    char names[FUSION_MAX_LENGTH + 1][32]; // the fields on a line
+    Sequence *sequences;
+    int capacity;
+    int count;
+    int lineno;
+    int fields;
+    int opcode;
+    int i;
+    Sequence *s;
+
+    capacity = 64;
+    sequences = (Sequence*)emalloc(capacity * sizeof(*sequences));
+    count = 0;
+    lineno = 0;
+
+    while (fgets(line, sizeof(line), profile->handle) != NULL) {
+        lineno++;
+        if (line[0] == '#') {
+            continue;
+        }
+        fields = sscanf(line, "%31s %31s %31s %31s", names[0], names[1], names[2], names[3]);
+        // single opcodes are not sequences
+        if (fields < 3) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            sequences = (Sequence*)erealloc(sequences, capacity * sizeof(*sequences));
+        }
+        s = &sequences[count];
+        s->length = fields - 1;
+        s->count = strtoul(names[fields - 1], NULL, 10);
+        for (i = 0; i < s->length; i++) {
+            opcode = opcode_lookup(names[i]);
+            if (opcode < 0) {
+                fail("%s:%d: unknown opcode `%s'", profile->name, lineno, names[i]);
+            }
+            s->opcodes[i] = opcode;
+        }
+
+        // leave out sequences that cannot be fused
+        for (i = 0; i < s->length; i++) {
+            if (s->opcodes[i] == OC_HALT) {
+                break;
+            }
+            if (i < s->length - 1 && is_sequence_end(s->opcodes[i])) {
+                break;
+            }
+        }
+        if (i == s->length) {
+            count++;
+        }
     }
+    file_close(profile);
 
-    // some vars
-    dword hwhb; // stores high-order byte at the high-order word
-    dword hwlb; // stores low-order byte at the high-order word
-    dword lwhb; // stores high-order byte at the low-order word
-    dword lwlb; // stores low-order byte at the low-order word
-    dword data; // the data to return
+    qsort(sequences, count, sizeof(*sequences), sequence_compare);
+    if (count > FUSION_TABLE_SIZE) {
+        count = FUSION_TABLE_SIZE;
+    }
 
-    // initialize bytes
-    hwhb = hwlb = lwhb = lwlb = 0;
+    printf("#ifndef __PARTICLE_FUSION_H__\n");
+    printf("#define __PARTICLE_FUSION_H__\n\n");
+    printf("// Superinstructions generated from an opcode profile. See the built-in\n");
+    printf("// table for the format.\n\n");
+    printf("#define FUSION_SET(F2, F3)");
+    for (i = 0; i < count; i++) {
+        s = &sequences[i];
+        if (s->length == 2) {
+            printf(" \\\n    F2(%s, %s)", opcode_names[s->opcodes[0]], opcode_names[s->opcodes[1]]);
+        }
+        else {
+            printf(" \\\n    F3(%s, %s, %s)", opcode_names[s->opcodes[0]], opcode_names[s->opcodes[1]], opcode_names[s->opcodes[2]]);
+        }
+    }
+    printf("\n\n#endif /* __PARTICLE_FUSION_H__ */\n");
+    free(sequences);
+}
 
-    // read the bytes from memory in big endian
-    hwhb = (dword)mem[addr];   // get the high-order byte at the high-order word
-    hwlb = (dword)mem[addr+1]; // get the low-order byte at the high-order word
-    lwhb = (dword)mem[addr+2]; // get the high-order byte at the low-order word
-    lwlb = (dword)mem[addr+3]; // get the low-order byte at the low-order word
+//==============================================================================
+// Opcode profile
+//==============================================================================
 
-    // shift the bytes for bitwise joining. `lwlb`1 is missing because it
-    // already sits at its correct order position and does not need to be shifted
-    hwhb = hwhb << 24; // move the HWHB into the HWHB position
-    hwlb = hwlb << 16; // move the HWLB into the HWLB position
-    lwhb = lwhb << 8;  // move the LWHB into LWHB position
+// Count an execution of an opcode, and of the pair it makes with the opcode
+// executed before it
 
-    // join the bytes into a dword
-    data = hwhb | hwlb | lwhb | lwlb;
+static void profile_count(Profile *profile, byte opcode)
+{
+    profile->counts[opcode]++;
+    if (profile->last >= 0) {
+        profile->pairs[profile->last][opcode]++;
+    }
+    profile->last = opcode;
+}
 
-    // return it
-    return data;
+/**
+ * Writes an opcode profile to its file, most frequent first. A file whose
+ * name ends in `.json' gets a JSON object. Any other file gets text that
+ * vm_fusion_generate() reads: one opcode or opcode pair per line, followed by
+ * the number of times it was executed, with the conditional jumps in comments.
+ *
+ * Profile *profile: The opcode profile
+ *
+ * Returns nothing
+ */
+static void profile_write(Profile *profile)
+{
+    Sequence *sequences;
+    Sequence *s;
+    File *file;
+    size_t length;
+    bool json;
+    int count;
+    int pairs;
+    int a;
+    int b;
+    int i;
+
+    // gather the opcodes, then the pairs, each most frequent first
+    sequences = (Sequence*)emalloc((256 + 256 * 256) * sizeof(*sequences));
+    count = 0;
+    for (a = 0; a < 256; a++) {
+        if (profile->counts[a] > 0) {
+            s = &sequences[count++];
+            s->opcodes[0] = a;
+            s->length = 1;
+            s->count = profile->counts[a];
+        }
+    }
+    qsort(sequences, count, sizeof(*sequences), sequence_compare);
+    pairs = count;
+    for (a = 0; a < 256; a++) {
+        for (b = 0; b < 256; b++) {
+            if (profile->pairs[a][b] > 0) {
+                s = &sequences[count++];
+                s->opcodes[0] = a;
+                s->opcodes[1] = b;
+                s->length = 2;
+                s->count = profile->pairs[a][b];
+            }
+        }
+    }
+    qsort(&sequences[pairs], count - pairs, sizeof(*sequences), sequence_compare);
+
+    length = strlen(profile->name);
+    json = length >= 5 && strcmp(profile->name + length - 5, ".json") == 0;
+    file = file_open(profile->name, "wb");
+    if (json) {
+        fprintf(file->handle, "{\n  \"opcodes\": {");
+        for (i = 0; i < pairs; i++) {
+            s = &sequences[i];
+            fprintf(file->handle, "%s\n    \"%s\": %lu", i > 0 ? "," : "", opcode_names[s->opcodes[0]], s->count);
+        }
+        fprintf(file->handle, "\n  },\n  \"pairs\": [");
+        for (i = pairs; i < count; i++) {
+            s = &sequences[i];
+            fprintf(file->handle, "%s\n    [\"%s\", \"%s\", %lu]", i > pairs ? "," : "", opcode_names[s->opcodes[0]], opcode_names[s->opcodes[1]], s->count);
+        }
+        fprintf(file->handle, "\n  ],\n  \"branches\": {");
+        b = 0;
+        for (a = 0; a < 256; a++) {
+            if (is_conditional(a) && profile->counts[a] > 0) {
+                fprintf(file->handle, "%s\n    \"%s\": {\"taken\": %lu, \"not_taken\": %lu}", b++ > 0 ? "," : "", opcode_names[a], profile->taken[a], profile->counts[a] - profile->taken[a]);
+            }
+        }
+        fprintf(file->handle, "\n  }\n}\n");
+    }
+    else {
+        fprintf(file->handle, "# Opcode profile: opcodes and opcode pairs by the number of times they\n");
+        fprintf(file->handle, "# were executed. Conditional jumps by the number of times they jumped.\n");
+        for (a = 0; a < 256; a++) {
+            if (is_conditional(a) && profile->counts[a] > 0) {
+                fprintf(file->handle, "# %s taken %lu not-taken %lu\n", opcode_names[a], profile->taken[a], profile->counts[a] - profile->taken[a]);
+            }
+        }
+        for (i = 0; i < count; i++) {
+            s = &sequences[i];
+            if (s->length == 1) {
+                fprintf(file->handle, "%s %lu\n", opcode_names[s->opcodes[0]], s->count);
+            }
+            else {
+                fprintf(file->handle, "%s %s %lu\n", opcode_names[s->opcodes[0]], opcode_names[s->opcodes[1]], s->count);
+            }
+        }
+    }
+    file_close(file);
+    free(sequences);
+}
+
+// Returns TRUE if the given opcode is a conditional jump
+
+static bool is_conditional(byte opcode)
+{
+    return opcode == OC_JZ || opcode == OC_JNZ || opcode == OC_JE || opcode == OC_JNE;
+}
+
+// Returns TRUE if the given opcode may transfer control somewhere other than
+// the next instruction
+
+static bool is_transfer(byte opcode)
+{
+    switch (opcode) {
+        case OC_JMP:
+        case OC_JZ:
+        case OC_JNZ:
+        case OC_JE:
+        case OC_JNE:
+        case OC_CALL:
+        case OC_RET:
+        case OC_HALT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns TRUE if the given opcode may only be the last of a fused sequence.
+// Fused handlers run the later instructions of a sequence from their cached
+// decodings, so no earlier instruction may leave the sequence, nor write to
+// memory, which may hold the instructions after it.
+
+static bool is_sequence_end(byte opcode)
+{
+    switch (opcode) {
+        case OC_PULLBI:
+        case OC_PULLWI:
+        case OC_PULLDI:
+            return true;
+        default:
+            return is_transfer(opcode);
+    }
+}
+
+// Returns the opcode with the given name, or -1 if there is none
+
+static int opcode_lookup(const char *name)
+{
+    static KeywordTable opcodes;
+    static bool opcodes_ready;
+
+    if (!opcodes_ready) {
+        keyword_table_init(&opcodes, opcode_keywords, sizeof(opcode_keywords) / sizeof(opcode_keywords[0]));
+        opcodes_ready = true;
+    }
+    return keyword_lookup(&opcodes, name, strlen(name));
+}
+
+// Orders sequences from the most to the least frequent
+
+static int sequence_compare(const void *a, const void *b)
+{
+    const Sequence *x = a;
+    const Sequence *y = b;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return y->length - x->length;
 }
 
 //==============================================================================
-// Expression stack operations
+// Memory operations
 //==============================================================================
 
-/*
-static void es_pushb()
+// Gives a machine fresh memory. Where the host allows it, the memory is mapped
+// as untouched zero pages, so it costs nothing until the program uses it.
+
+static void mem_alloc(Vm *vm)
 {
+    vm->clean = true;
+#if defined(VM_MMAP)
+    vm->mem = (byte*)mmap(NULL, MEMORY_ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm->mem != MAP_FAILED) {
+        vm->mapped = true;
+        return;
+    }
+#endif
+    vm->mem = (byte*)calloc(MEMORY_ALLOC_SIZE, 1);
+    if (vm->mem == NULL) {
+        fail("Unable to allocate memory");
+    }
+    vm->mapped = false;
+}
 
+static void mem_release(Vm *vm)
+{
+#if defined(VM_MMAP)
+    if (vm->mapped) {
+        munmap(vm->mem, MEMORY_ALLOC_SIZE);
+        vm->mem = NULL;
+        return;
+    }
+#endif
+    free(vm->mem);
+    vm->mem = NULL;
 }
 
-static byte es_pullb()
+// Gives a machine the memory of a snapshot. A memfd snapshot is mapped
+// privately, so pages are only copied when the machine writes to them.
+
+static void mem_map(Vm *vm, VmSnapshot *snapshot)
 {
+    vm->clean = false;
+#if defined(VM_MMAP)
+    if (snapshot->fd >= 0) {
+        vm->mem = (byte*)mmap(NULL, MEMORY_ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, snapshot->fd, 0);
+        if (vm->mem == MAP_FAILED) {
+            fail("Unable to map memory snapshot");
+        }
+        vm->mapped = true;
+        return;
+    }
+#endif
+    vm->mem = (byte*)emalloc(MEMORY_ALLOC_SIZE);
+    memcpy(vm->mem, snapshot->mem, MEMORY_ALLOC_SIZE);
+    vm->mapped = false;
+}
 
+// Guest addresses are 22 bits wide and are wrapped into memory with
+// ADDRESS_MASK, so the accessors need no range checks. The MEMORY_PAD bytes
+// past the end of memory let a word or dword access at the top of memory
+// use a single unaligned load or store. The guest is big-endian, so the
+// value is byte-swapped on little-endian hosts.
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define host_to_bew(x) __builtin_bswap16(x)
+#define host_to_bed(x) __builtin_bswap32(x)
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define host_to_bew(x) (x)
+#define host_to_bed(x) (x)
+#else
+#define MEMORY_BYTEWISE // unknown host byte order; assemble values a byte at a time
+#endif
+
+/**
+ * Writes a byte of data to memory
+ *
+ * byte  data: The data to write
+ * dword addr: The address to write to
+ *
+ * Returns nothing
+ */
+static void mem_writeb(Vm *vm, dword addr, byte data)
+{
+    addr &= ADDRESS_MASK;
+
+    // writes into the code segment invalidate decoded code
+    if (addr <= CODE_SEGMENT_END) {
+        code_invalidate(vm, addr, BYTE);
+    }
+
+    vm->mem[addr] = data;
 }
 
-static es_pushw()
+/**
+ * Reads a byte of data from memory and returns it
+ */
+static byte mem_readb(Vm *vm, dword addr)
 {
+    return vm->mem[addr & ADDRESS_MASK];
+}
 
+static void mem_writew(Vm *vm, dword addr, word data)
+{
+    addr &= ADDRESS_MASK;
+
+    // writes into the code segment invalidate decoded code
+    if (addr <= CODE_SEGMENT_END) {
+        code_invalidate(vm, addr, WORD);
+    }
+
+#ifdef MEMORY_BYTEWISE
+    vm->mem[addr]   = (data >> 8) & 0xff;
+    vm->mem[addr+1] = data & 0xff;
+#else
+    data = host_to_bew(data);
+    memcpy(&vm->mem[addr], &data, WORD);
+#endif
 }
 
-static es_pullw()
+static word mem_readw(Vm *vm, dword addr)
 {
+    addr &= ADDRESS_MASK;
+
+#ifdef MEMORY_BYTEWISE
+    return ((word)vm->mem[addr] << 8) | (word)vm->mem[addr+1];
+#else
+    word data;
 
+    memcpy(&data, &vm->mem[addr], WORD);
+    return host_to_bew(data);
+#endif
 }
 
-static es_pushd()
+static void mem_writed(Vm *vm, dword addr, dword data)
 {
+    addr &= ADDRESS_MASK;
 
+    // writes into the code segment invalidate decoded code
+    if (addr <= CODE_SEGMENT_END) {
+        code_invalidate(vm, addr, DWORD);
+    }
+
+#ifdef MEMORY_BYTEWISE
+    vm->mem[addr]   = (data >> 24) & 0xff;
+    vm->mem[addr+1] = (data >> 16) & 0xff;
+    vm->mem[addr+2] = (data >> 8) & 0xff;
+    vm->mem[addr+3] = data & 0xff;
+#else
+    data = host_to_bed(data);
+    memcpy(&vm->mem[addr], &data, DWORD);
+#endif
 }
 
-static es_pulld()
+static dword mem_readd(Vm *vm, dword addr)
 {
+    addr &= ADDRESS_MASK;
+
+#ifdef MEMORY_BYTEWISE
+    return ((dword)vm->mem[addr] << 24) | ((dword)vm->mem[addr+1] << 16)
+         | ((dword)vm->mem[addr+2] << 8) | (dword)vm->mem[addr+3];
+#else
+    dword data;
 
+    memcpy(&data, &vm->mem[addr], DWORD);
+    return host_to_bed(data);
+#endif
 }
 
-static toes_setb(byte data)
+/**
+ * Writes a byte, word or dword of data to memory
+ *
+ * dword size: The size of the data (BYTE, WORD or DWORD)
+ * dword addr: The address to write to
+ * dword data: The data to write
+ *
+ * Returns nothing
+ */
+static void mem_write(Vm *vm, dword size, dword addr, dword data)
 {
+    switch (size) {
+        case BYTE:
+            mem_writeb(vm, addr, data);
+            break;
+        case WORD:
+            mem_writew(vm, addr, data);
+            break;
+        default:
+            mem_writed(vm, addr, data);
+            break;
+    }
+}
 
+/**
+ * Reads a byte, word or dword of data from memory and returns it
+ */
+static dword mem_read(Vm *vm, dword size, dword addr)
+{
+    switch (size) {
+        case BYTE:
+            return mem_readb(vm, addr);
+        case WORD:
+            return mem_readw(vm, addr);
+        default:
+            return mem_readd(vm, addr);
+    }
 }
 
-static byte toes_getb()
+/**
+ * Reads guest memory on behalf of an instruction. Cached stack items are
+ * spilled first if the read may see the expression stack.
+ */
+static dword mem_load(Vm *vm, dword size, dword addr)
 {
+    addr &= ADDRESS_MASK;
+    if (vm->stack_cached > 0 && addr + size > EXPR_STACK_SEGMENT_START && addr <= EXPR_STACK_SEGMENT_END) {
+        es_spill(vm);
+    }
+    return mem_read(vm, size, addr);
+}
+
+/**
+ * Writes guest memory on behalf of an instruction. Cached stack items are
+ * spilled first if the write may land on the expression stack.
+ */
+static void mem_store(Vm *vm, dword size, dword addr, dword data)
+{
+    addr &= ADDRESS_MASK;
+    if (vm->stack_cached > 0 && addr + size > EXPR_STACK_SEGMENT_START && addr <= EXPR_STACK_SEGMENT_END) {
+        es_spill(vm);
+    }
+    mem_write(vm, size, addr, data);
+}
+
+/**
+ * Maps part of a file over machine memory. The mapping is private, so a
+ * program that writes to the memory gets its own copy of the page, and pages
+ * the program never reaches are never read. The offset, the address and the
+ * length must be whole host pages; bytes past the end of the file read as
+ * zeroes.
+ *
+ * Returns TRUE if the file was mapped, or FALSE if it has to be read instead
+ */
+static bool mem_map_file(Vm *vm, File *file, long int offset, dword addr, long int length)
+{
+#if defined(VM_MMAP)
+    long int page; // the host page size
+    void *mem;
+
+    // the machine memory has to be a mapping of its own to map over
+    if (!vm->mapped || length <= 0) {
+        return false;
+    }
+    page = sysconf(_SC_PAGESIZE);
+    if (page <= 0 || offset % page != 0 || addr % page != 0 || length % page != 0) {
+        return false;
+    }
+    mem = mmap(vm->mem + addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(file->handle), offset);
+    return mem != MAP_FAILED;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Loads a raw image of the code segment
+ *
+ * Returns VM_OK, or VM_FAULT if the image cannot be loaded
+ */
+static int load_image(Vm *vm, File *file)
+{
+    long int filesize;
+    size_t bytes_read;
+#if defined(VM_MMAP)
+    struct stat status;
+    long int page;
+#endif
+
+#if defined(VM_MMAP)
+    // the size of a regular file is known without seeking
+    if (fstat(fileno(file->handle), &status) == 0 && S_ISREG(status.st_mode)) {
+        filesize = status.st_size;
+    }
+    else {
+        filesize = file_size(file);
+    }
+#else
+    filesize = file_size(file);
+#endif
+    if (filesize < 0) {
+        snprintf(vm->error, sizeof(vm->error), "Unable to get the size of the object file");
+        return VM_FAULT;
+    }
+    if (filesize > CODE_SEGMENT_SIZE) {
+        snprintf(vm->error, sizeof(vm->error), "Object file size (%ldB) exceeds VM code segment size of %dB", filesize, CODE_SEGMENT_SIZE);
+        return VM_FAULT;
+    }
+    vm->clean = false;
+    vm->code_size = filesize;
+
+#if defined(VM_MMAP)
+    // the bytes past the end of the file up to the end of its last page read
+    // as zeroes, just like the rest of the code segment
+    page = sysconf(_SC_PAGESIZE);
+    if (page > 0 && CODE_SEGMENT_SIZE % page == 0 && mem_map_file(vm, file, 0, CODE_SEGMENT_START, (filesize + page - 1) / page * page)) {
+        return VM_OK;
+    }
+#endif
+
+    file_reset(file);
+    bytes_read = fread((char*)vm->mem, 1, filesize, file->handle);
+    if (bytes_read != (size_t)filesize) {
+        snprintf(vm->error, sizeof(vm->error), "Unable to read entire file. Read %lu bytes of file containing %ld bytes", (unsigned long)bytes_read, filesize);
+        return VM_FAULT;
+    }
+    return VM_OK;
+}
+
+/**
+ * Loads the sections of an object file whose header has been read
+ *
+ * Returns VM_OK, or VM_FAULT if the file cannot be loaded
+ */
+static int load_object(Vm *vm, File *file, Object *object)
+{
+    Section *section;
+    const char *name;
+    unsigned long code_end; // the end of the sections loaded into the code segment
+    int i;
+
+    if (object->version != OBJECT_VERSION) {
+        snprintf(vm->error, sizeof(vm->error), "Unsupported object file version %u", object->version);
+        return VM_FAULT;
+    }
+    if (object->flags & OBJECT_RELOCATABLE) {
+        snprintf(vm->error, sizeof(vm->error), "Relocatable machine code must be linked before it is run");
+        return VM_FAULT;
+    }
+    if (object->entry > CODE_SEGMENT_END) {
+        snprintf(vm->error, sizeof(vm->error), "Entry point (%06lx) lies outside the code segment", object->entry);
+        return VM_FAULT;
+    }
+    vm->clean = false;
+    vm->code_size = 0;
+    code_end = 0;
+
+    for (i = 0; i < object->section_count; i++) {
+        section = &object->sections[i];
+        name = object_section_name(section->type);
+        switch (section->type) {
+            case SECTION_CODE:
+            case SECTION_DATA:
+            case SECTION_BSS:
+                if (section->filesize > section->size || section->address + section->size > (section->type == SECTION_CODE ? CODE_SEGMENT_SIZE : MEMORY_SIZE)) {
+                    snprintf(vm->error, sizeof(vm->error), "The %s section at %06lx (%luB) does not fit in its segment", name, section->address, section->size);
+                    return VM_FAULT;
+                }
+                // memory is all zeroes, which is all a bss section asks for
+                if (section->filesize > 0 && !load_section(vm, file, section)) {
+                    snprintf(vm->error, sizeof(vm->error), "Unable to read the %s section", name);
+                    return VM_FAULT;
+                }
+                // the code size is never negative here; it starts at zero
+                if (section->type == SECTION_CODE && section->address + section->size > (unsigned long)vm->code_size) {
+                    vm->code_size = section->address + section->size;
+                }
+                if (section->address + section->size <= CODE_SEGMENT_SIZE && section->address + section->size > code_end) {
+                    code_end = section->address + section->size;
+                }
+                break;
+            case SECTION_DECODED:
+                if (!load_decoded(vm, file, section)) {
+                    snprintf(vm->error, sizeof(vm->error), "Malformed %s section", name);
+                    return VM_FAULT;
+                }
+                break;
+            default:
+                // sections the machine does not know are not its business
+                break;
+        }
+    }
+    if (!check_decoded(vm, code_end)) {
+        snprintf(vm->error, sizeof(vm->error), "Malformed %s section", object_section_name(SECTION_DECODED));
+        return VM_FAULT;
+    }
+    vm->pc = object->entry;
+    return VM_OK;
+}
+
+/**
+ * Loads the contents of a section into memory. The whole pages of the
+ * section are mapped where the host allows it, and the rest is read.
+ *
+ * Returns FALSE if the section cannot be read
+ */
+static bool load_section(Vm *vm, File *file, Section *section)
+{
+    unsigned long mapped; // the number of bytes mapped
+#if defined(VM_MMAP)
+    long int page;
+#endif
+
+    mapped = 0;
+#if defined(VM_MMAP)
+    page = sysconf(_SC_PAGESIZE);
+    if (page > 0 && mem_map_file(vm, file, section->offset, section->address, section->filesize / page * page)) {
+        mapped = section->filesize / page * page;
+    }
+#endif
+    if (mapped == section->filesize) {
+        return true;
+    }
+    if (fseek(file->handle, section->offset + mapped, SEEK_SET) != 0) {
+        return false;
+    }
+    return fread(vm->mem + section->address + mapped, 1, section->filesize - mapped, file->handle) == section->filesize - mapped;
+}
+
+/**
+ * Reads the pre-decoded instructions of an object file, for the next run to
+ * put into its tables
+ *
+ * Returns FALSE if the section is malformed
+ */
+static bool load_decoded(Vm *vm, File *file, Section *section)
+{
+    if (section->filesize % OBJECT_DECODED_SIZE != 0 || section->filesize / OBJECT_DECODED_SIZE > CODE_SEGMENT_SIZE) {
+        return false;
+    }
+    if (section->filesize == 0) {
+        return true;
+    }
+    if (fseek(file->handle, section->offset, SEEK_SET) != 0) {
+        return false;
+    }
+    free(vm->predecoded);
+    vm->predecoded = (byte*)emalloc(section->filesize);
+    vm->predecoded_count = 0;
+    if (fread(vm->predecoded, section->filesize, 1, file->handle) != 1) {
+        return false;
+    }
+    vm->predecoded_count = section->filesize / OBJECT_DECODED_SIZE;
+    return true;
+}
+
+/**
+ * Checks the pre-decoded instructions loaded with the code. The engines
+ * trust them, so each one must decode to a known instruction that lies in the
+ * code segment below the given end of the loaded sections, and must be
+ * followed by an instruction after it.
+ *
+ * Returns FALSE if an instruction does not check out
+ */
+static bool check_decoded(Vm *vm, unsigned long code_end)
+{
+    const byte *record;
+    dword addr;
+    dword next;
+    dword i;
+
+    for (i = 0; i < vm->predecoded_count; i++) {
+        record = vm->predecoded + i * OBJECT_DECODED_SIZE;
+        addr = object_get(record, 4);
+        next = object_get(record + 12, 4);
+        if (next <= addr || next > code_end) {
+            return false;
+        }
+        if (opcode_names[record[4]] == NULL || record[5] > OPERAND_SIZE_DWORD) {
+            return false;
+        }
+        if (record[6] != ADDRESSING_MODE_IMMEDIATE && record[6] != ADDRESSING_MODE_DIRECT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//==============================================================================
+// Expression stack operations
+//==============================================================================
+
+// The expression stack grows down from the end of its segment. The EP points
+// at the first byte of the item at TOES.
+
+/**
+ * Pushes data of the given size to TOES
+ */
+static void es_push(Vm *vm, dword size, dword data)
+{
+    if (vm->ep - size < EXPR_STACK_SEGMENT_START) {
+        vm_fail(vm, "vm: expression stack overflow");
+    }
+    vm->ep -= size;
+
+    if (!vm->stack_caching) {
+        mem_write(vm, size, vm->ep, data);
+        return;
+    }
+
+    // make room by spilling SOES; it sits below the old TOES
+    if (vm->stack_cached == STACK_CACHE_SIZE) {
+        mem_write(vm, vm->stack_cache[1].size, vm->ep + size + vm->stack_cache[0].size, vm->stack_cache[1].data);
+        vm->stack_cached--;
+    }
+    if (vm->stack_cached > 0) {
+        vm->stack_cache[1] = vm->stack_cache[0];
+    }
+    vm->stack_cache[0].data = data & size_mask(size);
+    vm->stack_cache[0].size = size;
+    vm->stack_cached++;
+}
+
+/**
+ * Pulls data of the given size from TOES and returns it
+ */
+static dword es_pull(Vm *vm, dword size)
+{
+    dword data;
+
+    if (vm->ep + size > EXPR_STACK_SEGMENT_END) {
+        vm_fail(vm, "vm: expression stack underflow");
+    }
+
+    if (vm->stack_cached > 0 && vm->stack_cache[0].size == size) {
+        data = vm->stack_cache[0].data;
+        vm->stack_cache[0] = vm->stack_cache[1];
+        vm->stack_cached--;
+    }
+    else {
+        es_spill(vm);
+        data = mem_read(vm, size, vm->ep);
+    }
+    vm->ep += size;
+    return data;
+}
+
+/**
+ * Reads the item of the given size that sits the given number of bytes below
+ * TOES, without pulling it
+ */
+static dword es_read(Vm *vm, dword size, dword offset)
+{
+    if (vm->ep + offset + size > EXPR_STACK_SEGMENT_END) {
+        vm_fail(vm, "vm: expression stack underflow");
+    }
 
+    if (vm->stack_cached > 0 && offset == 0 && vm->stack_cache[0].size == size) {
+        return vm->stack_cache[0].data;
+    }
+    if (vm->stack_cached > 1 && offset == vm->stack_cache[0].size && vm->stack_cache[1].size == size) {
+        return vm->stack_cache[1].data;
+    }
+    es_spill(vm);
+    return mem_read(vm, size, vm->ep + offset);
 }
 
-static toes_setw(word data)
+/**
+ * Overwrites the item of the given size that sits the given number of bytes
+ * below TOES
+ */
+static void es_write(Vm *vm, dword size, dword offset, dword data)
 {
+    if (vm->ep + offset + size > EXPR_STACK_SEGMENT_END) {
+        vm_fail(vm, "vm: expression stack underflow");
+    }
 
+    if (vm->stack_cached > 0 && offset == 0 && vm->stack_cache[0].size == size) {
+        vm->stack_cache[0].data = data & size_mask(size);
+        return;
+    }
+    if (vm->stack_cached > 1 && offset == vm->stack_cache[0].size && vm->stack_cache[1].size == size) {
+        vm->stack_cache[1].data = data & size_mask(size);
+        return;
+    }
+    es_spill(vm);
+    mem_write(vm, size, vm->ep + offset, data);
 }
 
-static word toes_getw()
+/**
+ * Writes the cached stack items to memory, so that memory holds the whole
+ * expression stack
+ */
+static void es_spill(Vm *vm)
 {
+    if (vm->stack_cached > 0) {
+        mem_write(vm, vm->stack_cache[0].size, vm->ep, vm->stack_cache[0].data);
+    }
+    if (vm->stack_cached > 1) {
+        mem_write(vm, vm->stack_cache[1].size, vm->ep + vm->stack_cache[0].size, vm->stack_cache[1].data);
+    }
+    vm->stack_cached = 0;
+}
+
+/**
+ * Moves the item at the given depth to TOES. The items above it move one
+ * place down. Depth 0 is TOES.
+ */
+static void es_roll(Vm *vm, dword size, dword depth)
+{
+    dword data;
+    dword i;
 
+    data = es_read(vm, size, depth * size);
+    for (i = depth; i > 0; i--) {
+        es_write(vm, size, i * size, es_read(vm, size, (i - 1) * size));
+    }
+    es_write(vm, size, 0, data);
 }
 
-static toes_setd(dword data)
+/**
+ * Moves the item at TOES down to the given depth. The items below it move one
+ * place up. This undoes es_roll().
+ */
+static void es_rollc(Vm *vm, dword size, dword depth)
 {
+    dword data;
+    dword i;
 
+    data = es_read(vm, size, 0);
+    for (i = 0; i < depth; i++) {
+        es_write(vm, size, i * size, es_read(vm, size, (i + 1) * size));
+    }
+    es_write(vm, size, depth * size, data);
 }
 
-static dword toes_getd()
+/**
+ * Pulls TOES and SOES, applies the given operation to them and pushes the
+ * result. SOES is the left operand.
+ */
+static void es_alu(Vm *vm, AluOp op, dword size)
 {
+    dword a;
+    dword b;
 
-}*/
+    b = es_pull(vm, size);
+    a = es_pull(vm, size);
+    es_push(vm, size, alu(vm, op, size, a, b));
+}
+
+/**
+ * Replaces TOES with its bitwise NOT
+ */
+static void es_not(Vm *vm, dword size)
+{
+    dword data;
+
+    data = ~es_read(vm, size, 0);
+    set_flags(vm, size, data);
+    vm->sv = vm->sc = false;
+    es_write(vm, size, 0, data);
+}
+
+//==============================================================================
+// Call stack operations
+//==============================================================================
+
+// The call stack grows down from the end of its segment, like the expression
+// stack. It stores return addresses as dwords.
+
+static void cs_push(Vm *vm, dword data)
+{
+    if (vm->cp - DWORD < CALL_STACK_SEGMENT_START) {
+        vm_fail(vm, "vm: call stack overflow");
+    }
+    vm->cp -= DWORD;
+    mem_writed(vm, vm->cp, data);
+}
+
+static dword cs_pull(Vm *vm)
+{
+    dword data;
+
+    if (vm->cp + DWORD > CALL_STACK_SEGMENT_END) {
+        vm_fail(vm, "vm: call stack underflow");
+    }
+    data = mem_readd(vm, vm->cp);
+    vm->cp += DWORD;
+    return data;
+}
+
+// Discards the given number of bytes from the call stack
+
+static void cs_drop(Vm *vm, dword size)
+{
+    if (vm->cp + size > CALL_STACK_SEGMENT_END) {
+        vm_fail(vm, "vm: call stack underflow");
+    }
+    vm->cp += size;
+}
+
+//==============================================================================
+// Arithmetic and logic
+//==============================================================================
+
+/**
+ * Applies an operation to two operands of the given size, updates the status
+ * flags and returns the result truncated to the size
+ */
+static dword alu(Vm *vm, AluOp op, dword size, dword a, dword b)
+{
+    unsigned long long mask;   // all bits of the operand size
+    unsigned long long result; // the result before it is truncated
+    dword sign;                // the sign bit of the operand size
+
+    mask = (1ULL << (size * 8)) - 1;
+    sign = 1U << (size * 8 - 1);
+    a &= mask;
+    b &= mask;
+    vm->sv = false;
+    vm->sc = false;
+
+    switch (op) {
+        case ALU_ADD:
+            result = (unsigned long long)a + b;
+            vm->sc = result > mask;
+            vm->sv = (~(a ^ b) & (a ^ result) & sign) != 0;
+            break;
+        case ALU_SUB:
+            result = (unsigned long long)a - b;
+            vm->sc = a < b;
+            vm->sv = ((a ^ b) & (a ^ result) & sign) != 0;
+            break;
+        case ALU_MUL:
+            result = (unsigned long long)a * b;
+            vm->sc = vm->sv = result > mask;
+            break;
+        case ALU_DIV:
+            if (b == 0) {
+                vm_fail(vm, "vm: division by zero");
+            }
+            result = a / b;
+            break;
+        case ALU_MOD:
+            if (b == 0) {
+                vm_fail(vm, "vm: division by zero");
+            }
+            result = a % b;
+            break;
+        case ALU_AND:
+            result = a & b;
+            break;
+        case ALU_OR:
+            result = a | b;
+            break;
+        case ALU_XOR:
+            result = a ^ b;
+            break;
+        case ALU_SHL:
+            result = b < size * 8 ? (unsigned long long)a << b : 0;
+            break;
+        default:
+            result = b < size * 8 ? a >> b : 0;
+            break;
+    }
+
+    result &= mask;
+    set_flags(vm, size, result);
+    return result;
+}
+
+// Returns the mask that covers all bits of the given size
+
+static dword size_mask(dword size)
+{
+    return size == DWORD ? 0xffffffff : (1U << (size * 8)) - 1;
+}
+
+// Updates the zero and negative flags for a result of the given size
+
+static void set_flags(Vm *vm, dword size, dword data)
+{
+    if (size != DWORD) {
+        data &= (1U << (size * 8)) - 1;
+    }
+    vm->sz = data == 0;
+    vm->sn = (data >> (size * 8 - 1)) & 1;
+}
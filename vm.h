@@ -2,10 +2,43 @@
 #define __PARTICLE_VM_H__
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include "file.h"
 
+// Execution engines
+#define VM_ENGINE_SWITCH   1 // fetch-decode-execute state machine
+#define VM_ENGINE_THREADED 2 // direct-threaded code (needs a GNU C compiler)
+
+// Machine status
+#define VM_OK    0 // the machine loaded or ran its program
+#define VM_FAULT 1 // the machine faulted; see vm_error()
+
+// A machine with its own memory and registers
+typedef struct Vm Vm;
+
+// The memory and registers of a machine, saved to start other machines from
+typedef struct VmSnapshot VmSnapshot;
+
+// Externally exposed
+extern int vm_engine;         // the execution engine of new machines
+extern bool vm_stack_caching; // keeps the top of the expression stack out of memory in new machines if TRUE
+extern char *vm_profile;      // the file new machines write an opcode profile to; NULL if they do not profile
+
 // Prototypes
 
-void execute(File *);
+Vm *vm_create();
+int vm_load(Vm *, File *);
+int vm_load_code(Vm *, const unsigned char *, long int, unsigned long);
+int vm_run(Vm *);
+unsigned long long vm_retired(Vm *);
+const char *vm_error(Vm *);
+void vm_destroy(Vm *);
+VmSnapshot *vm_snapshot(Vm *);
+Vm *vm_fork(VmSnapshot *);
+void vm_restore(Vm *, VmSnapshot *);
+void vm_snapshot_destroy(VmSnapshot *);
+unsigned long long execute(File *);
+unsigned long long execute_code(const unsigned char *, long int, unsigned long);
+void vm_fusion_generate(File *);
 
 #endif /* __PARTICLE_VM_H__ */